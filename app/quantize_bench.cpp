@@ -0,0 +1,299 @@
+// Benchmark suite for the quantization pipeline.
+// Every workload (the images shipped in images/ and synthetic images
+// with a controlled number of unique colours) is quantized for every
+// combination of k and thread count, several times over, and the
+// histogram, seeding, k-means (and every iteration), remap and encode
+// phases are timed separately. The results are written as CSV or JSON,
+// one record per workload, k, thread count and phase, so that runs of
+// different releases can be compared.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "../include/ra/quantization_tools.hpp"
+#include <opencv2/opencv.hpp>
+
+using namespace ra::quantization;
+using std::chrono::duration;
+using std::chrono::high_resolution_clock;
+
+void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "Options:\n"
+              << "  --images <dir>                     directory of images to benchmark, empty for none (default: images)\n"
+              << "  --synthetic <n,...>                unique colour counts of the synthetic images (default: 256,65536,1048576)\n"
+              << "  --size <rows>x<cols>               size of the synthetic images (default: 1024x1024)\n"
+              << "  --k <k,...>                        palette sizes (default: 4,16,64)\n"
+              << "  --threads <n,...>                  thread pool sizes (default: 1 and hardware concurrency)\n"
+              << "  --reps <uint>                      repetitions of every measurement (default: 5)\n"
+              << "  --engine <naive|hamerly|minibatch> k-means algorithm (default: naive)\n"
+              << "  --format <csv|json>                output format (default: csv)\n"
+              << "  --out <file>                       output file (default: standard output)\n";
+}
+
+// An image to benchmark, already converted to continuous RGBA
+struct workload {
+    std::string name;
+    Mat img;
+    std::vector<std::uint8_t> pixels; // owns the pixels of synthetic images
+};
+
+// The timings of every repetition of one phase
+struct phase_samples {
+    std::string phase;
+    std::vector<double> ms;
+};
+
+// Parses a comma separated list of positive integers; returns an empty list on error
+std::vector<long> parse_list(const std::string &arg) {
+    std::vector<long> values;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        long v = std::atol(item.c_str());
+        if (v < 1) {
+            return {};
+        }
+        values.push_back(v);
+    }
+    return values;
+}
+
+// Returns a rows x cols image with exactly n unique colours (n <= rows * cols), each drawn at
+// random, and each used by at least one pixel
+workload synthetic_workload(long n, int rows, int cols) {
+    workload w;
+    w.name = "synthetic_" + std::to_string(n);
+    std::mt19937 rng(n);
+    std::vector<std::uint32_t> colours;
+    std::unordered_set<std::uint32_t> seen;
+    while ((long) colours.size() < n) {
+        std::uint32_t c = rng() | 0xff000000u; // opaque
+        if (seen.insert(c).second) {
+            colours.push_back(c);
+        }
+    }
+    std::size_t pixels = std::size_t(rows) * cols;
+    w.pixels.resize(pixels * 4);
+    for (std::size_t i = 0; i < pixels; i++) {
+        std::uint32_t c = i < colours.size() ? colours[i] : colours[rng() % colours.size()];
+        for (int ch = 0; ch < 4; ch++) {
+            w.pixels[i * 4 + ch] = colour_channel(c, ch);
+        }
+    }
+    w.img = Mat(rows, cols, CV_8UC4, w.pixels.data());
+    return w;
+}
+
+// Returns the value at percentile p (0 to 100) of sorted, by the nearest-rank method
+double percentile(const std::vector<double> &sorted, double p) {
+    std::size_t rank = std::size_t(std::ceil(p / 100 * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+// Times every phase of quantizing w into k colours on tp, reps times
+std::vector<phase_samples> run_workload(thread_pool &tp, const workload &w, int k, int reps, const quantize_options &options, std::size_t &unique) {
+    std::vector<phase_samples> samples = {{"histogram", {}}, {"seeding", {}}, {"kmeans", {}}, {"iteration", {}}, {"remap", {}}, {"encode", {}}, {"total", {}}};
+    Mat out(w.img.rows, w.img.cols, CV_8UC4);
+    std::vector<unsigned char> png;
+    stats_recorder recorder; // times every k-means iteration
+    for (int r = 0; r < reps; r++) {
+        auto t0 = high_resolution_clock::now();
+        colour_histogram unique_colours = build_histogram(tp, w.img.data, w.img.rows, w.img.cols);
+        auto t1 = high_resolution_clock::now();
+        if ((ul) k > unique_colours.size()) {
+            throw std::invalid_argument("k exceeds the number of unique colours");
+        }
+        std::vector<Pixel> seeds;
+        init_cluster_centers(tp, unique_colours, seeds, k, options);
+        auto t2 = high_resolution_clock::now();
+        quantize_options seeded = options;
+        seeded.observer = &recorder;
+        for (const Pixel &c : seeds) {
+            seeded.initial_palette.push_back(pack_colour(get<0>(c), get<1>(c), get<2>(c), get<3>(c)));
+        }
+        clustering result = cluster_colours(tp, unique_colours, k, seeded);
+        auto t3 = high_resolution_clock::now();
+        remap_table table(tp, unique_colours, result.assignment.data());
+        remap_image(tp, table, result.palette, w.img.data, out.data, w.img.rows, w.img.cols);
+        auto t4 = high_resolution_clock::now();
+        imencode(".png", out, png);
+        auto t5 = high_resolution_clock::now();
+
+        unique = unique_colours.size();
+        samples[0].ms.push_back(duration<double, std::milli>(t1 - t0).count());
+        samples[1].ms.push_back(duration<double, std::milli>(t2 - t1).count());
+        samples[2].ms.push_back(duration<double, std::milli>(t3 - t2).count());
+        samples[4].ms.push_back(duration<double, std::milli>(t4 - t3).count());
+        samples[5].ms.push_back(duration<double, std::milli>(t5 - t4).count());
+        samples[6].ms.push_back(duration<double, std::milli>(t5 - t0).count());
+    }
+    for (const quantize_stats &run : recorder.runs) {
+        samples[3].ms.insert(samples[3].ms.end(), run.iteration_ms.begin(), run.iteration_ms.end());
+    }
+    if (samples[3].ms.empty()) { // minibatch reports no iterations
+        samples.erase(samples.begin() + 3);
+    }
+    return samples;
+}
+
+int main(int argc, char *argv[]) {
+    std::string images_dir = "images";
+    std::vector<long> synthetic = {256, 65536, 1048576};
+    int rows = 1024;
+    int cols = 1024;
+    std::vector<long> ks = {4, 16, 64};
+    std::vector<long> threads = {1, std::max<long>(2, std::thread::hardware_concurrency())};
+    int reps = 5;
+    std::string format = "csv";
+    std::string out_path;
+    quantize_options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--images") {
+            images_dir = value;
+        } else if (arg == "--synthetic") {
+            synthetic = parse_list(value);
+        } else if (arg == "--size") {
+            if (sscanf(value.c_str(), "%dx%d", &rows, &cols) != 2 || rows < 1 || cols < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--k") {
+            ks = parse_list(value);
+        } else if (arg == "--threads") {
+            threads = parse_list(value);
+        } else if (arg == "--reps") {
+            reps = std::atoi(value.c_str());
+        } else if (arg == "--engine") {
+            if (value == "naive") {
+                options.engine = kmeans_engine::naive;
+            } else if (value == "hamerly") {
+                options.engine = kmeans_engine::hamerly;
+            } else if (value == "minibatch") {
+                options.engine = kmeans_engine::minibatch;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--format") {
+            format = value;
+        } else if (arg == "--out") {
+            out_path = value;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (ks.empty() || threads.empty() || reps < 1 || (format != "csv" && format != "json")) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<workload> workloads;
+    if (!images_dir.empty() && std::filesystem::is_directory(images_dir)) {
+        std::vector<std::string> paths;
+        for (const auto &e : std::filesystem::directory_iterator(images_dir)) {
+            if (e.is_regular_file() && e.path().stem().string().find("_quantized_") == std::string::npos) {
+                paths.push_back(e.path().string());
+            }
+        }
+        std::sort(paths.begin(), paths.end());
+        for (const std::string &path : paths) {
+            Mat img = imread(path, IMREAD_UNCHANGED);
+            if (img.empty()) {
+                continue;
+            }
+            workload w;
+            w.name = std::filesystem::path(path).filename().string();
+            w.img = Mat(img.rows, img.cols, CV_8UC4);
+            try {
+                mat_tile_source(img).read(tile_rect{0, 0, img.rows, img.cols}, w.img.data);
+            } catch (const std::exception &e) {
+                std::cerr << path << ": " << e.what() << std::endl;
+                continue;
+            }
+            workloads.push_back(std::move(w));
+        }
+    }
+    for (long n : synthetic) {
+        if (n > long(rows) * cols) {
+            std::cerr << "skipping " << n << " unique colours: more than " << rows << "x" << cols << " pixels" << std::endl;
+            continue;
+        }
+        workloads.push_back(synthetic_workload(n, rows, cols));
+    }
+
+    std::ofstream file;
+    if (!out_path.empty()) {
+        file.open(out_path);
+        if (!file) {
+            std::cerr << "cannot create " << out_path << std::endl;
+            return 1;
+        }
+    }
+    std::ostream &out = out_path.empty() ? std::cout : file;
+    if (format == "csv") {
+        out << "workload,rows,cols,unique_colours,k,threads,phase,samples,min_ms,mean_ms,p50_ms,p90_ms,p99_ms,max_ms\n";
+    } else {
+        out << "{\"results\": [";
+    }
+
+    bool first = true;
+    for (const workload &w : workloads) {
+        for (long t : threads) {
+            thread_pool tp(t);
+            for (long k : ks) {
+                std::size_t unique = 0;
+                std::vector<phase_samples> samples;
+                try {
+                    samples = run_workload(tp, w, k, reps, options, unique);
+                } catch (const std::exception &e) {
+                    std::cerr << w.name << ", k " << k << ": " << e.what() << std::endl;
+                    continue;
+                }
+                for (phase_samples &s : samples) {
+                    std::sort(s.ms.begin(), s.ms.end());
+                    double mean = 0;
+                    for (double ms : s.ms) {
+                        mean += ms / s.ms.size();
+                    }
+                    if (format == "csv") {
+                        out << w.name << ',' << w.img.rows << ',' << w.img.cols << ',' << unique << ',' << k << ',' << t << ',' << s.phase << ','
+                            << s.ms.size() << ',' << s.ms.front() << ',' << mean << ',' << percentile(s.ms, 50) << ',' << percentile(s.ms, 90) << ','
+                            << percentile(s.ms, 99) << ',' << s.ms.back() << '\n';
+                    } else {
+                        out << (first ? "\n" : ",\n") << "  {\"workload\": \"" << w.name << "\", \"rows\": " << w.img.rows << ", \"cols\": " << w.img.cols
+                            << ", \"unique_colours\": " << unique << ", \"k\": " << k << ", \"threads\": " << t << ", \"phase\": \"" << s.phase
+                            << "\", \"samples\": " << s.ms.size() << ", \"min_ms\": " << s.ms.front() << ", \"mean_ms\": " << mean
+                            << ", \"p50_ms\": " << percentile(s.ms, 50) << ", \"p90_ms\": " << percentile(s.ms, 90)
+                            << ", \"p99_ms\": " << percentile(s.ms, 99) << ", \"max_ms\": " << s.ms.back() << "}";
+                    }
+                    first = false;
+                }
+                out.flush();
+            }
+        }
+    }
+    if (format == "json") {
+        out << "\n]}\n";
+    }
+    return 0;
+}
@@ -2,12 +2,32 @@
 // V00810568
 // SENG475 - K_Means Quantization Project
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <chrono>
 #include <complex>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <thread>
+#include <vector>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "../include/ra/indexed_png.hpp"
 #include "../include/ra/quantization_tools.hpp"
+#include "../include/ra/raw_image.hpp"
 #include <opencv2/opencv.hpp>
 #include <filesystem>
 
@@ -19,13 +39,878 @@ using std::chrono::duration_cast;
 using std::chrono::high_resolution_clock;
 using std::chrono::milliseconds;
 
+void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " <image_path> <uint_k> [options]\n"
+              << "       " << prog << " --serve <socket_path> [--jobs <uint>] [--queue <uint>] [engine options]\n"
+              << "Options:\n"
+              << "  --engine <naive|hamerly|minibatch> k-means algorithm (default: naive)\n"
+              << "  --seeding <auto|kmeans++|kmeans||> initial center selection (default: auto)\n"
+              << "  --seed <uint>                      random seed for seeding and sampling (default: 0)\n"
+              << "  --iterations <uint>                maximum k-means iterations / minibatch batches (default: 300)\n"
+              << "  --batch-size <uint>                pixels sampled per minibatch batch (default: 1024)\n"
+              << "  --tile <uint>                      stream the image in tiles of this many pixels square\n"
+              << "  --raw <rows>x<cols>                read the input as raw RGBA pixels and write raw RGBA output (implies --tile 1024)\n"
+              << "                                     (inputs in the headered raw format, see raw_image.hpp, are mapped and need no option)\n"
+              << "  --batch                            image_path is a directory of images or a file listing one image per line\n"
+              << "  --in-flight <uint>                 batch: images decoded but not yet written at any time (default: 4)\n"
+              << "  --io-threads <uint>                batch: threads decoding and threads encoding images (default: 2)\n"
+              << "  --save-palette <file>              write the palette found by clustering to file\n"
+              << "  --palette <file>                   skip clustering and map every pixel to the nearest colour of a saved palette of k colours\n"
+              << "  --warm-start <file>                start k-means from a saved palette of k colours instead of seeding\n"
+              << "  --sequence                         like --batch, but the images are frames quantized in order, each warm-started from the one before\n"
+              << "  --center-tolerance <float>         stop k-means once no center moves farther than this (default: 0, or 1 with --sequence)\n"
+              << "  --stats <file>                     write the statistics of every run as JSON to file (- for standard output)\n"
+              << "  --indexed                          write a palette PNG of pixel indices (k <= 256) instead of a full-colour image\n"
+              << "  --serve <socket_path>              serve jobs on a Unix domain socket, one per line: <image_path> <uint_k> [options]\n"
+              << "                                     (job options: --engine, --seeding, --seed, --iterations, --batch-size,\n"
+              << "                                     --center-tolerance, --palette, --indexed); each gets a JSON line in reply\n"
+              << "  --jobs <uint>                      serve: jobs quantized at the same time, on one shared pool (default: 1)\n"
+              << "  --queue <uint>                     serve: jobs waiting for a slot before clients are held back (default: 64)\n"
+              << "  --threads <uint>                   threads of the pool (default: one per CPU the process may use)\n"
+              << "  --affinity <placement>[:<cpus>]    pin the threads: none, compact (CPU by CPU), scatter (node by node) or numa (one\n"
+              << "                                     group per NUMA node), optionally on a CPU list such as 0-15,32-47; a CPU list\n"
+              << "                                     alone means compact (default: none)\n";
+}
+
+// Sets engine to the k-means engine called name; returns false if there is none
+bool engine_from_name(const std::string &name, kmeans_engine &engine) {
+    if (name == "naive") {
+        engine = kmeans_engine::naive;
+    } else if (name == "hamerly") {
+        engine = kmeans_engine::hamerly;
+    } else if (name == "minibatch") {
+        engine = kmeans_engine::minibatch;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Sets seeding to the seeding method called name; returns false if there is none
+bool seeding_from_name(const std::string &name, seeding_method &seeding) {
+    if (name == "auto") {
+        seeding = seeding_method::automatic;
+    } else if (name == "kmeans++") {
+        seeding = seeding_method::kmeans_pp;
+    } else if (name == "kmeans||") {
+        seeding = seeding_method::kmeans_parallel;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Sets pool to the placement described by spec: a placement name, a CPU list (pinned compact), or
+// both as <name>:<cpus>; returns false if spec is neither
+bool affinity_from_spec(const std::string &spec, pool_options &pool) {
+    std::size_t colon = spec.find(':');
+    std::string name = spec.substr(0, colon);
+    bool listed = colon != std::string::npos;
+    std::string cpus = listed ? spec.substr(colon + 1) : "";
+    if (name == "none") {
+        pool.placement = affinity::none;
+    } else if (name == "compact") {
+        pool.placement = affinity::compact;
+    } else if (name == "scatter") {
+        pool.placement = affinity::scatter;
+    } else if (name == "numa") {
+        pool.placement = affinity::numa;
+    } else if (!listed) {
+        pool.placement = affinity::compact;
+        listed = true;
+        cpus = spec;
+    } else {
+        return false;
+    }
+    try {
+        pool.cpus = parse_cpu_list(cpus);
+    } catch (const std::invalid_argument &) {
+        return false;
+    }
+    return !listed || !pool.cpus.empty(); // a CPU list must name some CPU
+}
+
+// One image moving through the batch pipeline
+struct batch_job {
+    std::string input;
+    std::string output;
+    Mat img; // decoded image
+    Mat out; // quantized image (the decoded one, quantized in place), or its palette indices
+    std::vector<std::uint32_t> palette; // with indexed output, the palette to write with out
+};
+
+// Returns the palette to store in a palette PNG: the packed colours of an 8-bit image as they are,
+// or the sample values of a 16-bit image as 8-bit greys
+std::vector<std::uint32_t> png_palette(const std::vector<std::uint32_t> &palette, bool samples) {
+    if (!samples) {
+        return palette;
+    }
+    std::vector<std::uint32_t> grey;
+    for (std::uint32_t v : palette) {
+        grey.push_back(pack_colour(v >> 8, v >> 8, v >> 8, 255));
+    }
+    return grey;
+}
+
+// Returns the output path for an input image and k
+std::string output_path_for(const std::string &input, const std::string &k, const std::string &extension) {
+    filesystem::path p(input);
+    return p.parent_path().string() + '/' + p.stem().string() + "_quantized_" + k + extension;
+}
+
+// Reads the image at path as a continuous 8-bit image with 1, 3 or 4 channels, which the library
+// quantizes in that layout. 16-bit greyscale is kept as is if keep_16bit is set, and scaled down to
+// 8 bits otherwise.
+// Throws std::runtime_error if it cannot be read or has an unsupported type.
+Mat read_image(const std::string &path, bool keep_16bit = true) {
+    Mat img = imread(path, IMREAD_UNCHANGED); // get the image regardless of num. channels (greyscale, colour, or col+alpha)
+    if (img.empty()) {
+        throw std::runtime_error("Could not read the image");
+    }
+    switch (img.type()) {
+        case CV_8UC1:
+        case CV_8UC3:
+        case CV_8UC4:
+            return img;
+        case CV_16UC1: { // typical of jp2 satellite files
+            if (keep_16bit) {
+                return img;
+            }
+            Mat grey;
+            img.convertTo(grey, CV_8U, 1.0 / 128);
+            return grey;
+        }
+        default:
+            throw std::runtime_error("unsupported image type " + std::to_string(img.type()));
+    }
+}
+
+// Quantize a headered raw image file (see raw_image.hpp) into a raw image file next to it. Both
+// are memory-mapped, so the pixels are read from and written to the files without decoding or
+// encoding. With indexed output, the file holds palette indices and the palette.
+// If palette is not empty, it is applied instead of clustering. Returns the palette. The output
+// file is removed again if the job fails.
+// Throws std::runtime_error if a file cannot be mapped, and as quantizer::quantize does.
+std::vector<std::uint32_t> quantize_raw_image(quantizer &q, const std::string &path, const std::string &k_arg, int k,
+                                              const std::vector<std::uint32_t> &palette, bool indexed) {
+    mapped_raw_image in(path);
+    if (!in.palette().empty()) {
+        throw std::runtime_error(path + " holds palette indices, not pixels");
+    }
+    std::string out_path = output_path_for(path, k_arg, ".raim");
+    mapped_raw_output out(out_path, in.rows(), in.cols(), indexed ? 1 : in.channels(), indexed ? 8 : in.bits(), indexed ? k : 0);
+    std::vector<std::uint32_t> result = palette;
+    try {
+        if (palette.empty()) {
+            result = indexed ? q.quantize_indexed(in.view(), out.view(), k) : q.quantize(in.view(), out.view(), k);
+        } else if (indexed) {
+            q.apply_indexed(in.view(), out.view(), palette);
+        } else {
+            q.apply(in.view(), out.view(), palette);
+        }
+        if (indexed) {
+            out.set_palette(result);
+        }
+    } catch (...) {
+        std::error_code ignored;
+        filesystem::remove(out_path, ignored); // a rejected job leaves no zero-filled output behind
+        throw;
+    }
+    return result;
+}
+
+// Returns the images of a batch: the image files of a directory (sorted, skipping earlier
+// outputs), or the non-empty lines of a list file
+std::vector<std::string> batch_inputs(const std::string &path) {
+    std::vector<std::string> inputs;
+    if (filesystem::is_directory(path)) {
+        const std::vector<std::string> extensions = {".png", ".jpg", ".jpeg", ".tif", ".tiff", ".bmp", ".jp2", ".webp"};
+        for (const filesystem::directory_entry &e : filesystem::directory_iterator(path)) {
+            std::string ext = e.path().extension().string();
+            std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+            if (e.is_regular_file() && std::find(extensions.begin(), extensions.end(), ext) != extensions.end() &&
+                e.path().stem().string().find("_quantized_") == std::string::npos) {
+                inputs.push_back(e.path().string());
+            }
+        }
+        std::sort(inputs.begin(), inputs.end());
+    } else {
+        std::ifstream list(path);
+        std::string line;
+        while (std::getline(list, line)) {
+            if (!line.empty()) {
+                inputs.push_back(line);
+            }
+        }
+    }
+    return inputs;
+}
+
+// Quantize every image of a batch with decoding, quantization and encoding running as
+// overlapping stages connected by bounded queues: io_threads threads decode images ahead, one
+// image at a time is quantized on all the threads of the pool, and io_threads threads encode
+// the finished images. At most in_flight images are decoded but not yet written.
+// If palette is not empty, it is applied to every image instead of clustering. If indexed is set,
+// every image is written as a palette PNG.
+// Returns the number of images that failed.
+int run_batch(thread_pool &tp, const std::vector<std::string> &inputs, const std::string &k_arg, int k, const quantize_options &options, const std::vector<std::uint32_t> &palette, int in_flight, int io_threads,
+              bool indexed) {
+    using ra::concurrency::queue;
+    queue<std::size_t> pending(inputs.size()); // indices of the images left to decode
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+        pending.push(std::size_t(i));
+    }
+    pending.close();
+    queue<int> tokens(in_flight); // one token per image allowed in flight
+    for (int t = 0; t < in_flight; t++) {
+        tokens.push(int(t));
+    }
+    queue<batch_job> decoded(in_flight);
+    queue<batch_job> quantized(in_flight);
+    std::atomic<int> failures{0};
+    std::atomic<int> decoders{io_threads};
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < io_threads; t++) {
+        threads.emplace_back([&]() {
+            std::size_t i;
+            while (pending.pop(i) == queue<std::size_t>::status::success) {
+                int token;
+                tokens.pop(token);
+                batch_job job;
+                job.input = inputs[i];
+                job.output = output_path_for(job.input, k_arg, ".png");
+                try {
+                    job.img = read_image(job.input);
+                } catch (const std::exception &e) {
+                    std::cerr << job.input << ": " << e.what() << std::endl;
+                    failures++;
+                    tokens.push(std::move(token));
+                    continue;
+                }
+                decoded.push(std::move(job));
+            }
+            if (--decoders == 0) {
+                decoded.close();
+            }
+        });
+    }
+    for (int t = 0; t < io_threads; t++) {
+        threads.emplace_back([&]() {
+            batch_job job;
+            while (quantized.pop(job) == queue<batch_job>::status::success) {
+                if (!job.palette.empty()) {
+                    try {
+                        write_indexed_png(job.output, view_of(job.out), job.palette);
+                    } catch (const std::exception &e) {
+                        std::cerr << job.output << ": " << e.what() << std::endl;
+                        failures++;
+                    }
+                } else if (!imwrite(job.output, job.out)) {
+                    std::cerr << job.output << ": Could not write the image" << std::endl;
+                    failures++;
+                }
+                job = batch_job(); // release the images before letting another one in
+                tokens.push(0);
+            }
+        });
+    }
+
+    // the quantization stage runs on this thread, with the whole pool behind it; the quantizer
+    // keeps its buffers from one image to the next
+    quantizer q(tp, options);
+    batch_job job;
+    while (decoded.pop(job) == queue<batch_job>::status::success) {
+        try {
+            if (indexed) {
+                job.out = Mat(job.img.rows, job.img.cols, CV_8UC1);
+                if (palette.empty()) {
+                    job.palette = q.quantize_indexed(job.img, job.out, k);
+                } else {
+                    q.apply_indexed(job.img, job.out, palette);
+                    job.palette = palette;
+                }
+                job.palette = png_palette(job.palette, job.img.depth() == CV_16U);
+            } else {
+                // quantized in place: the decoded image becomes the output
+                if (palette.empty()) {
+                    q.quantize(job.img, job.img, k);
+                } else {
+                    q.apply(job.img, job.img, palette);
+                }
+                job.out = job.img;
+            }
+            job.img = Mat();
+            quantized.push(std::move(job));
+        } catch (const std::exception &e) {
+            std::cerr << job.input << ": " << e.what() << std::endl;
+            failures++;
+            tokens.push(0);
+        }
+    }
+    quantized.close();
+    for (std::thread &t : threads) {
+        t.join();
+    }
+    return failures;
+}
+
+// Quantize the frames of a sequence in order, each starting from the palette of the one before.
+// The next frame is decoded on the pool while the current one is quantized.
+// Returns the number of frames that failed.
+int run_sequence(thread_pool &tp, const std::vector<std::string> &frames, const std::string &k_arg, int k, const quantize_options &options) {
+    sequence_quantizer sequence(tp, k, options);
+    int failures = 0;
+    std::future<Mat> next = tp.submit([&]() { return read_image(frames[0], false); });
+    for (std::size_t f = 0; f < frames.size(); f++) {
+        Mat frame;
+        try {
+            frame = next.get();
+        } catch (const std::exception &e) {
+            std::cerr << frames[f] << ": " << e.what() << std::endl;
+            failures++;
+        }
+        if (f + 1 < frames.size()) {
+            next = tp.submit([&, f]() { return read_image(frames[f + 1], false); });
+        }
+        if (frame.empty()) {
+            continue;
+        }
+        try {
+            auto t1 = high_resolution_clock::now();
+            sequence.next(frame, frame);
+            duration<double, std::milli> ms_double = high_resolution_clock::now() - t1;
+            std::cout << frames[f] << ": " << sequence.changed_pixels() << " changed pixels, " << ms_double.count() << "ms\n";
+            if (!imwrite(output_path_for(frames[f], k_arg, ".png"), frame)) {
+                throw std::runtime_error("Could not write the image");
+            }
+        } catch (const std::exception &e) {
+            std::cerr << frames[f] << ": " << e.what() << std::endl;
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// Returns s as a JSON string literal
+std::string json_string(const std::string &s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char) c < 0x20) {
+            char hex[8];
+            std::snprintf(hex, sizeof hex, "\\u%04x", c);
+            out += hex;
+        } else {
+            out += c;
+        }
+    }
+    return out + '"';
+}
+
+// Run one server job, a request line "<image_path> <k> [options]", on q, whose options start from
+// defaults. Returns the reply: a JSON object with the output path, the time taken and the
+// statistics of the run (as written by --stats), or the error that stopped the job. The pool
+// counters of the statistics are pool-wide: with several job slots, they include the tasks of the
+// other jobs run meanwhile.
+std::string serve_job(quantizer &q, const quantize_options &defaults, const std::string &line) {
+    std::istringstream words(line);
+    std::vector<std::string> args;
+    for (std::string word; words >> word;) {
+        args.push_back(word);
+    }
+    std::ostringstream reply;
+    try {
+        if (args.size() < 2) {
+            throw std::invalid_argument("expected <image_path> <uint_k> [options]");
+        }
+        const std::string &path = args[0];
+        const std::string &k_arg = args[1];
+        int k = atoi(k_arg.c_str());
+        if (k < 1) {
+            throw std::invalid_argument("k must be a positive integer");
+        }
+        quantize_options options = defaults;
+        std::vector<std::uint32_t> palette;
+        bool indexed = false;
+        for (std::size_t i = 2; i < args.size(); i++) {
+            const std::string &arg = args[i];
+            if (arg == "--indexed") {
+                indexed = true;
+            } else if (i + 1 == args.size()) {
+                throw std::invalid_argument("unknown option or missing value: " + arg);
+            } else if (arg == "--engine") {
+                if (!engine_from_name(args[++i], options.engine)) {
+                    throw std::invalid_argument("unknown engine: " + args[i]);
+                }
+            } else if (arg == "--seeding") {
+                if (!seeding_from_name(args[++i], options.seeding)) {
+                    throw std::invalid_argument("unknown seeding method: " + args[i]);
+                }
+            } else if (arg == "--seed") {
+                options.seed = std::strtoull(args[++i].c_str(), nullptr, 10);
+            } else if (arg == "--iterations") {
+                options.max_iterations = atoi(args[++i].c_str());
+            } else if (arg == "--batch-size") {
+                options.batch_size = atoi(args[++i].c_str());
+            } else if (arg == "--center-tolerance") {
+                options.center_tolerance = atof(args[++i].c_str());
+            } else if (arg == "--palette") {
+                palette = load_palette(args[++i]);
+                if (palette.size() != (std::size_t) k) {
+                    throw std::invalid_argument("the palette has " + std::to_string(palette.size()) + " colours, but k is " + k_arg);
+                }
+            } else {
+                throw std::invalid_argument("unknown option: " + arg);
+            }
+        }
+
+        stats_recorder recorder;
+        options.observer = &recorder;
+        q.set_options(options);
+        auto t1 = high_resolution_clock::now();
+        std::string output;
+        if (is_raw_image(path)) {
+            output = output_path_for(path, k_arg, ".raim");
+            quantize_raw_image(q, path, k_arg, k, palette, indexed);
+        } else {
+            output = output_path_for(path, k_arg, ".png");
+            Mat img = read_image(path);
+            Mat out = indexed ? Mat(img.rows, img.cols, CV_8UC1) : img;
+            if (palette.empty()) {
+                palette = indexed ? q.quantize_indexed(img, out, k) : q.quantize(img, out, k);
+            } else if (indexed) {
+                q.apply_indexed(img, out, palette);
+            } else {
+                q.apply(img, out, palette);
+            }
+            if (indexed) {
+                write_indexed_png(output, view_of(out), png_palette(palette, img.depth() == CV_16U));
+            } else if (!imwrite(output, out)) {
+                throw std::runtime_error("Could not write the image " + output);
+            }
+        }
+        duration<double, std::milli> ms_double = high_resolution_clock::now() - t1;
+        q.set_options(defaults); // the recorder goes out of scope
+
+        std::ostringstream stats;
+        write_json(stats, recorder.runs);
+        std::string json = stats.str();
+        std::replace(json.begin(), json.end(), '\n', ' '); // one line per reply
+        // tasks_scheduled and queue_wait_ms count every job running on the pool meanwhile, which the reply says
+        reply << "{\"status\": \"ok\", \"output\": " << json_string(output) << ", \"ms\": " << ms_double.count() << ", \"stats\": " << json
+              << ", \"pool_counters\": \"pool-wide\"}";
+    } catch (const std::exception &e) {
+        q.set_options(defaults);
+        reply.str("");
+        reply << "{\"status\": \"error\", \"message\": " << json_string(e.what()) << "}";
+    }
+    return reply.str();
+}
+
+// Set by SIGINT and SIGTERM to stop the server
+volatile std::sig_atomic_t stop_requested = 0;
+
+void on_stop_signal(int) { stop_requested = 1; }
+
+// The reply to a request that is not run because the server is stopping
+const std::string shutting_down_reply = "{\"status\": \"error\", \"message\": \"the server is shutting down\"}";
+
+// A request waiting for a job slot of the server
+struct server_job {
+    std::string line;
+    std::promise<std::string> reply;
+};
+
+// What the threads of the server share. Client threads are detached, so they hold it by
+// shared_ptr: the last one to finish may outlive run_server.
+struct server_state {
+    explicit server_state(std::size_t queue_size) : pending(queue_size) {}
+
+    ra::concurrency::queue<server_job> pending; // requests waiting for a job slot
+    std::mutex m;
+    std::condition_variable idle; // notified when a client disconnects
+    std::set<int> clients; // the sockets of the connected clients
+};
+
+// Writes all of text to the socket fd; returns false if the client has gone
+bool send_all(int fd, const std::string &text) {
+    for (std::size_t sent = 0; sent < text.size();) {
+        ssize_t n = ::send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        sent += n;
+    }
+    return true;
+}
+
+// Read the request lines of a client one after the other, queue each one as a job and send back its
+// reply, until the client disconnects or the server stops
+void serve_client(std::shared_ptr<server_state> state, int fd) {
+    constexpr std::size_t max_line = 1 << 16;
+    std::string buffer;
+    char chunk[4096];
+    bool open = true;
+    while (open) {
+        ssize_t n = ::recv(fd, chunk, sizeof chunk, 0);
+        if (n <= 0) {
+            break;
+        }
+        buffer.append(chunk, n);
+        std::size_t eol;
+        while (open && (eol = buffer.find('\n')) != std::string::npos) {
+            std::string line = buffer.substr(0, eol);
+            buffer.erase(0, eol + 1);
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            server_job job;
+            job.line = line;
+            std::future<std::string> reply = job.reply.get_future();
+            std::string text = shutting_down_reply;
+            if (state->pending.push(std::move(job)) == ra::concurrency::queue<server_job>::status::success) {
+                try {
+                    text = reply.get();
+                } catch (const std::future_error &) {
+                    // dropped from the queue at shutdown
+                }
+            }
+            open = send_all(fd, text + '\n');
+        }
+        open = open && buffer.size() <= max_line;
+    }
+    std::lock_guard<std::mutex> lock(state->m);
+    state->clients.erase(fd);
+    ::close(fd);
+    state->idle.notify_all();
+}
+
+// Serve quantization jobs on the Unix domain socket at socket_path until SIGINT or SIGTERM. The
+// thread pool tp serves for the lifetime of the server, and each of the jobs job slots keeps a
+// quantizer on it, so a job pays neither for process startup nor for thread creation, and reuses
+// the buffers of the jobs before it. Clients send one request per line and get one JSON reply per
+// line, in order. Requests beyond the free slots wait in a queue of queue_size; when that is full,
+// clients are held back until a slot frees.
+// Returns the exit status.
+int run_server(thread_pool &tp, const std::string &socket_path, int jobs, int queue_size, const quantize_options &defaults) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof addr.sun_path) {
+        std::cerr << "socket path too long: " << socket_path << std::endl;
+        return 1;
+    }
+    std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size() + 1);
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        std::cerr << "cannot create a socket: " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    // a socket left behind by an earlier server is replaced, but nothing else is
+    struct stat st;
+    if (::lstat(socket_path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            std::cerr << "cannot listen on " << socket_path << ": path exists and is not a socket" << std::endl;
+            ::close(listener);
+            return 1;
+        }
+        ::unlink(socket_path.c_str());
+    }
+    if (::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof addr) != 0 || ::listen(listener, 64) != 0) {
+        std::cerr << "cannot listen on " << socket_path << ": " << std::strerror(errno) << std::endl;
+        ::close(listener);
+        return 1;
+    }
+    std::signal(SIGINT, on_stop_signal);
+    std::signal(SIGTERM, on_stop_signal);
+
+    auto state = std::make_shared<server_state>(queue_size);
+    std::vector<std::thread> slots;
+    for (int j = 0; j < jobs; j++) {
+        slots.emplace_back([&tp, &defaults, state]() {
+            quantizer q(tp, defaults);
+            server_job job;
+            while (state->pending.pop(job) == ra::concurrency::queue<server_job>::status::success) {
+                // once a stop is requested, what is still queued is answered, not run
+                job.reply.set_value(stop_requested ? shutting_down_reply : serve_job(q, defaults, job.line));
+            }
+        });
+    }
+    std::cout << "serving on " << socket_path << " with " << jobs << " job slots" << std::endl;
+
+    while (!stop_requested) {
+        pollfd pfd = {listener, POLLIN, 0};
+        if (::poll(&pfd, 1, 200) <= 0) { // wakes up regularly to notice a stop
+            continue;
+        }
+        int fd = ::accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(state->m);
+        state->clients.insert(fd);
+        std::thread(serve_client, state, fd).detach();
+    }
+
+    ::close(listener);
+    ::unlink(socket_path.c_str());
+    // pop hands out what is queued even once the queue is closed: answer the requests still
+    // waiting with an error here, so that the slots only finish the jobs they are running
+    state->pending.close();
+    server_job job;
+    while (state->pending.try_pop(job) == ra::concurrency::queue<server_job>::status::success) {
+        job.reply.set_value(shutting_down_reply);
+    }
+    for (std::thread &t : slots) {
+        t.join();
+    }
+    std::unique_lock<std::mutex> lock(state->m);
+    for (int fd : state->clients) {
+        ::shutdown(fd, SHUT_RDWR);
+    }
+    state->idle.wait(lock, [&]() { return state->clients.empty(); });
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
-    if(argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <image_path> <uint_k>" << std::endl;
+    if(argc < 3) {
+        usage(argv[0]);
         //throw std::runtime_error("USAGE: quantize_image <img_path>");
         return 1;
     }
 
+    quantize_options options;
+    int tile_size = 0; // 0: quantize the whole image at once
+    int raw_rows = 0;
+    int raw_cols = 0;
+    bool batch = false;
+    int in_flight = 4;
+    int io_threads = 2;
+    std::string save_palette_path;
+    std::string palette_path;
+    std::string warm_start_path;
+    bool sequence = false;
+    double center_tolerance = -1;
+    std::string stats_path;
+    bool indexed = false;
+    bool serve = std::string(argv[1]) == "--serve"; // then argv[2] is the socket path
+    int server_jobs = 1;
+    int server_queue = 64;
+    pool_options pool;
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--engine" && i + 1 < argc) {
+            std::string engine = argv[++i];
+            if (!engine_from_name(engine, options.engine)) {
+                std::cerr << "Unknown engine: " << engine << std::endl;
+                return 1;
+            }
+        } else if (arg == "--seeding" && i + 1 < argc) {
+            std::string seeding = argv[++i];
+            if (!seeding_from_name(seeding, options.seeding)) {
+                std::cerr << "Unknown seeding method: " << seeding << std::endl;
+                return 1;
+            }
+        } else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = std::strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--iterations" && i + 1 < argc) {
+            options.max_iterations = atoi(argv[++i]);
+        } else if (arg == "--batch-size" && i + 1 < argc) {
+            options.batch_size = atoi(argv[++i]);
+        } else if (arg == "--tile" && i + 1 < argc) {
+            tile_size = atoi(argv[++i]);
+            if (tile_size < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--batch") {
+            batch = true;
+        } else if (arg == "--in-flight" && i + 1 < argc) {
+            in_flight = atoi(argv[++i]);
+            if (in_flight < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--io-threads" && i + 1 < argc) {
+            io_threads = atoi(argv[++i]);
+            if (io_threads < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--stats" && i + 1 < argc) {
+            stats_path = argv[++i];
+        } else if (arg == "--sequence") {
+            sequence = true;
+        } else if (arg == "--indexed") {
+            indexed = true;
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            server_jobs = atoi(argv[++i]);
+            if (server_jobs < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--queue" && i + 1 < argc) {
+            server_queue = atoi(argv[++i]);
+            if (server_queue < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--threads" && i + 1 < argc) {
+            int threads = atoi(argv[++i]);
+            if (threads < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+            pool.threads = threads;
+        } else if (arg == "--affinity" && i + 1 < argc) {
+            if (!affinity_from_spec(argv[++i], pool)) {
+                std::cerr << "Unknown affinity: " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if (arg == "--center-tolerance" && i + 1 < argc) {
+            center_tolerance = atof(argv[++i]);
+            if (center_tolerance < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--save-palette" && i + 1 < argc) {
+            save_palette_path = argv[++i];
+        } else if (arg == "--palette" && i + 1 < argc) {
+            palette_path = argv[++i];
+        } else if (arg == "--warm-start" && i + 1 < argc) {
+            warm_start_path = argv[++i];
+        } else if (arg == "--raw" && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &raw_rows, &raw_cols) != 2 || raw_rows < 1 || raw_cols < 1) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // with --stats, the library reports every run to the recorder, which is written out at the end
+    stats_recorder recorder;
+    if (!stats_path.empty()) {
+        options.observer = &recorder;
+    }
+    auto finish = [&](int status) {
+        if (stats_path == "-") {
+            write_json(std::cout, recorder.runs);
+        } else if (!stats_path.empty()) {
+            std::ofstream file(stats_path);
+            write_json(file, recorder.runs);
+            if (!file) {
+                std::cerr << "Could not write " << stats_path << std::endl;
+                return 1;
+            }
+        }
+        return status;
+    };
+
+    if (center_tolerance >= 0) {
+        options.center_tolerance = center_tolerance;
+    } else if (sequence) {
+        options.center_tolerance = 1; // consecutive frames rarely move a center by more than this
+    }
+
+    // one pool, placed as asked, serves every mode
+    std::unique_ptr<thread_pool> tp;
+    try {
+        tp = std::make_unique<thread_pool>(pool);
+    } catch (const std::invalid_argument &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (tp->unpinned_threads() != 0) {
+        std::cerr << "warning: " << tp->unpinned_threads() << " of " << tp->size()
+                  << " threads could not be pinned and run where the system places them" << std::endl;
+    }
+
+    if (serve) {
+        if (batch || sequence || tile_size > 0 || raw_rows > 0 || indexed || !stats_path.empty() || !palette_path.empty() ||
+            !warm_start_path.empty() || !save_palette_path.empty()) {
+            std::cerr << "--serve takes engine options only: palettes, output options and stats come with every job" << std::endl;
+            return 1;
+        }
+        return run_server(*tp, argv[2], server_jobs, server_queue, options);
+    }
+
+    // a saved palette fixes k: it must agree with the k given
+    std::vector<std::uint32_t> palette;
+    try {
+        if (!palette_path.empty()) {
+            palette = load_palette(palette_path);
+        }
+        if (!warm_start_path.empty()) {
+            options.initial_palette = load_palette(warm_start_path);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    for (const std::vector<std::uint32_t> *saved : {&palette, &options.initial_palette}) {
+        if (!saved->empty() && saved->size() != (std::size_t) atoi(argv[2])) {
+            std::cerr << "The palette has " << saved->size() << " colours, but k is " << argv[2] << std::endl;
+            return 1;
+        }
+    }
+    if (!palette.empty() && !save_palette_path.empty()) {
+        std::cerr << "--palette and --save-palette cannot be combined" << std::endl;
+        return 1;
+    }
+    if (indexed && (sequence || tile_size > 0 || raw_rows > 0)) {
+        std::cerr << "--indexed cannot be combined with --sequence, --tile or --raw" << std::endl;
+        return 1;
+    }
+
+    if (sequence) {
+        int k = atoi(argv[2]);
+        if (k < 1) {
+            std::cerr << "Usage: " << argv[0] << " <image_path> <(uint_k > 1)>" << std::endl;
+            return 1;
+        }
+        if (batch || !palette.empty() || !save_palette_path.empty()) {
+            std::cerr << "--sequence cannot be combined with --batch, --palette or --save-palette" << std::endl;
+            return 1;
+        }
+        std::vector<std::string> frames = batch_inputs(argv[1]);
+        if (frames.empty()) {
+            std::cerr << "No images found in " << argv[1] << std::endl;
+            return 1;
+        }
+        auto t1 = high_resolution_clock::now();
+        int failures = run_sequence(*tp, frames, argv[2], k, options);
+        duration<double, std::milli> ms_double = high_resolution_clock::now() - t1;
+        std::cout << frames.size() - failures << " of " << frames.size() << " frames in " << ms_double.count() << "ms\n";
+        return finish(failures == 0 ? 0 : 1);
+    }
+
+    if (batch) {
+        int k = atoi(argv[2]);
+        if (k < 1) {
+            std::cerr << "Usage: " << argv[0] << " <image_path> <(uint_k > 1)>" << std::endl;
+            return 1;
+        }
+        if (!save_palette_path.empty()) {
+            std::cerr << "--save-palette cannot be used with --batch, which clusters every image separately" << std::endl;
+            return 1;
+        }
+        std::vector<std::string> inputs = batch_inputs(argv[1]);
+        if (inputs.empty()) {
+            std::cerr << "No images found in " << argv[1] << std::endl;
+            return 1;
+        }
+        auto t1 = high_resolution_clock::now();
+        int failures = run_batch(*tp, inputs, argv[2], k, options, palette, in_flight, io_threads, indexed);
+        duration<double, std::milli> ms_double = high_resolution_clock::now() - t1;
+        std::cout << inputs.size() - failures << " of " << inputs.size() << " images in " << ms_double.count() << "ms\n";
+        return finish(failures == 0 ? 0 : 1);
+    }
+
     std::string image_path;
     std::string output_path;
 
@@ -38,36 +923,90 @@ int main(int argc, char *argv[]) {
         std::cerr << "Image at path not found. \n" << std::endl;
         return 1;
     }
-    Mat img = imread(image_path, IMREAD_UNCHANGED); // get the image regardless of num. channels (greyscale, colour, or col+alpha)
-
-    //double min, max;
-
-    // convert to RGBA (4-channel) image 
-    if(img.type() == 0) { // typical of jp2 satellite files
-        std::cout<<"FLAG\n";
-        cvtColor(img, img, COLOR_GRAY2BGRA); // convert to rgba / 8bit colours
-        cvtColor(img, img, COLOR_BGRA2RGBA); // convert to rgba / 8bit colours
-    } else if(img.type() == 2) { // typical of jp2 satellite files
-        img = img/128;
-        img.convertTo(img, CV_8UC4);
-        //cvtColor(img, img, COLOR_GRAY2RGBA); // should have 4 channels now
-    } else if(img.type() == 16) { // standard rgb (ex. jpg)
-        cvtColor(img, img, COLOR_RGB2RGBA); // convert to rgba / 8bit colours
-    }
-    /*
-    minMaxLoc(img, &min, &max);
-    std::cout<<"MIN: "<<min<<'\n';
-    std::cout<<"MAX: "<<max<<'\n';
-    */
-    Mat out = img.clone(); // array of size (rows x cols) containing each pixel's correspondence to one of k centers
-
-    std::cout<<img.type()<<'\n';
-    std::cout<<img.channels()<<'\n';
-
-    if(img.empty()) {
-        std::cerr << "Could not read the image: " << image_path << std::endl;
+    if (is_raw_image(image_path)) {
+        int k = atoi(argv[2]);
+        if (k < 1) {
+            std::cerr << "Usage: " << argv[0] << " <image_path> <(uint_k > 1)>" << std::endl;
+            return 1;
+        }
+        if (tile_size > 0 || raw_rows > 0) {
+            std::cerr << "raw image files are mapped whole: --tile and --raw do not apply" << std::endl;
+            return 1;
+        }
+        try {
+            auto t1 = high_resolution_clock::now();
+            quantizer q(*tp, options);
+            palette = quantize_raw_image(q, image_path, argv[2], k, palette, indexed);
+            duration<double, std::milli> ms_double = high_resolution_clock::now() - t1;
+            std::cout << ms_double.count() << "ms\n";
+            if (!save_palette_path.empty()) {
+                save_palette(save_palette_path, palette);
+            }
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        return finish(0);
+    }
+    if (tile_size > 0 || raw_rows > 0) {
+        // streaming mode: only a couple of tiles of the image are converted to RGBA at a time
+        int k = atoi(argv[2]);
+        if (k < 1) {
+            std::cerr << "Usage: " << argv[0] << " <image_path> <(uint_k > 1)>" << std::endl;
+            return 1;
+        }
+        if (tile_size == 0) {
+            tile_size = 1024;
+        }
+        try {
+            auto t1 = high_resolution_clock::now();
+            if (raw_rows > 0) {
+                output_path = output_path_for(image_path, argv[2], ".rgba");
+                raw_file_tile_source source(image_path, raw_rows, raw_cols);
+                raw_file_tile_sink sink(output_path, raw_cols);
+                if (palette.empty()) {
+                    palette = quantize_tiles(*tp, source, sink, k, options, tile_size);
+                } else {
+                    apply_palette_tiles(*tp, source, sink, palette, tile_size, options.observer);
+                }
+            } else {
+                Mat img = imread(image_path, IMREAD_UNCHANGED);
+                if (img.empty()) {
+                    std::cerr << "Could not read the image: " << image_path << std::endl;
+                    return 1;
+                }
+                Mat out(img.rows, img.cols, CV_8UC4);
+                mat_tile_source source(img);
+                memory_tile_sink sink(out.data, out.step);
+                if (palette.empty()) {
+                    palette = quantize_tiles(*tp, source, sink, k, options, tile_size);
+                } else {
+                    apply_palette_tiles(*tp, source, sink, palette, tile_size, options.observer);
+                }
+                imwrite(output_path, out);
+            }
+            duration<double, std::milli> ms_double = high_resolution_clock::now() - t1;
+            std::cout << ms_double.count() << "ms\n";
+            if (!save_palette_path.empty()) {
+                save_palette(save_palette_path, palette);
+            }
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+        return finish(0);
+    }
+
+    Mat img;
+    try {
+        img = read_image(image_path);
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << ": " << image_path << std::endl;
         return 1;
     }
+    // quantized in place, with the channels of the input, or into an image of palette indices
+    Mat out = indexed ? Mat(img.rows, img.cols, CV_8UC1) : img;
+
     int img_size = img.rows * img.cols;
     int k;
     try {
@@ -85,7 +1024,19 @@ int main(int argc, char *argv[]) {
     }
 
     auto t1 = high_resolution_clock::now();
-    quantize_image(img, out, k);
+    try {
+        quantizer q(*tp, options);
+        if (palette.empty()) {
+            palette = indexed ? q.quantize_indexed(img, out, k) : q.quantize(img, out, k);
+        } else if (indexed) {
+            q.apply_indexed(img, out, palette);
+        } else {
+            q.apply(img, out, palette);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
     auto t2 = high_resolution_clock::now();
     duration<double, std::milli> ms_double = t2 - t1;
     std::cout << ms_double.count() << "ms\n";
@@ -96,8 +1047,24 @@ int main(int argc, char *argv[]) {
     //if(key =='s') {
     //imwrite(output_path, out);
     //}
-    imwrite(output_path, out);
-
+    try {
+        if (indexed) {
+            write_indexed_png(output_path, view_of(out), png_palette(palette, img.depth() == CV_16U));
+        } else {
+            imwrite(output_path, out);
+        }
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    if (!save_palette_path.empty()) {
+        try {
+            save_palette(save_palette_path, palette);
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
 
-    return 0;
+    return finish(0);
 }
@@ -0,0 +1,162 @@
+// Contention microbenchmark for the concurrent queues and the thread
+// pools built on them.
+// Every queue is run with the same number of producers and consumers
+// moving the same number of elements through the same capacity, and
+// the pools schedule the same number of empty tasks.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "../include/ra/queue.hpp"
+#include "../include/ra/ring_queue.hpp"
+#include "../include/ra/thread_pool.hpp"
+
+using std::chrono::duration;
+using std::chrono::high_resolution_clock;
+
+void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "Options:\n"
+              << "  --producers <uint>  pushing threads (default: 4)\n"
+              << "  --consumers <uint>  popping threads (default: 4)\n"
+              << "  --items <uint>      elements pushed by every producer (default: 1000000)\n"
+              << "  --capacity <uint>   maximum size of the queue (default: 1024)\n"
+              << "  --tasks <uint>      tasks scheduled on each pool (default: 1000000)\n"
+              << "  --threads <uint>    threads in each pool (default: hardware concurrency)\n";
+}
+
+// Returns the seconds taken to move producers * items elements through
+// a Queue of the given capacity.
+template <class Queue>
+double run_queue(std::size_t producers, std::size_t consumers, std::size_t items, std::size_t capacity) {
+    Queue q(capacity);
+    std::atomic<std::size_t> ready{0};
+    std::atomic<bool> go{false};
+    std::atomic<std::size_t> popped{0};
+    std::vector<std::thread> threads;
+    for (std::size_t p = 0; p < producers; p++) {
+        threads.emplace_back([&]() {
+            ready++;
+            while (!go) {
+                std::this_thread::yield();
+            }
+            for (std::size_t i = 0; i < items; i++) {
+                std::size_t x = i;
+                q.push(std::move(x));
+            }
+        });
+    }
+    for (std::size_t c = 0; c < consumers; c++) {
+        threads.emplace_back([&]() {
+            ready++;
+            while (!go) {
+                std::this_thread::yield();
+            }
+            std::size_t x;
+            std::size_t n = 0;
+            while (q.pop(x) == Queue::status::success) {
+                n++;
+            }
+            popped += n;
+        });
+    }
+    while (ready < producers + consumers) {
+        std::this_thread::yield();
+    }
+    auto start = high_resolution_clock::now();
+    go = true;
+    for (std::size_t p = 0; p < producers; p++) {
+        threads[p].join();
+    }
+    // the consumers drain what is left, then see the queue closed
+    while (!q.is_empty()) {
+        std::this_thread::yield();
+    }
+    q.close();
+    for (std::size_t c = producers; c < threads.size(); c++) {
+        threads[c].join();
+    }
+    double seconds = duration<double>(high_resolution_clock::now() - start).count();
+    if (popped != producers * items) {
+        std::cerr << "lost elements: " << popped << " of " << producers * items << std::endl;
+    }
+    return seconds;
+}
+
+// Returns the seconds taken to schedule tasks empty tasks on a Pool and
+// wait for them.
+template <class Pool>
+double run_pool(std::size_t threads, typename Pool::scheduling mode, std::size_t tasks) {
+    Pool tp(threads, mode);
+    std::atomic<std::size_t> done{0};
+    auto start = high_resolution_clock::now();
+    for (std::size_t t = 0; t < tasks; t++) {
+        tp.schedule([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+    }
+    tp.block_until_idle();
+    double seconds = duration<double>(high_resolution_clock::now() - start).count();
+    if (done != tasks) {
+        std::cerr << "lost tasks: " << done << " of " << tasks << std::endl;
+    }
+    return seconds;
+}
+
+void report(const char *name, std::size_t ops, double seconds) {
+    std::cout << name << ": " << seconds * 1000 << " ms, " << ops / seconds / 1e6 << " Mops/s" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    std::size_t producers = 4;
+    std::size_t consumers = 4;
+    std::size_t items = 1000000;
+    std::size_t capacity = 1024;
+    std::size_t tasks = 1000000;
+    std::size_t threads = std::max(2u, std::thread::hardware_concurrency());
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        std::size_t value = std::strtoull(argv[++i], nullptr, 10);
+        if (arg == "--producers") {
+            producers = value;
+        } else if (arg == "--consumers") {
+            consumers = value;
+        } else if (arg == "--items") {
+            items = value;
+        } else if (arg == "--capacity") {
+            capacity = value;
+        } else if (arg == "--tasks") {
+            tasks = value;
+        } else if (arg == "--threads") {
+            threads = value;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (producers == 0 || consumers == 0 || capacity == 0 || threads == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    using namespace ra::concurrency;
+    std::cout << producers << " producers, " << consumers << " consumers, " << items << " items each, capacity " << capacity << std::endl;
+    report("queue", producers * items, run_queue<queue<std::size_t>>(producers, consumers, items, capacity));
+    report("ring_queue", producers * items, run_queue<ring_queue<std::size_t>>(producers, consumers, items, capacity));
+
+    std::cout << threads << " threads, " << tasks << " tasks" << std::endl;
+    using locked_pool = basic_thread_pool<queue>;
+    using ring_pool = basic_thread_pool<ring_queue>;
+    report("pool<queue> handoff", tasks, run_pool<locked_pool>(threads, locked_pool::scheduling::handoff, tasks));
+    report("pool<ring_queue> handoff", tasks, run_pool<ring_pool>(threads, ring_pool::scheduling::handoff, tasks));
+    report("pool<queue> work_stealing", tasks, run_pool<locked_pool>(threads, locked_pool::scheduling::work_stealing, tasks));
+    report("pool<ring_queue> work_stealing", tasks, run_pool<ring_pool>(threads, ring_pool::scheduling::work_stealing, tasks));
+    return 0;
+}
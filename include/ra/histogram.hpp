@@ -0,0 +1,550 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+#include "./image_view.hpp"
+#include "./thread_pool.hpp"
+
+namespace ra::quantization {
+
+// Packs the four 8-bit channels of a pixel into a single 32-bit key.
+// The first channel occupies the least significant byte.
+inline std::uint32_t pack_colour(std::uint8_t r, std::uint8_t g, std::uint8_t b, std::uint8_t a) {
+    return std::uint32_t(r) | (std::uint32_t(g) << 8) | (std::uint32_t(b) << 16) | (std::uint32_t(a) << 24);
+}
+
+// Returns channel c (0 to 3) of a packed colour.
+inline std::uint8_t colour_channel(std::uint32_t colour, int c) {
+    return (colour >> (8 * c)) & 0xff;
+}
+
+// Returns the packed colour of the pixel at p, of an 8-bit image with C
+// channels (1, 3 or 4), as it would be once expanded to 4 channels: a
+// grey value v becomes (v, v, v, 255), and 3 channels get an alpha of
+// 255. Images are read in their own layout, but their colours,
+// distances and palettes are those of the expanded image.
+template <int C>
+inline std::uint32_t load_colour(const std::uint8_t *p) {
+    if constexpr (C == 1) {
+        return pack_colour(p[0], p[0], p[0], 255);
+    } else if constexpr (C == 3) {
+        return pack_colour(p[0], p[1], p[2], 255);
+    } else {
+        return pack_colour(p[0], p[1], p[2], p[3]);
+    }
+}
+
+// Writes the first C channels of a packed colour to the pixel at p.
+template <int C>
+inline void store_colour(std::uint8_t *p, std::uint32_t colour) {
+    for (int c = 0; c < C; c++) {
+        p[c] = colour_channel(colour, c);
+    }
+}
+
+// Returns fn(std::integral_constant<int, C>()), where C is channels,
+// which must be 1, 3 or 4: this selects the instantiation of a kernel
+// templated on the channel count.
+template <class F>
+inline decltype(auto) with_channels(int channels, F &&fn) {
+    switch (channels) {
+        case 1:
+            return fn(std::integral_constant<int, 1>());
+        case 3:
+            return fn(std::integral_constant<int, 3>());
+        default:
+            return fn(std::integral_constant<int, 4>());
+    }
+}
+
+// Open-addressing (linear probing) hash table mapping packed colours
+// to pixel counts.
+// The slots are stored in one flat array so that a lookup touches a
+// single cache line in the common case.
+// This class is not thread safe; each thread fills its own table.
+class colour_table {
+   public:
+    // An unsigned integral type used to represent sizes.
+    using size_type = std::size_t;
+
+    // One entry of the table. A count of zero marks an empty slot.
+    struct slot {
+        std::uint64_t count;
+        std::uint32_t colour;
+    };
+
+    // Constructs an empty table able to hold at least capacity
+    // colours before it has to grow.
+    explicit colour_table(size_type capacity = 256) {
+        size_type n = 16;
+        while (n < 2 * capacity) {
+            n *= 2;
+        }
+        initial_slots_ = n;
+        slots_.assign(n, slot{0, 0});
+        mask_ = n - 1;
+    }
+
+    // Returns the hash of a packed colour. The high bits select a
+    // partition (see partitioned_colour_table); the low bits select
+    // the slot inside a table.
+    static std::uint32_t hash(std::uint32_t colour) {
+        return (std::uint64_t(colour) * 0x9E3779B97F4A7C15ull) >> 32;
+    }
+
+    // Adds n pixels of the given colour, where h == hash(colour).
+    void add(std::uint32_t colour, std::uint32_t h, std::uint64_t n) {
+        size_type i = h & mask_;
+        while (true) {
+            slot &s = slots_[i];
+            if (s.count == 0) {
+                s.colour = colour;
+                s.count = n;
+                if (++size_ * 2 > slots_.size()) {
+                    grow();
+                }
+                return;
+            }
+            if (s.colour == colour) {
+                s.count += n;
+                return;
+            }
+            i = (i + 1) & mask_;
+        }
+    }
+
+    // Adds n pixels of the given colour.
+    void add(std::uint32_t colour, std::uint64_t n = 1) { add(colour, hash(colour), n); }
+
+    // Returns the number of pixels of the given colour (zero if the
+    // colour is not in the table).
+    std::uint64_t count(std::uint32_t colour) const {
+        size_type i = hash(colour) & mask_;
+        while (slots_[i].count != 0) {
+            if (slots_[i].colour == colour) {
+                return slots_[i].count;
+            }
+            i = (i + 1) & mask_;
+        }
+        return 0;
+    }
+
+    // Returns the number of distinct colours in the table.
+    size_type size() const { return size_; }
+
+    // Removes every colour, returning the table to the size it was
+    // constructed with, so that it fills (and orders its colours)
+    // exactly as a new table would. The memory is kept: refilling the
+    // table with as many colours allocates nothing.
+    void clear() {
+        slots_.assign(initial_slots_, slot{0, 0});
+        mask_ = initial_slots_ - 1;
+        size_ = 0;
+    }
+
+    // Returns the underlying slot array (including empty slots).
+    const std::vector<slot> &slots() const { return slots_; }
+
+   private:
+    // Doubles the number of slots and reinserts every colour.
+    void grow() {
+        old_.swap(slots_);
+        slots_.assign(2 * old_.size(), slot{0, 0});
+        mask_ = slots_.size() - 1;
+        size_ = 0;
+        for (const slot &s : old_) {
+            if (s.count != 0) {
+                add(s.colour, hash(s.colour), s.count);
+            }
+        }
+    }
+
+    std::vector<slot> slots_;
+    std::vector<slot> old_;  // the slots before the last grow; its memory is reused by the next one
+    size_type initial_slots_ = 0;
+    size_type mask_ = 0;
+    size_type size_ = 0;
+};
+
+// A colour table split into a power-of-two number of independent
+// sub-tables selected by the high bits of the colour hash.
+// Every colour lands in the same partition in every table, so the
+// partitions of several tables can be merged in parallel without
+// locking: one merge task owns one partition.
+class partitioned_colour_table {
+   public:
+    using size_type = std::size_t;
+
+    // Constructs a table with 2^partition_bits partitions.
+    explicit partitioned_colour_table(int partition_bits = 0, size_type capacity = 256)
+        : bits_(partition_bits),
+          parts_(size_type(1) << partition_bits, colour_table(capacity >> partition_bits)) {}
+
+    // Adds n pixels of the given colour.
+    void add(std::uint32_t colour, std::uint64_t n = 1) {
+        std::uint32_t h = colour_table::hash(colour);
+        parts_[bits_ ? h >> (32 - bits_) : 0].add(colour, h, n);
+    }
+
+    // Returns the number of partitions.
+    size_type partitions() const { return parts_.size(); }
+
+    // Returns partition p.
+    const colour_table &partition(size_type p) const { return parts_[p]; }
+    colour_table &partition(size_type p) { return parts_[p]; }
+
+    // Removes every colour, keeping the slots of every partition.
+    void clear() {
+        for (colour_table &t : parts_) {
+            t.clear();
+        }
+    }
+
+   private:
+    int bits_;
+    std::vector<colour_table> parts_;
+};
+
+// Histogram of the distinct colours of an image.
+// The colours and their pixel counts are stored in two contiguous
+// arrays of equal length so that the clustering loops can iterate
+// over them by index.
+struct colour_histogram {
+    // Packed colours (see pack_colour).
+    std::vector<std::uint32_t> colours;
+    // counts[i] is the number of pixels with colour colours[i].
+    std::vector<std::uint64_t> counts;
+    // The colours are grouped by the high bits of their hash: the
+    // colours in [partitions[p], partitions[p + 1]) all belong to
+    // partition p of a partitioned_colour_table with partition_bits
+    // bits. Tables built from the histogram can use this to fill one
+    // partition per task.
+    int partition_bits = 0;
+    std::vector<std::size_t> partitions;
+    // The channels the colours vary in: 1 if they all are grey and
+    // opaque (they come from 1-channel images, see load_colour), 3 if
+    // they all are opaque, 4 otherwise.
+    int channels = 4;
+
+    // Returns the number of distinct colours.
+    std::size_t size() const { return colours.size(); }
+};
+
+// Flattens merged, the 2^bits partitions of a colour table, into hist,
+// copying one partition per task. The arrays of hist are reused.
+inline void flatten_partitions(ra::concurrency::thread_pool &tp, const std::vector<colour_table> &merged, int bits, colour_histogram &hist) {
+    using size_type = std::size_t;
+    size_type parts = merged.size();
+    hist.partitions.assign(parts + 1, 0);
+    for (size_type p = 0; p < parts; p++) {
+        hist.partitions[p + 1] = hist.partitions[p] + merged[p].size();
+    }
+    hist.partition_bits = bits;
+    hist.colours.resize(hist.partitions[parts]);
+    hist.counts.resize(hist.partitions[parts]);
+    tp.parallel_for(0, parts, 1, [&](size_type p_first, size_type p_last) {
+        for (size_type p = p_first; p < p_last; p++) {
+            size_type i = hist.partitions[p];
+            for (const colour_table::slot &s : merged[p].slots()) {
+                if (s.count != 0) {
+                    hist.colours[i] = s.colour;
+                    hist.counts[i] = s.count;
+                    i++;
+                }
+            }
+        }
+    });
+}
+
+// As above, into a new histogram.
+inline colour_histogram flatten_partitions(ra::concurrency::thread_pool &tp, const std::vector<colour_table> &merged, int bits) {
+    colour_histogram hist;
+    flatten_partitions(tp, merged, bits, hist);
+    return hist;
+}
+
+// Accumulates the histogram of an image that is given in pieces (for
+// example tiles or strips), so that the whole image never has to be in
+// memory at once.
+// Every piece is split into one block of rows per thread of the pool,
+// each block is counted into the partitioned table of its thread, and
+// the tables are merged one partition per task when the histogram is
+// finished. No lock is taken per pixel.
+// The tables are kept when a histogram is finished, so a builder that
+// is reused for images of similar size stops allocating.
+class histogram_builder {
+   public:
+    using size_type = std::size_t;
+
+    // Constructs an empty builder whose work runs on tp.
+    explicit histogram_builder(ra::concurrency::thread_pool &tp) : tp_(tp) {
+        while ((size_type(1) << bits_) < tp.size()) {
+            bits_++;
+        }
+        partials_.assign(tp.size(), partitioned_colour_table(bits_));
+        merged_.resize(size_type(1) << bits_);
+    }
+
+    // Adds the pixels of an 8-bit piece with 1, 3 or 4 channels.
+    void add(const const_image_view &img) {
+        channels_ = std::max(channels_, img.channels);
+        with_channels(img.channels, [&](auto c) { add_pixels<decltype(c)::value>(img); });
+    }
+
+    // As above, for a continuous piece of rows x cols pixels.
+    void add(const std::uint8_t *data, int rows, int cols, int channels = 4) { add(const_image_view(data, rows, cols, channels)); }
+
+    // Merges everything added so far into hist (reusing its arrays),
+    // and leaves the builder empty.
+    void finish(colour_histogram &hist) {
+        // merge partition p of every partial into one table
+        size_type parts = merged_.size();
+        tp_.parallel_for(0, parts, 1, [&](size_type p_first, size_type p_last) {
+            for (size_type p = p_first; p < p_last; p++) {
+                merged_[p].clear();
+                for (partitioned_colour_table &partial : partials_) {
+                    for (const colour_table::slot &s : partial.partition(p).slots()) {
+                        if (s.count != 0) {
+                            merged_[p].add(s.colour, s.count);
+                        }
+                    }
+                    partial.partition(p).clear();
+                }
+            }
+        });
+        flatten_partitions(tp_, merged_, bits_, hist);
+        hist.channels = channels_ == 0 ? 4 : channels_;
+        channels_ = 0;
+    }
+
+    // As above, into a new histogram.
+    colour_histogram finish() {
+        colour_histogram hist;
+        finish(hist);
+        return hist;
+    }
+
+   private:
+    template <int C>
+    void add_pixels(const const_image_view &img) {
+        size_type workers = std::max<size_type>(1, std::min<size_type>(partials_.size(), img.rows));
+        tp_.parallel_for(0, workers, 1, [&](size_type w_first, size_type w_last) {
+            for (size_type w = w_first; w < w_last; w++) {
+                int first = img.rows * w / workers;
+                int last = img.rows * (w + 1) / workers;
+                if (first == last) {
+                    continue;
+                }
+                partitioned_colour_table &table = partials_[w];
+                if constexpr (C == 1) {
+                    // 256 possible values: count them directly
+                    std::uint64_t counts[256] = {};
+                    for_each_span(img, first, last, [&](const std::uint8_t *p, size_type n) {
+                        for (const std::uint8_t *end = p + n; p != end; p++) {
+                            counts[*p]++;
+                        }
+                    });
+                    for (int v = 0; v < 256; v++) {
+                        if (counts[v] != 0) {
+                            table.add(pack_colour(v, v, v, 255), counts[v]);
+                        }
+                    }
+                    continue;
+                }
+                // runs of identical pixels are common; count them before hashing
+                std::uint32_t run_colour = load_colour<C>(img.row(first));
+                std::uint64_t run = 0;
+                for_each_span(img, first, last, [&](const std::uint8_t *p, size_type n) {
+                    for (const std::uint8_t *end = p + n * C; p != end; p += C) {
+                        std::uint32_t c = load_colour<C>(p);
+                        if (c != run_colour) {
+                            table.add(run_colour, run);
+                            run_colour = c;
+                            run = 0;
+                        }
+                        run++;
+                    }
+                });
+                table.add(run_colour, run);
+            }
+        });
+    }
+
+    ra::concurrency::thread_pool &tp_;
+    int bits_ = 0;
+    int channels_ = 0;                                // the most channels added since the last finish
+    std::vector<partitioned_colour_table> partials_;  // one per thread of the pool
+    std::vector<colour_table> merged_;               // one per partition
+};
+
+// Builds the histogram of an 8-bit image with 1, 3 or 4 channels.
+inline colour_histogram build_histogram(ra::concurrency::thread_pool &tp, const const_image_view &img) {
+    histogram_builder builder(tp);
+    builder.add(img);
+    return builder.finish();
+}
+
+// As above, for a continuous image of rows x cols pixels.
+inline colour_histogram build_histogram(ra::concurrency::thread_pool &tp, const std::uint8_t *data, int rows, int cols, int channels = 4) {
+    return build_histogram(tp, const_image_view(data, rows, cols, channels));
+}
+
+// Histogram of the samples of a 16-bit, single-channel image. With at
+// most 65536 distinct values, the counts are indexed directly by value
+// instead of hashed, and the values come out sorted. Each thread counts
+// its rows into a table of its own; the tables are then summed one
+// range of values per task. The tables are kept, so rebuilding the
+// histogram allocates nothing.
+class sample_histogram {
+   public:
+    using size_type = std::size_t;
+
+    // The number of possible sample values.
+    static constexpr size_type values = 65536;
+
+    // Replaces the contents with the samples of a 16-bit
+    // single-channel image, counted on the threads of tp.
+    void build(ra::concurrency::thread_pool &tp, const const_image_view &img) {
+        size_type workers = std::max<size_type>(1, std::min<size_type>(tp.size(), img.rows));
+        if (partials_.size() < workers) {
+            partials_.resize(workers);
+        }
+        tp.parallel_for(0, workers, 1, [&](size_type w_first, size_type w_last) {
+            for (size_type w = w_first; w < w_last; w++) {
+                std::vector<std::uint64_t> &table = partials_[w];
+                table.assign(values, 0);
+                for_each_span(img, img.rows * w / workers, img.rows * (w + 1) / workers, [&](const std::uint8_t *row, size_type n) {
+                    const std::uint16_t *p = reinterpret_cast<const std::uint16_t *>(row);
+                    for (const std::uint16_t *end = p + n; p != end; p++) {
+                        table[*p]++;
+                    }
+                });
+            }
+        });
+        counts_.resize(values);
+        tp.parallel_for(0, values, 4096, [&](size_type first, size_type last) {
+            for (size_type v = first; v < last; v++) {
+                std::uint64_t n = 0;
+                for (size_type w = 0; w < workers; w++) {
+                    n += partials_[w][v];
+                }
+                counts_[v] = n;
+            }
+        });
+        unique_ = values - std::count(counts_.begin(), counts_.end(), std::uint64_t(0));
+    }
+
+    // As above, for a continuous image of rows x cols pixels.
+    void build(ra::concurrency::thread_pool &tp, const std::uint16_t *data, int rows, int cols) {
+        build(tp, const_image_view(reinterpret_cast<const std::uint8_t *>(data), rows, cols, 1, 16));
+    }
+
+    // Returns the number of pixels with sample value v.
+    std::uint64_t count(size_type v) const { return counts_[v]; }
+
+    // Returns the number of distinct sample values.
+    size_type unique() const { return unique_; }
+
+   private:
+    std::vector<std::uint64_t> counts_;                 // indexed by value
+    std::vector<std::vector<std::uint64_t>> partials_;  // one per worker
+    size_type unique_ = 0;
+};
+
+// Returns the histogram of next, an 8-bit image with 1, 3 or 4
+// channels, given hist, the histogram of prev, an image of the same size
+// and channels (for example the previous frame of a video).
+// Only the pixels that differ between the two images are hashed: each
+// thread counts the colours they gain and lose into tables of its own,
+// and these are merged with hist one partition per task. The cost is
+// one comparison per pixel plus work proportional to the number of
+// changed pixels and of distinct colours, instead of a hash per pixel.
+// If changed is not null, the number of changed pixels is stored in it.
+// Precondition: hist was built from prev (with any pool).
+inline colour_histogram update_histogram(ra::concurrency::thread_pool &tp, const colour_histogram &hist, const const_image_view &prev,
+                                         const const_image_view &next, std::size_t *changed = nullptr) {
+    using size_type = std::size_t;
+    int rows = next.rows;
+    int channels = next.channels;
+    int bits = hist.partition_bits;
+    size_type parts = size_type(1) << bits;
+    size_type workers = std::max<size_type>(1, std::min<size_type>(tp.size(), rows));
+    std::vector<partitioned_colour_table> gained(workers, partitioned_colour_table(bits, 16 << bits));
+    std::vector<partitioned_colour_table> lost(workers, partitioned_colour_table(bits, 16 << bits));
+    std::vector<size_type> counts(workers, 0);
+    with_channels(channels, [&](auto c) {
+        constexpr int C = decltype(c)::value;
+        tp.parallel_for(0, workers, 1, [&](size_type w_first, size_type w_last) {
+            for (size_type w = w_first; w < w_last; w++) {
+                for_each_span(prev, next, rows * w / workers, rows * (w + 1) / workers, [&](const std::uint8_t *p, const std::uint8_t *q, size_type n) {
+                    for (size_type i = 0; i < n * C; i += C) {
+                        std::uint32_t before = load_colour<C>(p + i);
+                        std::uint32_t after = load_colour<C>(q + i);
+                        if (before != after) {
+                            lost[w].add(before);
+                            gained[w].add(after);
+                            counts[w]++;
+                        }
+                    }
+                });
+            }
+        });
+    });
+    if (changed != nullptr) {
+        *changed = 0;
+        for (size_type n : counts) {
+            *changed += n;
+        }
+    }
+
+    // merge partition p of hist and of every table, dropping the colours whose count reaches zero
+    std::vector<colour_table> merged(parts);
+    tp.parallel_for(0, parts, 1, [&](size_type p_first, size_type p_last) {
+        for (size_type p = p_first; p < p_last; p++) {
+            colour_table table(hist.partitions[p + 1] - hist.partitions[p]);
+            for (size_type i = hist.partitions[p]; i < hist.partitions[p + 1]; i++) {
+                table.add(hist.colours[i], hist.counts[i]);
+            }
+            colour_table removed;
+            for (size_type w = 0; w < workers; w++) {
+                for (const colour_table::slot &s : gained[w].partition(p).slots()) {
+                    if (s.count != 0) {
+                        table.add(s.colour, s.count);
+                    }
+                }
+                for (const colour_table::slot &s : lost[w].partition(p).slots()) {
+                    if (s.count != 0) {
+                        removed.add(s.colour, s.count);
+                    }
+                }
+            }
+            for (const colour_table::slot &s : table.slots()) {
+                if (s.count != 0) {
+                    std::uint64_t n = s.count - removed.count(s.colour);
+                    if (n != 0) {
+                        merged[p].add(s.colour, n);
+                    }
+                }
+            }
+        }
+    });
+
+    colour_histogram result = flatten_partitions(tp, merged, bits);
+    result.channels = std::max(hist.channels, channels);
+    return result;
+}
+
+// As above, for continuous images of rows x cols pixels.
+inline colour_histogram update_histogram(ra::concurrency::thread_pool &tp, const colour_histogram &hist, const std::uint8_t *prev,
+                                         const std::uint8_t *next, int rows, int cols, std::size_t *changed = nullptr, int channels = 4) {
+    return update_histogram(tp, hist, const_image_view(prev, rows, cols, channels), const_image_view(next, rows, cols, channels), changed);
+}
+
+}  // namespace ra::quantization
+
+#endif
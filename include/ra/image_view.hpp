@@ -0,0 +1,92 @@
+#ifndef IMAGE_VIEW_H
+#define IMAGE_VIEW_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace ra::quantization {
+
+// A view of pixels that the caller owns: rows of cols pixels with
+// channels samples of bits (8 or 16) bits each, row r starting
+// r * stride bytes after data. A stride larger than a row describes
+// padded buffers and regions of interest of larger images, which can
+// then be quantized in place, without a copy.
+// T is std::uint8_t or const std::uint8_t; 16-bit samples are read
+// through the same byte pointer.
+template <class T>
+struct basic_image_view {
+    using size_type = std::size_t;
+
+    T *data = nullptr;
+    int rows = 0;
+    int cols = 0;
+    int channels = 4;
+    int bits = 8;
+    size_type stride = 0;  // bytes from the start of one row to the next
+
+    basic_image_view() = default;
+
+    // A stride of 0 stands for continuous rows.
+    basic_image_view(T *data, int rows, int cols, int channels = 4, int bits = 8, size_type stride = 0)
+        : data(data), rows(rows), cols(cols), channels(channels), bits(bits), stride(stride != 0 ? stride : row_bytes()) {}
+
+    // A view of mutable pixels converts to a view of const ones.
+    template <class U, class = std::enable_if_t<std::is_convertible_v<U *, T *>>>
+    basic_image_view(const basic_image_view<U> &v) : data(v.data), rows(v.rows), cols(v.cols), channels(v.channels), bits(v.bits), stride(v.stride) {}
+
+    // Returns the number of bytes of pixels in a row.
+    size_type row_bytes() const { return size_type(cols) * channels * (bits / 8); }
+
+    // Returns true if the rows follow each other without padding.
+    bool continuous() const { return stride == row_bytes() || rows <= 1; }
+
+    // Returns the first byte of row r.
+    T *row(int r) const { return data + size_type(r) * stride; }
+
+    // Returns the view of rows [row, row + rows) and columns
+    // [col, col + cols), which keeps the stride of this one.
+    basic_image_view region(int row, int col, int rows, int cols) const {
+        return basic_image_view(this->row(row) + size_type(col) * channels * (bits / 8), rows, cols, channels, bits, stride);
+    }
+};
+
+using image_view = basic_image_view<std::uint8_t>;
+using const_image_view = basic_image_view<const std::uint8_t>;
+
+// Calls fn(p, n) for every run of contiguous pixels in rows [first,
+// last) of img, p pointing to the first byte of n pixels. Continuous
+// rows are passed as a single run.
+template <class T, class Fn>
+inline void for_each_span(const basic_image_view<T> &img, int first, int last, Fn fn) {
+    if (first >= last) {
+        return;
+    }
+    if (img.continuous()) {
+        fn(img.row(first), std::size_t(last - first) * img.cols);
+        return;
+    }
+    for (int r = first; r < last; r++) {
+        fn(img.row(r), std::size_t(img.cols));
+    }
+}
+
+// As above, over the same rows of two images of the same size, calling
+// fn(p, q, n) with p and q pointing into in and out.
+template <class T, class U, class Fn>
+inline void for_each_span(const basic_image_view<T> &in, const basic_image_view<U> &out, int first, int last, Fn fn) {
+    if (first >= last) {
+        return;
+    }
+    if (in.continuous() && out.continuous()) {
+        fn(in.row(first), out.row(first), std::size_t(last - first) * in.cols);
+        return;
+    }
+    for (int r = first; r < last; r++) {
+        fn(in.row(r), out.row(r), std::size_t(in.cols));
+    }
+}
+
+}  // namespace ra::quantization
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef INDEXED_PNG_H
+#define INDEXED_PNG_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./image_view.hpp"
+
+namespace ra::quantization {
+
+// Encodes an image of palette indices (8 bits, one channel) as a
+// palette PNG: a PLTE chunk with the colours of palette, a tRNS chunk
+// with their alpha if any is not opaque, and the indices packed into 1,
+// 2, 4 or 8 bits per pixel, the fewest that hold every index. The
+// result is a quarter of the size of the RGBA image before compression,
+// and usually much less after.
+// palette holds packed colours (see pack_colour). If bgr is set, their
+// channels are in the order OpenCV uses (blue, green, red, alpha), and
+// are reordered for the PNG; otherwise they are red, green, blue, alpha.
+// level is the zlib compression level (0 to 9).
+// Throws std::invalid_argument if the palette is empty or holds more
+// than 256 colours, and std::runtime_error if compression fails.
+// Precondition: every index is less than palette.size()
+std::vector<std::uint8_t> encode_indexed_png(const const_image_view &indices, const std::vector<std::uint32_t> &palette, bool bgr = true,
+                                             int level = 6);
+
+// Writes encode_indexed_png(indices, palette, bgr, level) to the file at
+// path, replacing it if it exists.
+// Throws as encode_indexed_png does, and std::runtime_error if the file
+// cannot be written.
+void write_indexed_png(const std::string &path, const const_image_view &indices, const std::vector<std::uint32_t> &palette, bool bgr = true,
+                       int level = 6);
+
+}  // namespace ra::quantization
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef NEAREST_CENTER_H
+#define NEAREST_CENTER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ra::quantization {
+
+// Cluster centers laid out as a structure of arrays: one array per
+// channel, so that a vector register holds the same channel of
+// several consecutive centers.
+// The arrays are padded to a multiple of center_soa::block centers
+// with sentinel centers that are farther from every colour than any
+// real center, so the kernels never need a remainder loop.
+class center_soa {
+   public:
+    // An unsigned integral type used to represent sizes.
+    using size_type = std::size_t;
+
+    // The number of centers the padded arrays are a multiple of.
+    static constexpr size_type block = 16;
+
+    // The channel value used for the padding centers.
+    static constexpr std::int32_t sentinel = 1 << 14;
+
+    // Constructs an empty set of centers.
+    center_soa() = default;
+
+    // Resizes the set to k centers. New centers are zero.
+    void resize(size_type k) {
+        size_ = k;
+        size_type padded = (k + block - 1) / block * block;
+        for (int c = 0; c < 4; c++) {
+            channels_[c].resize(padded, 0);
+            for (size_type j = k; j < padded; j++) {
+                channels_[c][j] = sentinel;
+            }
+        }
+        not_grey_ = 0;
+        not_opaque_ = 0;
+        for (size_type j = 0; j < k; j++) {
+            count(j, 1);
+        }
+    }
+
+    // Sets center j to the colour (c0, c1, c2, c3).
+    // Precondition: j < size()
+    void set(size_type j, int c0, int c1, int c2, int c3) {
+        count(j, -1);
+        channels_[0][j] = c0;
+        channels_[1][j] = c1;
+        channels_[2][j] = c2;
+        channels_[3][j] = c3;
+        count(j, 1);
+    }
+
+    // Declares the layout of the colours the centers are compared with
+    // (see colour_histogram::channels): 1 if they are all grey and
+    // opaque, (v, v, v, 255), 3 if they are all opaque, 4 otherwise.
+    void set_colour_channels(int channels) { colour_channels_ = channels; }
+
+    // Returns the number of channels the kernels compute: that of the
+    // colours, or more if some center does not have their layout. The
+    // distances are those over the four channels either way.
+    int channels() const {
+        if (colour_channels_ == 1 && not_grey_ == 0) {
+            return 1;
+        }
+        if (colour_channels_ <= 3 && not_opaque_ == 0) {
+            return 3;
+        }
+        return 4;
+    }
+
+    // Returns the number of (real) centers.
+    size_type size() const { return size_; }
+
+    // Returns the number of centers including the padding.
+    size_type padded_size() const { return channels_[0].size(); }
+
+    // Returns the array holding channel c of every center.
+    const std::int32_t *channel(int c) const { return channels_[c].data(); }
+
+   private:
+    // Adds n to the counts of the layouts center j does not have.
+    void count(size_type j, int n) {
+        bool opaque = channels_[3][j] == 255;
+        not_opaque_ += opaque ? 0 : n;
+        not_grey_ += opaque && channels_[0][j] == channels_[1][j] && channels_[1][j] == channels_[2][j] ? 0 : n;
+    }
+
+    size_type size_ = 0;
+    std::vector<std::int32_t> channels_[4];
+    int colour_channels_ = 4;
+    std::ptrdiff_t not_grey_ = 0;    // real centers that are not (v, v, v, 255)
+    std::ptrdiff_t not_opaque_ = 0;  // real centers whose channel 3 is not 255
+
+};
+
+// The instruction sets the nearest-center kernel is implemented for.
+enum class simd_level {
+    scalar = 0,  // portable C++
+    sse41,       // 4 centers per instruction
+    avx2,        // 8 centers per instruction
+};
+
+// Returns the best instruction set supported by the running CPU.
+simd_level detect_simd_level();
+
+// For each of the n packed colours (see pack_colour), finds the
+// nearest center by squared Euclidean distance over the 4 channels.
+// Only the channels that vary are computed (see center_soa::channels).
+// The index of that center is stored in index[i] and the squared
+// distance in dist[i]. Ties go to the center with the lowest index,
+// so every instruction set gives identical results.
+// The kernel used is the one returned by detect_simd_level().
+// Precondition: centers.size() > 0
+void nearest_centers(const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist);
+
+// As above, but uses the kernel for the given instruction set, which
+// must be supported by the running CPU.
+void nearest_centers(simd_level level, const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist);
+
+// As nearest_centers, but also stores in second[i] the squared distance
+// to the second nearest center (which may equal dist[i] on a tie).
+// If there is only one center, second[i] is the largest uint32_t.
+void nearest_two_centers(const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist, std::uint32_t *second);
+
+// As above, but uses the kernel for the given instruction set.
+void nearest_two_centers(simd_level level, const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist, std::uint32_t *second);
+
+}  // namespace ra::quantization
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef PALETTE_H
+#define PALETTE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ra::quantization {
+
+// Palette files hold the packed colours (see pack_colour) of a palette,
+// so that later runs can apply it or start clustering from it.
+// Layout, with every integer stored little-endian:
+//   4 bytes   magic "RAPL"
+//   uint32    format version (palette_version)
+//   uint32    number of colours n
+//   n uint32  packed colours, in palette order
+constexpr std::uint32_t palette_version = 1;
+
+namespace detail {
+
+inline void put_u32(std::ofstream &out, std::uint32_t x) {
+    char b[4] = {char(x & 0xff), char((x >> 8) & 0xff), char((x >> 16) & 0xff), char((x >> 24) & 0xff)};
+    out.write(b, 4);
+}
+
+inline std::uint32_t get_u32(std::ifstream &in) {
+    unsigned char b[4] = {};
+    in.read(reinterpret_cast<char *>(b), 4);
+    return std::uint32_t(b[0]) | (std::uint32_t(b[1]) << 8) | (std::uint32_t(b[2]) << 16) | (std::uint32_t(b[3]) << 24);
+}
+
+}  // namespace detail
+
+// Writes palette to the file at path, replacing it if it exists.
+// Throws std::runtime_error if the file cannot be written.
+inline void save_palette(const std::string &path, const std::vector<std::uint32_t> &palette) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("cannot create " + path);
+    }
+    out.write("RAPL", 4);
+    detail::put_u32(out, palette_version);
+    detail::put_u32(out, std::uint32_t(palette.size()));
+    for (std::uint32_t c : palette) {
+        detail::put_u32(out, c);
+    }
+    if (!out) {
+        throw std::runtime_error("write error on " + path);
+    }
+}
+
+// Reads the palette stored in the file at path.
+// Throws std::runtime_error if the file cannot be read, is not a
+// palette file, or holds no colours.
+inline std::vector<std::uint32_t> load_palette(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        throw std::runtime_error("cannot open " + path);
+    }
+    char magic[4] = {};
+    in.read(magic, 4);
+    if (!in || std::string(magic, 4) != "RAPL") {
+        throw std::runtime_error(path + " is not a palette file");
+    }
+    std::uint32_t version = detail::get_u32(in);
+    if (version != palette_version) {
+        throw std::runtime_error(path + " has unsupported palette version " + std::to_string(version));
+    }
+    std::uint32_t n = detail::get_u32(in);
+    if (!in || n == 0) {
+        throw std::runtime_error(path + " holds no colours");
+    }
+    // check the count against the file before allocating for it
+    std::streamoff at = in.tellg();
+    in.seekg(0, std::ios::end);
+    if (in.tellg() - at < 4 * std::streamoff(n)) {
+        throw std::runtime_error(path + " is truncated");
+    }
+    in.seekg(at);
+    std::vector<std::uint32_t> palette;
+    palette.reserve(n);
+    for (std::uint32_t i = 0; i < n && in; i++) {
+        palette.push_back(detail::get_u32(in));
+    }
+    if (!in) {
+        throw std::runtime_error(path + " is truncated");
+    }
+    return palette;
+}
+
+}  // namespace ra::quantization
+
+#endif
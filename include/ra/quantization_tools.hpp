@@ -2,272 +2,293 @@
 // V00810568
 // SENG475 - K_Means Quantization Project
 
+#ifndef QUANTIZATION_TOOLS_H
+#define QUANTIZATION_TOOLS_H
+
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <complex>
 #include <fstream>
+#include <future>
+#include <limits>
+#include <memory>
+#include <random>
+#include <stdexcept>
 #include <iostream>
 #include <string>
 #include "thread_pool.hpp"
+#include "histogram.hpp"
+#include "image_view.hpp"
+#include "nearest_center.hpp"
+#include "palette.hpp"
+#include "remap.hpp"
+#include "seeding.hpp"
+#include "stats.hpp"
+#include "tiles.hpp"
 #include <opencv2/opencv.hpp>
 #include <unordered_set>
+#include <vector>
 
 using namespace ra::concurrency;
 using namespace cv;
 using ul = unsigned long;
-using StdMutex = std::mutex;
-using Lock = std::unique_lock<std::mutex>;
 using Pixel = std::tuple<int, int, int, int>;
 namespace ra::quantization {
-    StdMutex cluster_centers_mu_;
-    StdMutex new_cluster_centers_mu_;
-    StdMutex unique_colours_mu_;
-
-    // init with k unique colours from image.
-    // these should have decent spacing relative to k value. If k is 255, then spacing is 1. if k is 2, spacing is 30?
-
-    void init_cluster_centers(std::map<Pixel, int> &unique_colours, std::map<Pixel, int> &cluster_centers, int k) { // have to pass in a ref to cluster_centers; also favourable to pass ref to unique_clusters for performance
-        std::map<Pixel, int>::iterator it;
-        Pixel p = {0,0,0,0};
-        cluster_centers[p] = 0; // set up k unique cluster centers
-        p = {255,255,255,255};
-        cluster_centers[p] = 0; // set up k unique cluster centers
-        while(cluster_centers.size() < (ul) k) { // for each center
-            int rand = std::rand() % unique_colours.size();
-            it = unique_colours.begin();
-            std::advance(it, rand);
-            cluster_centers[it->first] = 0; // set up k unique cluster centers
-        }
-    }
 
-    // Compute nearest cluster for every unique colour in image
-    double compute_cluster(Pixel colour, std::map<Pixel, int> &unique_colours, std::map<Pixel, int> &cluster_centers, std::map<Pixel, Pixel> &new_cluster_centers) {
-
-        int r = get<0>(colour);
-        int g = get<1>(colour);
-        int b = get<2>(colour);
-        int a = get<3>(colour);
-        Pixel cluster; // stores the tuple value of the associated cluster
-        ul dist = 0; // distance to colour value
-        ul min_dist = -1;
-        std::map<Pixel, int>::iterator it2;
-        for(it2 = cluster_centers.begin(); it2!= cluster_centers.end(); it2++){
-            ul d = get<0>(it2->first) - r;
-            dist = d*d;
-            d = get<1>(it2->first) - g;
-            dist += d*d;
-            d = get<2>(it2->first) - b;
-            dist += d*d;
-            d = get<3>(it2->first) - a;
-            dist += d*d;
-            if(it2 == cluster_centers.begin()) { // if no previous center allocated
-                cluster = it2->first;
-                min_dist = dist;
-            } else if (dist<min_dist) { // if this center is closer to this pixel than all other cluster_centers
-                cluster = it2->first;
-                min_dist = dist;
-            }                    
-        }
-        int i = unique_colours[colour];
-        cluster_centers_mu_.lock();
-        cluster_centers[cluster] += i; // add the number of pixels in the unique colour to the cluster
-        cluster_centers_mu_.unlock();
-
-        // add r, g, b, a of unique colours associated to cluster to pre-existing tuple value
-        new_cluster_centers_mu_.lock();
-        get<0>(new_cluster_centers[cluster]) += r*i;
-        get<1>(new_cluster_centers[cluster]) += g*i;
-        get<2>(new_cluster_centers[cluster]) += b*i;
-        get<3>(new_cluster_centers[cluster]) += a*i;     
-        new_cluster_centers_mu_.unlock();
-        return min_dist;
+    // The algorithm used for the k-means iterations
+    enum class kmeans_engine {
+        naive, // compare every unique colour with every center in every iteration
+        hamerly, // skip the comparisons that the triangle inequality proves cannot change an assignment
+        minibatch, // update the centers from small weighted samples of the histogram instead of all of it
+    };
+
+    // The way the initial cluster centers are chosen
+    enum class seeding_method {
+        automatic, // k-means|| for large histograms and k, k-means++ otherwise
+        kmeans_pp, // k-means++, weighted by pixel count
+        kmeans_parallel, // k-means||: a few parallel oversampling rounds, then k-means++ on the candidates
+    };
+
+    // Tunable parameters of quantize_image
+    struct quantize_options {
+        kmeans_engine engine = kmeans_engine::naive;
+        seeding_method seeding = seeding_method::automatic;
+        std::uint64_t seed = 0; // seed of the random number generator used for seeding
+        int max_iterations = 300; // upper limit on the number of k-means iterations (number of batches for minibatch)
+        int batch_size = 1024; // number of pixels sampled per minibatch iteration
+        std::vector<std::uint32_t> initial_palette; // if not empty, k-means starts from these packed colours (e.g. a saved palette) instead of seeding
+        double center_tolerance = 0; // stop once no center moves farther than this in an iteration (0: only when none moves); not used by minibatch
+        quantize_observer *observer = nullptr; // if not null, told about every phase of the run (see stats.hpp)
+    };
+
+    // Views of the pixels of a Mat, with its row stride, so that regions of interest and padded rows
+    // are read and written where they are
+    inline const_image_view view_of(const Mat &img) {
+        return const_image_view(img.data, img.rows, img.cols, img.channels(), int(img.elemSize1()) * 8, img.step[0]);
     }
 
-    // Get all unique colours in the image
-    void get_unique_colours(Mat img, std::map<Pixel, int> &unique_colours, int row, int cols) {
-        Pixel p;
-        for(int col = 0; col<cols; col++) {
-            p = {img.data[row * cols * 4 + col * 4], img.data[row * cols * 4 + col * 4 + 1], img.data[row * cols * 4 + col * 4 + 2] ,img.data[row * cols * 4 + col * 4 + 3]};
-            // insert only unique colours into map
-
-            unique_colours_mu_.lock();
-            if(unique_colours.contains(p)) {
-                unique_colours[p]++;
-            } else {
-                unique_colours[p] = 1;
-            }
-            unique_colours_mu_.unlock();
-
-        }
-        //std::cout<<"DONE ROW "<<row<<"\n";
+    inline image_view view_of(Mat &img) {
+        return image_view(img.data, img.rows, img.cols, img.channels(), int(img.elemSize1()) * 8, img.step[0]);
     }
 
-    void quantize_image(Mat img, Mat out, int k) {
-        int rows = img.rows;
-        int cols = img.cols;
-        int chans = img.channels();
-        std::map<Pixel, int> cluster_centers; // array of k cluster_centers pertaining to 'chans' colour channels, 
-        std::map<Pixel, Pixel> new_cluster_centers; // array of k cluster_center tuples pertaining to final pixel values after each k-means operation
-        std::map<Pixel, int> unique_colours; // store every unique colour in image, plus number of pixel members
-
-        thread_pool tp; // create thread pool with max possible num of threads for this hardware
-
-        // alpha: 0 is transparent, 255 is opaque
-        //Pixel p;
-        for(int row = 0; row< rows; row++) {
-            tp.schedule([&, row]() { // only pass 'row' by copy- pass all else by ref
-                get_unique_colours(img, unique_colours, row, cols);
-            });      
-        }
-        tp.block_until_idle();
-
-        if((ul) k > unique_colours.size()) {
-            std::cerr << "K value exceeds number of unique colours in image! Please choose a smaller k. " << std::endl;
-            exit(EXIT_FAILURE);
-        }
-
-        std::map<Pixel, int>::iterator it;
-        /*
-        for (it = unique_colours.begin(); it != unique_colours.end(); it++) {
-            //std::cout << get<0>(it->first) << " " << get<1>(it->first) << " " << get<2>(it->first) << " "<< get<3>(it->first) << ": "<< it->second << "\n"; // uncomment this line for a counted list of every unique colour 
-        }
-        */
-
-        std::cout<<"("<<rows<<"x"<<cols<<"x"<<chans<<"): "<<unique_colours.size()<<" COLOURS \n";
-
-        init_cluster_centers(unique_colours, cluster_centers, k);
-
-        std::cout<<"INITIAL CLUSTER CENTERS: \n";
-        for (it = cluster_centers.begin(); it != cluster_centers.end(); it++) {
-            std::cout << get<0>(it->first) << " " << get<1>(it->first) << " " << get<2>(it->first) << " "<< get<3>(it->first) << "\n "; // get cluster center, count
-        }
-
-        // at this point we have n unique colours and k randomly initialized cluster centers
-        ul prev_dist = -1; // first run
-        ul iter_dist = -1;
-        std::map<Pixel, Pixel>::iterator it3;
-        ul negative_one = -1;
-        //std::cout<<"FLAG\n";
-
-        while( (prev_dist/iter_dist < 0.999999 && prev_dist/iter_dist > 1.000001) || iter_dist == negative_one || prev_dist == negative_one){ // continue iterating until acceptable
- 
-            if(iter_dist != negative_one) {
-                prev_dist = iter_dist;
-            }
-
-            iter_dist = 0;
-            
-            // reset cluster_centers, clear new_cluster_centers 
-            new_cluster_centers.clear(); 
-            std::map<Pixel, int>::iterator it5;
-            for (it5 = cluster_centers.begin(); it5 != cluster_centers.end(); it5++) {
-                new_cluster_centers[it5->first] = {0,0,0,0}; // - this will hold the next iteration of cluster centers modified from the previous iteration
-            }
-            //std::cout<<"FLAG10\n";
-            //go through every unique colour, and compute its distance from a cluster center. If it falls within that cluster, add all of its pixels to the pixel count of that cluster center.
-            std::map<Pixel, int>::iterator it6 = unique_colours.begin();
-            Pixel p2;
-            for(ul i = 0; i< unique_colours.size(); i++) {
-            //for (it = unique_colours.begin(); it != unique_colours.end(); it++) {
-                p2 = it6->first;
-                tp.schedule([&, p2]() { // pass 'p2' by copy- pass all else by ref
-                    iter_dist += compute_cluster(p2, unique_colours, cluster_centers, new_cluster_centers);
-                });  
-                it6++;
-                //std::cout<<"...\n";
-            }
-            tp.block_until_idle();
-            // confirm all clusters have been calculated before moving on! Use block_until_idle to ensure all threads complete
-            //std::cout<<"FLAG6\n";
-
-
-            /*
-            std::cout<<"NEW CLUSTER CENTERS: \n";
-            for (it3 = new_cluster_centers.begin(); it3 != new_cluster_centers.end(); it3++) {
-                std::cout << get<0>(it3->first) << " " << get<1>(it3->first) << " " << get<2>(it3->first) << " "<< get<3>(it3->first) << ": " << get<0>(it3->second) << " " << get<1>(it3->second) << " " << get<2>(it3->second) << " "<< get<3>(it3->second)  <<"\n"; // get cluster center, count
-            }
-            */
-
-            // now compute next iteration of cluster centers
-            //std::cout<<"CLUSTER CENTER COUNTS: \n";
-
-            for (it3 = new_cluster_centers.begin(); it3 != new_cluster_centers.end(); it3++) { // iterate through new cluster center values
-                Pixel old_center = it3->first; //save the Pixel value the old cluster
-                int n = cluster_centers[old_center]; // get the total number of pixels within that cluster
-                //std::cout << get<0>(old_center) << " " << get<1>(old_center) << " " << get<2>(old_center) << " "<< get<3>(old_center) << ": " << n << "\n";
-                cluster_centers.erase(old_center); // get rid of old cluster
-                //std::cout<<get<0>(it3->second)+n-1<<"/"<<(double)n<<"\n";
-                //std::cout<<get<1>(it3->second)+n-1<<"/"<<(double)n<<"\n";
-                //std::cout<<get<2>(it3->second)+n-1<<"/"<<(double)n<<"\n";
-                //std::cout<<get<3>(it3->second)+n-1<<"/"<<(double)n<<"\n";
-
-                int r = (double)(get<0>(it3->second)+n-1)/(double)n;
-                int g = (double)(get<1>(it3->second)+n-1)/(double)n;
-                int b = (double)(get<2>(it3->second)+n-1)/(double)n;
-                int a = (double)(get<3>(it3->second)+n-1)/(double)n;
-                //std::cout<<r<<"\n";
-                //std::cout<<g<<"\n";
-                //std::cout<<b<<"\n";
-                //std::cout<<a<<"\n";
-
-                Pixel new_center = {r, g, b, a}; // establish new cluster to replace old
-                //std::cout<<"FLAG11\n";
-                cluster_centers[new_center] = 0;
-            }
-
-            std::cout<<"ITERATING... "<<iter_dist<<"\n";
-        }
-
-        // after while loop is over, do one last computation to find which cluster each unique colour belongs to 
-        std::map<Pixel, int>::iterator it2;
-        std::map<Pixel, Pixel> unique_colour_clusters; // store every unique colour in image, plus number of pixel members
-        for (it = unique_colours.begin(); it != unique_colours.end(); it++) {
-            int r = get<0>(it->first);
-            int g = get<1>(it->first);
-            int b = get<2>(it->first);
-            int a = get<3>(it->first);
-            Pixel cluster; // stores the tuple value of the chosen cluster
-            ul dist = 0; // distance to colour value
-            ul min_dist = -1;
-            for(it2 = cluster_centers.begin(); it2!= cluster_centers.end(); it2++){
-                ul d = get<0>(it2->first) - r;
-                dist = d*d;
-                d = get<1>(it2->first) - g;
-                dist += d*d;
-                d = get<2>(it2->first) - b;
-                dist += d*d;
-                d = get<3>(it2->first) - a;
-                dist += d*d;
-                if(it2 == cluster_centers.begin()) { // if no previous center allocated
-                    cluster = it2->first;
-                    min_dist = dist;
-                } else if (dist<min_dist) { // if this center is closer to this pixel than all other cluster_centers
-                    cluster = it2->first;
-                    min_dist = dist;
-                }                    
-            }
-            // at this point, we have the final cluster this unique colour belongs to. add to unique_colour_clusters
-            unique_colour_clusters[it->first] = cluster;
-        }
-
-        // write clusters to output
-        for(int row = 0; row<rows; row++) {
-            for(int col = 0; col<cols; col++) {
-                // 
-                Pixel o = {img.data[row * cols * 4 + col * 4], img.data[row * cols * 4 + col * 4 + 1], img.data[row * cols * 4 + col * 4 + 2], img.data[row * cols * 4 + col * 4 + 3]};
-                // o is a unique colour
-                o = unique_colour_clusters[o];
-                // o is now a cluster colour
-
-                out.data[row * cols * 4 + col * 4] = get<0>(o);
-                out.data[row * cols * 4 + col * 4 + 1] = get<1>(o);
-                out.data[row * cols * 4 + col * 4 + 2] = get<2>(o);   
-                out.data[row * cols * 4 + col * 4 + 3] = get<3>(o);                    
-            }
-        }
-        
-        std::cout<<"FINAL CLUSTER CENTERS: \n";
-        for (it = cluster_centers.begin(); it != cluster_centers.end(); it++) {
-            std::cout << get<0>(it->first) << " " << get<1>(it->first) << " " << get<2>(it->first) << " "<< get<3>(it->first) << "\n"; // get cluster center, count
-        }     
+    // Unpack a histogram colour into a Pixel tuple
+    inline Pixel to_pixel(std::uint32_t colour) {
+        return {colour_channel(colour, 0), colour_channel(colour, 1), colour_channel(colour, 2), colour_channel(colour, 3)};
     }
-}  // namespace ra::quantization
\ No newline at end of file
+
+    // The outcome of clustering a histogram: the palette (one packed colour per cluster) and, for
+    // every colour of the histogram, the index of the palette entry it belongs to
+    struct clustering {
+        std::vector<std::uint32_t> palette;
+        std::vector<std::uint32_t> assignment;
+        int iterations = 0; // k-means iterations (minibatch batches) run
+    };
+
+    // init with k unique colours from image, spread out across the histogram by k-means++ or k-means||
+    // (or with options.initial_palette, which must then hold k colours)
+    void init_cluster_centers(thread_pool &tp, const colour_histogram &unique_colours, std::vector<Pixel> &cluster_centers, int k, const quantize_options &options);
+
+    // Find the nearest palette entry of every colour of a histogram, one block of colours per thread
+    std::vector<std::uint32_t> assign_palette(thread_pool &tp, const colour_histogram &unique_colours, const std::vector<std::uint32_t> &palette);
+
+    // Cluster the colours of a histogram into k palette entries. The seeding and kmeans phases and
+    // every iteration are reported to options.observer, if any.
+    clustering cluster_colours(thread_pool &tp, const colour_histogram &unique_colours, int k, const quantize_options &options);
+
+    // The buffers of a clustering run (per-thread sums, centers and Hamerly bounds), kept by a
+    // quantizer between runs; defined in quantization_tools.cpp
+    struct cluster_workspace;
+
+    // Quantizes images one after the other into palettes of k colours, or maps them onto a given
+    // palette. The thread pool, the histogram tables, the k-means buffers, the assignment and the
+    // lookup table are all kept between calls, so once a few images of similar size have gone
+    // through, a call spawns no threads and allocates (almost) nothing. The pool is either owned,
+    // or borrowed from the caller, in which case it must outlive the quantizer.
+    // A quantizer must not be used by several threads at once; quantizers may share a pool.
+    class quantizer {
+       public:
+        // Quantizes on a pool of its own, with max possible num of threads for this hardware
+        explicit quantizer(const quantize_options &options = {});
+
+        // Quantizes on a pool of its own, with num_threads threads
+        explicit quantizer(std::size_t num_threads, const quantize_options &options = {});
+
+        // Quantizes on a pool of its own, with the threads and placement of pool
+        // Throws std::invalid_argument as the thread_pool constructor does
+        explicit quantizer(const pool_options &pool, const quantize_options &options = {});
+
+        // Quantizes on the threads of tp
+        explicit quantizer(thread_pool &tp, const quantize_options &options = {});
+
+        quantizer(const quantizer &) = delete;
+        quantizer &operator=(const quantizer &) = delete;
+        ~quantizer();
+
+        // The options used by the following calls
+        const quantize_options &options() const { return options_; }
+        void set_options(const quantize_options &options) { options_ = options; }
+
+        // The pool the work runs on
+        thread_pool &pool() { return tp_; }
+
+        // Quantize an image into out, as quantize_image does, and return the palette, which stays
+        // valid until the next call.
+        // Throws std::invalid_argument if the image has fewer than k unique colours, or another type.
+        const std::vector<std::uint32_t> &quantize(Mat img, Mat out, int k);
+
+        // As above, on pixels held by the caller. The rows of img and out may be padded, and out may
+        // be img itself, so that an image is quantized without a copy.
+        const std::vector<std::uint32_t> &quantize(const const_image_view &img, const image_view &out, int k);
+
+        // Map every pixel of an image to its nearest entry of palette, writing the result into out,
+        // as apply_palette does.
+        // Precondition: !palette.empty()
+        void apply(Mat img, Mat out, const std::vector<std::uint32_t> &palette);
+
+        // As above, on pixels held by the caller.
+        void apply(const const_image_view &img, const image_view &out, const std::vector<std::uint32_t> &palette);
+
+        // Quantize an image as quantize does, but write the palette index of every pixel into indices,
+        // an 8-bit single-channel image of the same size, instead of its colour: a quarter of the
+        // memory of an RGBA output, ready for write_indexed_png (see indexed_png.hpp).
+        // Throws std::invalid_argument if k > 256, or as quantize does.
+        const std::vector<std::uint32_t> &quantize_indexed(Mat img, Mat indices, int k);
+        const std::vector<std::uint32_t> &quantize_indexed(const const_image_view &img, const image_view &indices, int k);
+
+        // As apply, into an image of palette indices.
+        // Precondition: !palette.empty() && palette.size() <= 256
+        void apply_indexed(Mat img, Mat indices, const std::vector<std::uint32_t> &palette);
+        void apply_indexed(const const_image_view &img, const image_view &indices, const std::vector<std::uint32_t> &palette);
+
+       private:
+        // quantize and apply for 8-bit images, into colours or into indices
+        const std::vector<std::uint32_t> &quantize_pixels(const const_image_view &img, const image_view &out, int k, bool indexed);
+        void apply_pixels(const const_image_view &img, const image_view &out, const std::vector<std::uint32_t> &palette, bool indexed);
+
+        // quantize and apply for 16-bit images
+        const std::vector<std::uint32_t> &quantize_samples(const const_image_view &img, const image_view &out, int k);
+        void apply_samples(const const_image_view &img, const image_view &out, const std::vector<std::uint32_t> &palette);
+
+        std::unique_ptr<thread_pool> own_pool_; // null if the pool is borrowed
+        thread_pool &tp_;
+        quantize_options options_;
+        histogram_builder builder_;
+        colour_histogram unique_colours_; // the histogram of the last image
+        std::unique_ptr<cluster_workspace> workspace_;
+        clustering result_; // the palette and assignment of the last image
+        remap_table table_;
+        sample_histogram samples_; // the histogram of the last 16-bit image
+    };
+
+    // Quantize an 8-bit image with 1, 3 or 4 channels into out (of the same size and type, and possibly
+    // img itself), using the threads of tp. Rows are read and written with the stride of each Mat, so
+    // regions of interest need no copy. The image is processed in its own layout; its colours (and
+    // the palette) are those it has once expanded to RGBA, as by load_colour, so grey images get grey
+    // palettes.
+    // A 16-bit single-channel image is quantized on its original sample values, with a
+    // histogram indexed by value and one-dimensional k-means (options.engine does not apply). Its
+    // palette holds sample values, and out receives either the value of every pixel's center (a
+    // 16-bit single-channel out) or its palette index (an 8-bit single-channel out, for k <= 256).
+    // Returns the palette, which can be saved with save_palette and applied to other images.
+    // To quantize many images, use a quantizer, which keeps its buffers between calls.
+    // Throws std::invalid_argument if the image has fewer than k unique colours, or another type.
+    std::vector<std::uint32_t> quantize_image(thread_pool &tp, Mat img, Mat out, int k, const quantize_options &options = {});
+
+    // As above, on a thread pool with max possible num of threads for this hardware
+    std::vector<std::uint32_t> quantize_image(Mat img, Mat out, int k, const quantize_options &options = {});
+
+    // Map every pixel of an 8-bit image with 1, 3 or 4 channels to its nearest entry of an
+    // existing palette, writing the result into out (of the same size and type). A 16-bit image takes
+    // a palette of sample values and an out as for quantize_image. No clustering is done: this only
+    // builds the histogram and the lookup table.
+    // The run is reported to observer, if any.
+    // Precondition: !palette.empty()
+    void apply_palette(thread_pool &tp, Mat img, Mat out, const std::vector<std::uint32_t> &palette, quantize_observer *observer = nullptr);
+
+    // Quantizes the frames of a sequence (e.g. a video or a time-lapse) one after the other. The first
+    // frame is quantized as by quantize_image. Every later frame starts k-means from the palette of
+    // the frame before, so palette entries keep their index and colours change little between frames,
+    // and its histogram is updated from the pixels that changed instead of being rebuilt. With a
+    // center_tolerance, k-means stops as soon as the centers settle, which for a static scene is
+    // after the first iteration, leaving little more than the remap.
+    class sequence_quantizer {
+       public:
+        // Quantizes frames into k colours on the threads of tp.
+        sequence_quantizer(thread_pool &tp, int k, const quantize_options &options = {});
+
+        sequence_quantizer(const sequence_quantizer &) = delete;
+        sequence_quantizer &operator=(const sequence_quantizer &) = delete;
+        ~sequence_quantizer();
+
+        // Quantize the next frame, an 8-bit image with 1, 3 or 4 channels, into out (of the same size
+        // and type, and possibly the frame itself), and return its palette. A frame of a different
+        // size or channel count than the one before starts over.
+        // Throws std::invalid_argument if the first frame has fewer than k unique colours.
+        const std::vector<std::uint32_t> &next(Mat frame, Mat out);
+
+        // As above, on pixels held by the caller.
+        const std::vector<std::uint32_t> &next(const const_image_view &frame, const image_view &out);
+
+        // Returns the number of pixels that changed between the last two frames (zero after a frame
+        // that started over).
+        std::size_t changed_pixels() const { return changed_; }
+
+       private:
+        thread_pool &tp_;
+        int k_;
+        quantize_options options_;
+        int rows_ = 0;
+        int cols_ = 0;
+        int channels_ = 0;
+        std::unique_ptr<std::uint8_t[]> prev_; // the pixels of the last frame, without row padding
+        std::size_t prev_size_ = 0; // the bytes allocated for them
+        colour_histogram unique_colours_; // the histogram of the last frame
+        std::vector<std::uint32_t> palette_; // the palette of the last frame
+        std::unique_ptr<cluster_workspace> workspace_;
+        clustering result_;
+        remap_table table_;
+        std::size_t changed_ = 0;
+    };
+
+    // Tile source over an 8-bit 1, 3 or 4 channel (or 16-bit 1 channel) image, converting every
+    // tile to 4 channels as it is read, the same way the command line tool converts whole images
+    class mat_tile_source : public tile_source {
+       public:
+        explicit mat_tile_source(const Mat &img) : img_(img) {}
+
+        int rows() const override { return img_.rows; }
+        int cols() const override { return img_.cols; }
+
+        void read(const tile_rect &rect, std::uint8_t *data) override;
+
+       private:
+        Mat img_;
+    };
+
+    // Quantize the image of source into sink in two passes over tiles of at most tile_size x
+    // tile_size pixels: the first pass builds the histogram, the second remaps and writes every
+    // tile. Besides the histogram and its lookup table, only two tiles are held in memory: the next
+    // tile is read on the pool while the current one is processed.
+    // Returns the palette.
+    // Throws std::invalid_argument if the image has fewer than k unique colours.
+    std::vector<std::uint32_t> quantize_tiles(thread_pool &tp, tile_source &source, tile_sink &sink, int k, const quantize_options &options = {},
+                                              int tile_size = 1024);
+
+    // As above, on a thread pool with max possible num of threads for this hardware
+    std::vector<std::uint32_t> quantize_tiles(tile_source &source, tile_sink &sink, int k, const quantize_options &options = {}, int tile_size = 1024);
+
+    // Apply an existing palette to the image of source, writing the result into sink. Since nothing
+    // is clustered, this takes a single pass: every tile is mapped through a lookup table of its own
+    // colours as soon as it is read. The whole pass is reported to observer, if any, as the remap phase.
+    // Precondition: !palette.empty()
+    void apply_palette_tiles(thread_pool &tp, tile_source &source, tile_sink &sink, const std::vector<std::uint32_t> &palette, int tile_size = 1024,
+                             quantize_observer *observer = nullptr);
+
+    // As above, on a thread pool with max possible num of threads for this hardware
+    void apply_palette_tiles(tile_source &source, tile_sink &sink, const std::vector<std::uint32_t> &palette, int tile_size = 1024, quantize_observer *observer = nullptr);
+
+}  // namespace ra::quantization
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
+#include <atomic>
 #include <condition_variable>
 #include <iostream>
 #include <list>
@@ -25,8 +26,8 @@ class queue {
     // A type for the status of a queue operation.
     enum class status {
         success = 0,  // operation successful
-        empty,        // 1; queue is empty (not currently used)
-        full,         // 2; queue is full (not currently used)
+        empty,        // 1; queue is empty (try_pop only)
+        full,         // 2; queue is full (try_push only)
         closed,       // 3; queue is closed
     };
 
@@ -55,14 +56,9 @@ class queue {
     // Destroys the queue after closing the queue (if not already
     // closed) and clearing the queue (if not already empty).
     ~queue() {
-        // std::cout << "QUEUE DESTRUCTOR...\n";
-
         Lock l(m_);
         closed_ = true;
-        q_.clear();
-        q_.~list();  // call destructor
-
-        // lock goes out of scope -> destructs
+        q_.clear();  // q_ itself is destroyed with the queue
     }
 
     // Inserts the value x at the end of the queue, blocking if
@@ -83,27 +79,42 @@ class queue {
         if (is_closed()) {
             return status::closed;  // dont insert anything
         }
-        Lock lk(push_m_);        // wait for lock, if possible
-        if (!is_full()) { 
+        {
+            Lock lk(push_m_);  // one pusher at a time
+            not_full_.wait(lk, [this] { return !is_full() || is_closed(); });  // wait for room
+            if (is_closed()) {
+                return status::closed;
+            }
             m_.lock();
             q_.push_back(std::move(x));
-            qcv_.notify_one();  // alert condition variable
             m_.unlock();
-            return status::success;  
-        } 
+        }
+        // notify under pop_m_: a popper has then either not yet checked
+        // for an element, or is already waiting, so the notify is not lost
+        Lock lk(pop_m_);
+        not_empty_.notify_one();
+        return status::success;
+    }
 
-        // if queue full,
-        qcv_.wait(lk, [this] {
-            if (is_full()) {
-                qcv_.notify_one();  // notify pops
+    // Inserts the value x at the end of the queue if there is room.
+    // Returns status::success, status::full (x is left unchanged) or
+    // status::closed.
+    // This function is thread safe and does not wait for room.
+    status try_push(value_type &&x) {
+        if (is_closed()) {
+            return status::closed;
+        }
+        {
+            Lock lk(push_m_);  // a blocked pusher must not find its room taken
+            Lock l(m_);
+            if (q_.size() == max_size_) {
+                return status::full;
             }
-            return !is_full();
-        });  // unblocks
-        m_.lock();
-        q_.push_back(std::move(x));
-        qcv_.notify_one(); // only notify pop after a push commences
-        m_.unlock();
-        return status::success;  // alert cond var
+            q_.push_back(std::move(x));
+        }
+        Lock lk(pop_m_);
+        not_empty_.notify_one();
+        return status::success;
     }
 
     // Removes the value from the front of the queue and places it
@@ -122,36 +133,44 @@ class queue {
     // This function is thread safe.
     status pop(value_type &x) {
         //std::cout<<"Q POP\n";
-        if (is_closed() && is_empty()) {
-            return status::closed;
-        }
-
-        Lock lk(pop_m_);
-        if (!is_empty()) { 
+        {
+            Lock lk(pop_m_);  // one popper at a time
+            not_empty_.wait(lk, [this] { return !is_empty() || is_closed(); });  // wait for an element
             m_.lock();
-            x = q_.front();  // call copy constructor
+            if (q_.empty()) {  // closed and empty
+                m_.unlock();
+                return status::closed;
+            }
+            x = std::move(q_.front());
             q_.pop_front();
-            qcv_.notify_one();  // alert condition variable
             m_.unlock();
-            return status::success;  
-        } 
-
-        qcv_.wait(lk, [this] {
-            if (is_empty()) {
-                qcv_.notify_one();  // notify pops
-            }
-            // std::cout << "QUEUE LAMBDA POP...\n";
-            return !is_empty();
-        });  // unlocks lock
-        m_.lock();
-        x = q_.front();  // call copy constructor
-        q_.pop_front();
-        qcv_.notify_one();
-        m_.unlock();
+        }
+        // notify under push_m_, for the same reason as in push
+        Lock lk(push_m_);
+        not_full_.notify_one();
         //std::cout<<"Q POP DONE\n";
-
         return status::success;
     }
+    // Removes the value from the front of the queue, if any, and
+    // places it in x.
+    // Returns status::success, status::empty, or status::closed if the
+    // queue is both empty and closed.
+    // This function is thread safe and does not wait for an element.
+    status try_pop(value_type &x) {
+        {
+            Lock lk(pop_m_);
+            Lock l(m_);
+            if (q_.empty()) {
+                return is_closed() ? status::closed : status::empty;
+            }
+            x = std::move(q_.front());
+            q_.pop_front();
+        }
+        Lock lk(push_m_);
+        not_full_.notify_one();
+        return status::success;
+    }
+
     // Closes the queue.
     // The queue is placed in the closed state.
     // The closed state prevents more items from being inserted
@@ -160,8 +179,17 @@ class queue {
     // Invoking this function on a closed queue has no effect.
     // This function is thread safe.
     void close() {
-        Lock l(m_);  // create a lock to check closed_status
-        closed_ = true;
+        {
+            Lock l(m_);  // create a lock to check closed_status
+            closed_ = true;
+        }
+        // wake blocked pushers and poppers so that they can return
+        {
+            Lock l(push_m_);
+            not_full_.notify_all();
+        }
+        Lock l(pop_m_);
+        not_empty_.notify_all();
     }
 
     // Clears the queue.
@@ -198,7 +226,7 @@ class queue {
     size_type max_size() const { return max_size_; }
 
    private:
-    bool closed_;
+    std::atomic<bool> closed_;
     size_type max_size_;
     status s_;
     std::list<value_type> q_;
@@ -206,7 +234,8 @@ class queue {
     Mutex push_m_;  // being used
     Mutex pop_m_;  // being used
 
-    CV qcv_;
+    CV not_full_;   // pushers wait on this (with push_m_)
+    CV not_empty_;  // poppers wait on this (with pop_m_)
 };
 
 // want to be able to push and pop without blocking one another
@@ -0,0 +1,126 @@
+#ifndef RAW_IMAGE_H
+#define RAW_IMAGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "./image_view.hpp"
+
+namespace ra::quantization {
+
+// Raw image files hold pixels exactly as the library reads and writes
+// them, so that pipelines which already have pixel buffers skip image
+// decoding and encoding: the files are memory-mapped, the histogram is
+// built straight from the mapping of the input, and the remap writes
+// straight into the mapping of the output.
+// Layout, with every integer stored little-endian:
+//   4 bytes   magic "RAIM"
+//   uint32    format version (raw_image_version)
+//   uint32    rows
+//   uint32    cols
+//   uint32    channels (1, 3 or 4)
+//   uint32    bits per sample (8 or 16)
+//   uint32    number of palette entries n (0 unless the pixels are
+//             palette indices)
+//   uint32    offset of the pixels from the start of the file
+//   n uint32  palette: packed colours (see pack_colour), or the sample
+//             values of a 16-bit image
+//   padding up to the offset, a multiple of 64
+//   pixels    rows x cols x channels samples, row after row, with no
+//             row padding
+constexpr std::uint32_t raw_image_version = 1;
+
+// Returns true if the file at path starts like a raw image file.
+bool is_raw_image(const std::string &path);
+
+namespace detail {
+
+// A file mapped into memory, unmapped on destruction. Move-only.
+class mapped_file {
+   public:
+    mapped_file() = default;
+    mapped_file(mapped_file &&other) noexcept;
+    mapped_file &operator=(mapped_file &&other) noexcept;
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+    ~mapped_file();
+
+    // Maps the size bytes of the file at path, read-only or read-write.
+    // Throws std::runtime_error if the file cannot be mapped.
+    mapped_file(const std::string &path, std::size_t size, bool writable);
+
+    std::uint8_t *data() const { return data_; }
+    std::size_t size() const { return size_; }
+
+   private:
+    std::uint8_t *data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+}  // namespace detail
+
+// A raw image file mapped for reading.
+class mapped_raw_image {
+   public:
+    // Maps the raw image file at path.
+    // Throws std::runtime_error if it cannot be read, is not a raw image
+    // file, has a pixel offset that is not a multiple of 64, or is
+    // truncated.
+    explicit mapped_raw_image(const std::string &path);
+
+    int rows() const { return rows_; }
+    int cols() const { return cols_; }
+    int channels() const { return channels_; }
+    int bits() const { return bits_; }
+
+    // Returns the palette of an image of indices, or an empty palette.
+    const std::vector<std::uint32_t> &palette() const { return palette_; }
+
+    // Returns a view of the pixels, valid while this object lives.
+    const_image_view view() const;
+
+   private:
+    detail::mapped_file file_;
+    int rows_ = 0;
+    int cols_ = 0;
+    int channels_ = 0;
+    int bits_ = 0;
+    std::size_t offset_ = 0;
+    std::vector<std::uint32_t> palette_;
+};
+
+// A raw image file created, sized and mapped for writing.
+class mapped_raw_output {
+   public:
+    // Creates (or replaces) the raw image file at path for an image of
+    // rows x cols pixels of channels (1, 3 or 4) samples of bits (8 or
+    // 16) bits, with room for palette_entries palette entries, and maps
+    // it. The pixels start out zero.
+    // Throws std::invalid_argument for an unsupported shape, and
+    // std::runtime_error if the file cannot be created.
+    mapped_raw_output(const std::string &path, int rows, int cols, int channels, int bits, std::size_t palette_entries = 0);
+
+    // Stores the palette of an image of indices.
+    // Throws std::invalid_argument if its size is not the number of
+    // entries the file was created with.
+    void set_palette(const std::vector<std::uint32_t> &palette);
+
+    // Returns a view of the pixels, valid while this object lives.
+    // What is written through it reaches the file.
+    image_view view() const;
+
+   private:
+    detail::mapped_file file_;
+    int rows_;
+    int cols_;
+    int channels_;
+    int bits_;
+    std::size_t palette_entries_;
+    std::size_t offset_;
+};
+
+}  // namespace ra::quantization
+
+#endif
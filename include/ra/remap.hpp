@@ -0,0 +1,230 @@
+#ifndef REMAP_H
+#define REMAP_H
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "./histogram.hpp"
+#include "./image_view.hpp"
+#include "./thread_pool.hpp"
+
+namespace ra::quantization {
+
+// Lookup table mapping every colour of a histogram to the index of the
+// palette entry (cluster) it was assigned to.
+// The table has the same hash partitions as the histogram it is built
+// from, and each partition is a flat open-addressing array, so that a
+// lookup is a hash, a shift and (usually) one probe.
+class remap_table {
+   public:
+    using size_type = std::size_t;
+
+    // Constructs an empty table, to be filled by build.
+    remap_table() = default;
+
+    // Builds the table for the colours of hist, where colour
+    // hist.colours[i] maps to palette entry assignment[i].
+    remap_table(ra::concurrency::thread_pool &tp, const colour_histogram &hist, const std::uint32_t *assignment) { build(tp, hist, assignment); }
+
+    // Replaces the contents of the table with the colours of hist, as
+    // the constructor does. The partitions are filled in parallel, one
+    // per task, and their slot arrays are reused.
+    void build(ra::concurrency::thread_pool &tp, const colour_histogram &hist, const std::uint32_t *assignment) {
+        bits_ = hist.partition_bits;
+        parts_.resize(size_type(1) << hist.partition_bits);
+        tp.parallel_for(0, parts_.size(), 1, [&](size_type p_first, size_type p_last) {
+            for (size_type p = p_first; p < p_last; p++) {
+                size_type first = hist.partitions[p];
+                size_type last = hist.partitions[p + 1];
+                part &t = parts_[p];
+                size_type n = 16;
+                while (n < 2 * (last - first)) {
+                    n *= 2;
+                }
+                t.slots.assign(n, slot{0, empty});
+                t.mask = n - 1;
+                for (size_type i = first; i < last; i++) {
+                    std::uint32_t c = hist.colours[i];
+                    size_type s = colour_table::hash(c) & t.mask;
+                    while (t.slots[s].index != empty) {
+                        s = (s + 1) & t.mask;
+                    }
+                    t.slots[s] = slot{c, assignment[i]};
+                }
+            }
+        });
+    }
+
+    // Returns the palette index of a colour.
+    // Precondition: the colour is in the histogram the table was built
+    // from.
+    std::uint32_t find(std::uint32_t colour) const {
+        std::uint32_t h = colour_table::hash(colour);
+        const part &t = parts_[bits_ ? h >> (32 - bits_) : 0];
+        size_type s = h & t.mask;
+        while (t.slots[s].colour != colour) {
+            s = (s + 1) & t.mask;
+        }
+        return t.slots[s].index;
+    }
+
+   private:
+    static constexpr std::uint32_t empty = std::uint32_t(-1);
+
+    struct slot {
+        std::uint32_t colour;
+        std::uint32_t index;
+    };
+
+    struct part {
+        std::vector<slot> slots;
+        size_type mask = 0;
+    };
+
+    int bits_ = 0;
+    std::vector<part> parts_;
+};
+
+// Writes the quantized version of an 8-bit image with C channels (1, 3
+// or 4): every pixel of in is replaced by palette[table.find(pixel)] in
+// out, an image of the same size and channels, where the palette holds
+// packed colours and pixels are packed as by load_colour. in and out may
+// be the same image.
+// The rows are split into blocks that are written in parallel. Runs of
+// identical input pixels are looked up once and written with a single
+// fill, which the compiler turns into vector stores; 1-channel pixels
+// go through a 256-entry table instead.
+template <int C>
+inline void remap_pixels(ra::concurrency::thread_pool &tp, const remap_table &table, const std::vector<std::uint32_t> &palette,
+                         const const_image_view &in, const image_view &out) {
+    // pixels are read and written as whole 32-bit words, which only match pack_colour on little-endian hosts
+    static_assert(std::endian::native == std::endian::little);
+    using size_type = std::size_t;
+    int rows = in.rows;
+    // a few blocks per thread, so that uneven rows even out
+    size_type blocks = std::max<size_type>(1, std::min<size_type>(4 * tp.size(), rows));
+    tp.parallel_for(0, blocks, 1, [&](size_type b_first, size_type b_last) {
+        for (size_type b = b_first; b < b_last; b++) {
+            int first = rows * b / blocks;
+            int last = rows * (b + 1) / blocks;
+            if constexpr (C == 1) {
+                // grey values are looked up the first time the block meets them
+                std::int32_t grey[256];
+                std::fill(grey, grey + 256, -1);
+                for_each_span(in, out, first, last, [&](const std::uint8_t *p, std::uint8_t *q, size_type n) {
+                    for (size_type i = 0; i < n; i++) {
+                        std::uint8_t v = p[i];
+                        if (grey[v] < 0) {
+                            grey[v] = colour_channel(palette[table.find(pack_colour(v, v, v, 255))], 0);
+                        }
+                        q[i] = grey[v];
+                    }
+                });
+            } else if constexpr (C == 3) {
+                for_each_span(in, out, first, last, [&](const std::uint8_t *p, std::uint8_t *q, size_type n) {
+                    for (size_type i = 0; i < n;) {
+                        std::uint32_t c = load_colour<3>(p + i * 3);
+                        std::uint32_t v = palette[table.find(c)];
+                        // the run is found before it is written, since out may be in
+                        size_type run = i + 1;
+                        while (run < n && load_colour<3>(p + run * 3) == c) {
+                            run++;
+                        }
+                        for (; i < run; i++) {
+                            store_colour<3>(q + i * 3, v);
+                        }
+                    }
+                });
+            } else {
+                std::vector<std::uint32_t> line(std::min<size_type>(size_type(last - first) * in.cols, 4096));
+                for_each_span(in, out, first, last, [&](const std::uint8_t *p, std::uint8_t *q, size_type n) {
+                    for (size_type i = 0; i < n;) {
+                        size_type m = std::min(line.size(), n - i);
+                        std::memcpy(line.data(), p + i * 4, m * 4);
+                        size_type t = 0;
+                        while (t < m) {
+                            std::uint32_t c = line[t];
+                            size_type run = t + 1;
+                            while (run < m && line[run] == c) {
+                                run++;
+                            }
+                            std::fill(line.begin() + t, line.begin() + run, palette[table.find(c)]);
+                            t = run;
+                        }
+                        std::memcpy(q + i * 4, line.data(), m * 4);
+                        i += m;
+                    }
+                });
+            }
+        }
+    });
+}
+
+// remap_pixels for an image with any number of channels (1, 3 or 4).
+inline void remap_image(ra::concurrency::thread_pool &tp, const remap_table &table, const std::vector<std::uint32_t> &palette,
+                        const const_image_view &in, const image_view &out) {
+    with_channels(in.channels, [&](auto c) { remap_pixels<decltype(c)::value>(tp, table, palette, in, out); });
+}
+
+// As above, for continuous images of rows x cols pixels.
+inline void remap_image(ra::concurrency::thread_pool &tp, const remap_table &table, const std::vector<std::uint32_t> &palette,
+                        const std::uint8_t *in, std::uint8_t *out, int rows, int cols, int channels = 4) {
+    remap_image(tp, table, palette, const_image_view(in, rows, cols, channels), image_view(out, rows, cols, channels));
+}
+
+// Writes the palette index of every pixel of an 8-bit image with C
+// channels (1, 3 or 4) into out, an 8-bit single-channel image of the
+// same size: this is remap_pixels for indexed output, and as with it,
+// runs of identical pixels are looked up once.
+// Precondition: the palette has at most 256 entries
+template <int C>
+inline void remap_index_pixels(ra::concurrency::thread_pool &tp, const remap_table &table, const const_image_view &in, const image_view &out) {
+    using size_type = std::size_t;
+    int rows = in.rows;
+    size_type blocks = std::max<size_type>(1, std::min<size_type>(4 * tp.size(), rows));
+    tp.parallel_for(0, blocks, 1, [&](size_type b_first, size_type b_last) {
+        for (size_type b = b_first; b < b_last; b++) {
+            int first = rows * b / blocks;
+            int last = rows * (b + 1) / blocks;
+            if constexpr (C == 1) {
+                std::int32_t grey[256];
+                std::fill(grey, grey + 256, -1);
+                for_each_span(in, out, first, last, [&](const std::uint8_t *p, std::uint8_t *q, size_type n) {
+                    for (size_type i = 0; i < n; i++) {
+                        std::uint8_t v = p[i];
+                        if (grey[v] < 0) {
+                            grey[v] = table.find(pack_colour(v, v, v, 255));
+                        }
+                        q[i] = grey[v];
+                    }
+                });
+            } else {
+                for_each_span(in, out, first, last, [&](const std::uint8_t *p, std::uint8_t *q, size_type n) {
+                    for (size_type i = 0; i < n;) {
+                        std::uint32_t c = load_colour<C>(p + i * C);
+                        size_type run = i + 1;
+                        while (run < n && load_colour<C>(p + run * C) == c) {
+                            run++;
+                        }
+                        std::fill(q + i, q + run, std::uint8_t(table.find(c)));
+                        i = run;
+                    }
+                });
+            }
+        }
+    });
+}
+
+// remap_index_pixels for an image with any number of channels (1, 3 or
+// 4).
+inline void remap_indices(ra::concurrency::thread_pool &tp, const remap_table &table, const const_image_view &in, const image_view &out) {
+    with_channels(in.channels, [&](auto c) { remap_index_pixels<decltype(c)::value>(tp, table, in, out); });
+}
+
+}  // namespace ra::quantization
+
+#endif
@@ -0,0 +1,264 @@
+#ifndef RING_QUEUE_H
+#define RING_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+namespace ra::concurrency {
+// Concurrent bounded FIFO queue backed by a fixed ring of slots.
+// This class has the same interface as queue, but does not allocate
+// per element and takes no lock: producers and consumers claim a slot
+// by advancing a shared position with a compare-and-swap, and every
+// slot carries a turn number that says whether it is ready to be
+// written or read (after D. Vyukov's bounded MPMC queue).
+// The blocking operations first retry briefly and then sleep on an
+// atomic counter that the opposite side bumps, so threads that do not
+// have to wait never make a system call.
+template <class T>
+class ring_queue {
+   public:
+    // The type of each of the elements stored in the queue.
+    using value_type = T;
+
+    // An unsigned integral type used to represent sizes.
+    using size_type = std::size_t;
+
+    // A type for the status of a queue operation.
+    enum class status {
+        success = 0,  // operation successful
+        empty,        // 1; queue is empty (try_pop only)
+        full,         // 2; queue is full (try_push only)
+        closed,       // 3; queue is closed
+    };
+
+    // A queue is not default constructible.
+    ring_queue() = delete;
+
+    // Constructs a queue with a maximum size of max_size.
+    // The queue is marked as open (i.e., not closed).
+    // Precondition: The quantity max_size must be greater than
+    // zero.
+    ring_queue(size_type max_size) : max_size_(max_size) {
+        if (max_size < 1) {
+            throw std::runtime_error("Max_size must be > 0\n");
+        }
+        slots_ = std::make_unique<slot[]>(max_size);
+    }
+
+    // A queue is not movable or copyable.
+    ring_queue(const ring_queue &) = delete;
+    ring_queue &operator=(const ring_queue &) = delete;
+    ring_queue(ring_queue &&) = delete;
+    ring_queue &operator=(ring_queue &&) = delete;
+
+    // Destroys the queue, destroying the elements still in it.
+    ~ring_queue() { clear(); }
+
+    // Inserts the value x at the end of the queue, blocking while the
+    // queue is full.
+    // Returns status::success, or status::closed if the queue is (or
+    // becomes) closed before x could be inserted.
+    // This function is thread safe.
+    status push(value_type &&x) {
+        while (true) {
+            std::uint32_t e = pops_.load();
+            status s = try_push(std::move(x));
+            if (s != status::full) {
+                return s;
+            }
+            wait_for(pops_, e, push_waiters_);
+        }
+    }
+
+    // Inserts the value x at the end of the queue if there is room.
+    // Returns status::success, status::full (x is left unchanged) or
+    // status::closed.
+    // This function is thread safe and never blocks.
+    status try_push(value_type &&x) {
+        if (is_closed()) {
+            return status::closed;
+        }
+        size_type pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            slot &s = slots_[pos % max_size_];
+            size_type turn = 2 * (pos / max_size_);
+            std::ptrdiff_t diff = std::ptrdiff_t(s.turn.load(std::memory_order_acquire)) - std::ptrdiff_t(turn);
+            if (diff == 0) {
+                // the slot is free for this lap: claim it
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    ::new (s.storage) value_type(std::move(x));
+                    s.turn.store(turn + 1, std::memory_order_release);
+                    signal(pushes_, pop_waiters_);
+                    return status::success;
+                }
+            } else if (diff < 0) {
+                // the slot still holds the element of the previous lap
+                return status::full;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Removes the value from the front of the queue and places it in
+    // x, blocking while the queue is empty and not closed.
+    // Returns status::success, or status::closed if the queue is both
+    // empty and closed.
+    // This function is thread safe.
+    status pop(value_type &x) {
+        while (true) {
+            std::uint32_t e = pushes_.load();
+            status s = try_pop(x);
+            if (s != status::empty) {
+                return s;
+            }
+            wait_for(pushes_, e, pop_waiters_);
+        }
+    }
+
+    // Removes the value from the front of the queue, if any, and places
+    // it in x.
+    // Returns status::success, status::empty, or status::closed if the
+    // queue is both empty and closed.
+    // This function is thread safe and never blocks.
+    status try_pop(value_type &x) {
+        size_type pos = head_.load(std::memory_order_relaxed);
+        while (true) {
+            slot &s = slots_[pos % max_size_];
+            size_type turn = 2 * (pos / max_size_) + 1;
+            std::ptrdiff_t diff = std::ptrdiff_t(s.turn.load(std::memory_order_acquire)) - std::ptrdiff_t(turn);
+            if (diff == 0) {
+                // the slot holds the element of this lap: claim it
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    value_type *v = std::launder(reinterpret_cast<value_type *>(s.storage));
+                    x = std::move(*v);
+                    v->~value_type();
+                    s.turn.store(turn + 1, std::memory_order_release);
+                    signal(pops_, push_waiters_);
+                    return status::success;
+                }
+            } else if (diff < 0) {
+                // the slot has not been written yet in this lap
+                return is_closed() ? status::closed : status::empty;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Closes the queue.
+    // The closed state prevents more items from being inserted on the
+    // queue, but it does not clear the items that are already on the
+    // queue. Blocked pushers and poppers are woken up.
+    // Invoking this function on a closed queue has no effect.
+    // This function is thread safe.
+    void close() {
+        closed_ = true;
+        pushes_++;
+        pops_++;
+        pushes_.notify_all();
+        pops_.notify_all();
+    }
+
+    // Clears the queue.
+    // All of the elements on the queue are discarded.
+    // This function is thread safe.
+    void clear() {
+        size_type pos = head_.load(std::memory_order_relaxed);
+        while (true) {
+            slot &s = slots_[pos % max_size_];
+            size_type turn = 2 * (pos / max_size_) + 1;
+            std::ptrdiff_t diff = std::ptrdiff_t(s.turn.load(std::memory_order_acquire)) - std::ptrdiff_t(turn);
+            if (diff == 0) {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    std::launder(reinterpret_cast<value_type *>(s.storage))->~value_type();
+                    s.turn.store(turn + 1, std::memory_order_release);
+                    signal(pops_, push_waiters_);
+                    pos++;
+                }
+            } else if (diff < 0) {
+                return;
+            } else {
+                pos = head_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Returns if the queue is currently full (i.e., the number of
+    // elements in the queue equals the maximum queue size).
+    // Slots that are being written count as full.
+    // This function is not thread safe.
+    bool is_full() const {
+        size_type head = head_.load();  // read first: the tail is never behind it
+        return tail_.load() - head >= max_size_;
+    }
+
+    // Returns if the queue is currently empty.
+    // This function is not thread safe.
+    bool is_empty() const { return tail_.load() == head_.load(); }
+
+    // Returns if the queue is closed (i.e., in the closed state).
+    // This function is not thread safe.
+    bool is_closed() const { return closed_; }
+
+    // Returns the maximum number of elements that can be held in
+    // the queue.
+    // This function is not thread safe.
+    size_type max_size() const { return max_size_; }
+
+   private:
+    // One element of the ring. Position pos uses slot pos % max_size_
+    // in lap pos / max_size_; turn == 2 * lap means the slot is free
+    // for the push of that lap, and turn == 2 * lap + 1 means it holds
+    // the element pushed in that lap.
+    struct slot {
+        std::atomic<size_type> turn{0};
+        alignas(value_type) unsigned char storage[sizeof(value_type)];
+    };
+
+    // Wakes the threads waiting for epoch to change, if any.
+    // The epoch is bumped before waiters is read, and a waiter
+    // registers in waiters before it rereads the epoch, so one of the
+    // two always sees the other.
+    static void signal(std::atomic<std::uint32_t> &epoch, std::atomic<std::uint32_t> &waiters) {
+        epoch++;
+        if (waiters > 0) {
+            epoch.notify_all();
+        }
+    }
+
+    // Blocks until epoch no longer equals e.
+    static void wait_for(std::atomic<std::uint32_t> &epoch, std::uint32_t e, std::atomic<std::uint32_t> &waiters) {
+        for (int spin = 0; spin < 16; spin++) {  // most waits are short
+            if (epoch.load() != e) {
+                return;
+            }
+            std::this_thread::yield();
+        }
+        waiters++;
+        epoch.wait(e);
+        waiters--;
+    }
+
+    // The positions live on their own cache lines, so that producers
+    // and consumers do not invalidate each other's.
+    alignas(64) std::atomic<size_type> tail_{0};  // next position to push
+    alignas(64) std::atomic<size_type> head_{0};  // next position to pop
+    alignas(64) std::atomic<std::uint32_t> pushes_{0};  // bumped by every push
+    std::atomic<std::uint32_t> pop_waiters_{0};
+    alignas(64) std::atomic<std::uint32_t> pops_{0};  // bumped by every pop
+    std::atomic<std::uint32_t> push_waiters_{0};
+    std::atomic<bool> closed_{false};
+    size_type max_size_;
+    std::unique_ptr<slot[]> slots_;
+};
+
+}  // namespace ra::concurrency
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef SEEDING_H
+#define SEEDING_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "./histogram.hpp"
+#include "./nearest_center.hpp"
+#include "./thread_pool.hpp"
+
+namespace ra::quantization {
+
+// Number of colours handled by one seeding task. The blocks do not
+// depend on how the tasks get scheduled, so a histogram and a seed
+// always give the same centers. (The order of the colours of a
+// histogram, and so the centers, depends on the pool that built it.)
+constexpr std::size_t seeding_block = 16384;
+
+// The squared distance of every colour of a weighted set to its nearest
+// chosen center, kept up to date as centers are added.
+class seeding_distances {
+   public:
+    using size_type = std::size_t;
+
+    // Constructs the distances for n colours, none of which has a
+    // center yet. channels is the layout of the colours (see
+    // colour_histogram::channels).
+    seeding_distances(const std::uint32_t *colours, const std::uint64_t *weights, size_type n, int channels = 4)
+        : colours_(colours), weights_(weights), n_(n), channels_(channels), dist_(n, std::uint32_t(-1)),
+          block_weight_((n + seeding_block - 1) / seeding_block, 0) {}
+
+    // Lowers the distances to account for the given new centers, and
+    // recomputes the weighted sum of every block.
+    // Precondition: !centers.empty()
+    void add_centers(ra::concurrency::thread_pool &tp, const std::vector<std::uint32_t> &centers) {
+        center_soa soa;
+        soa.resize(centers.size());
+        soa.set_colour_channels(channels_);
+        for (size_type j = 0; j < centers.size(); j++) {
+            std::uint32_t c = centers[j];
+            soa.set(j, colour_channel(c, 0), colour_channel(c, 1), colour_channel(c, 2), colour_channel(c, 3));
+        }
+        auto update = [&](size_type b) {
+            const size_type batch = 256;
+            std::uint32_t index[batch];
+            std::uint32_t dist[batch];
+            size_type first = b * seeding_block;
+            size_type last = std::min(n_, first + seeding_block);
+            std::uint64_t sum = 0;
+            for (size_type i = first; i < last; i += batch) {
+                size_type m = std::min(batch, last - i);
+                nearest_centers(soa, colours_ + i, m, index, dist);
+                for (size_type t = 0; t < m; t++) {
+                    dist_[i + t] = std::min(dist_[i + t], dist[t]);
+                    sum += weights_[i + t] * dist_[i + t];
+                }
+            }
+            block_weight_[b] = sum;
+        };
+        if (block_weight_.size() == 1) {  // not worth a round trip through the pool
+            update(0);
+            return;
+        }
+        tp.parallel_for(0, block_weight_.size(), 1, [&](size_type b_first, size_type b_last) {
+            for (size_type b = b_first; b < b_last; b++) {
+                update(b);
+            }
+        });
+    }
+
+    // Returns the squared distance of colour i to its nearest center.
+    std::uint32_t distance(size_type i) const { return dist_[i]; }
+
+    // Returns the sum over all colours of weight times squared distance.
+    std::uint64_t total() const {
+        std::uint64_t t = 0;
+        for (std::uint64_t w : block_weight_) {
+            t += w;
+        }
+        return t;
+    }
+
+    // Returns the colour whose cumulative weighted distance first
+    // exceeds r.
+    // Precondition: r < total()
+    size_type find(std::uint64_t r) const {
+        size_type b = 0;
+        while (r >= block_weight_[b]) {
+            r -= block_weight_[b++];
+        }
+        size_type i = b * seeding_block;
+        while (true) {
+            std::uint64_t w = weights_[i] * dist_[i];
+            if (r < w) {
+                return i;
+            }
+            r -= w;
+            i++;
+        }
+    }
+
+   private:
+    const std::uint32_t *colours_;
+    const std::uint64_t *weights_;
+    size_type n_;
+    int channels_;
+    std::vector<std::uint32_t> dist_;
+    std::vector<std::uint64_t> block_weight_;
+};
+
+// Weighted k-means++ seeding over the n colours with the given weights.
+// Centers already in centers are kept (and taken into account); new
+// ones are appended until there are k of them, each drawn with
+// probability proportional to its weight times its squared distance
+// to the nearest center so far. The first center, if centers is
+// empty, is drawn in proportion to weight alone. Fewer than k centers
+// result only if every colour is already a center. channels is the
+// layout of the colours (see colour_histogram::channels).
+inline void weighted_kmeans_pp(ra::concurrency::thread_pool &tp, const std::uint32_t *colours, const std::uint64_t *weights,
+                               std::size_t n, std::size_t k, std::mt19937_64 &rng, std::vector<std::uint32_t> &centers, int channels = 4) {
+    if (n == 0 || centers.size() >= k) {
+        return;
+    }
+    seeding_distances dist(colours, weights, n, channels);
+    if (centers.empty()) {
+        std::uint64_t total = 0;
+        for (std::size_t i = 0; i < n; i++) {
+            total += weights[i];
+        }
+        std::uint64_t r = std::uniform_int_distribution<std::uint64_t>(0, total - 1)(rng);
+        std::size_t i = 0;
+        while (r >= weights[i]) {
+            r -= weights[i++];
+        }
+        centers.push_back(colours[i]);
+    }
+    dist.add_centers(tp, centers);
+    while (centers.size() < k) {
+        std::uint64_t total = dist.total();
+        if (total == 0) {
+            break;
+        }
+        std::uint32_t c = colours[dist.find(std::uniform_int_distribution<std::uint64_t>(0, total - 1)(rng))];
+        centers.push_back(c);
+        dist.add_centers(tp, {c});
+    }
+}
+
+// k-means++ seeding of k centers from the histogram, weighting every
+// colour by its pixel count.
+inline std::vector<std::uint32_t> seed_kmeans_pp(ra::concurrency::thread_pool &tp, const colour_histogram &hist, std::size_t k, std::uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<std::uint32_t> centers;
+    weighted_kmeans_pp(tp, hist.colours.data(), hist.counts.data(), hist.size(), k, rng, centers, hist.channels);
+    return centers;
+}
+
+// k-means|| (scalable k-means++) seeding of k centers from the histogram.
+// Each of the rounds samples about oversampling * k colours in parallel,
+// each with probability proportional to its pixel count times its
+// squared distance to the candidates so far. The candidates are then
+// weighted by the number of pixels nearest to them and reduced to k
+// centers with weighted k-means++.
+inline std::vector<std::uint32_t> seed_kmeans_parallel(ra::concurrency::thread_pool &tp, const colour_histogram &hist, std::size_t k,
+                                                       std::uint64_t seed, int rounds = 5, double oversampling = 2.0) {
+    using size_type = std::size_t;
+    size_type n = hist.size();
+    std::mt19937_64 rng(seed);
+    std::vector<std::uint32_t> candidates;
+    if (n == 0 || k == 0) {
+        return candidates;
+    }
+    weighted_kmeans_pp(tp, hist.colours.data(), hist.counts.data(), n, 1, rng, candidates, hist.channels);
+    seeding_distances dist(hist.colours.data(), hist.counts.data(), n, hist.channels);
+    dist.add_centers(tp, candidates);
+
+    size_type blocks = (n + seeding_block - 1) / seeding_block;
+    std::vector<std::vector<std::uint32_t>> picked(blocks);
+    for (int round = 0; round < rounds; round++) {
+        double total = dist.total();
+        if (total == 0) {
+            break;
+        }
+        double scale = oversampling * k / total;
+        // every block draws from its own generator, so no state is shared between tasks
+        std::uint64_t round_seed = rng();
+        tp.parallel_for(0, blocks, 1, [&](size_type b_first, size_type b_last) {
+            for (size_type b = b_first; b < b_last; b++) {
+                std::mt19937_64 block_rng(round_seed + b);
+                std::uniform_real_distribution<double> uniform(0.0, 1.0);
+                picked[b].clear();
+                for (size_type i = b * seeding_block; i < std::min(n, (b + 1) * seeding_block); i++) {
+                    std::uint64_t w = hist.counts[i] * dist.distance(i);
+                    if (w != 0 && uniform(block_rng) < scale * w) {
+                        picked[b].push_back(hist.colours[i]);
+                    }
+                }
+            }
+        });
+        std::vector<std::uint32_t> added;
+        for (const std::vector<std::uint32_t> &p : picked) {
+            added.insert(added.end(), p.begin(), p.end());
+        }
+        if (added.empty()) {
+            continue;
+        }
+        candidates.insert(candidates.end(), added.begin(), added.end());
+        dist.add_centers(tp, added);
+    }
+
+    // weight each candidate by the number of pixels nearest to it
+    center_soa soa;
+    soa.resize(candidates.size());
+    soa.set_colour_channels(hist.channels);
+    for (size_type j = 0; j < candidates.size(); j++) {
+        std::uint32_t c = candidates[j];
+        soa.set(j, colour_channel(c, 0), colour_channel(c, 1), colour_channel(c, 2), colour_channel(c, 3));
+    }
+    std::vector<std::vector<std::uint64_t>> partial(blocks, std::vector<std::uint64_t>(candidates.size(), 0));
+    tp.parallel_for(0, blocks, 1, [&](size_type b_first, size_type b_last) {
+        for (size_type b = b_first; b < b_last; b++) {
+            const size_type batch = 256;
+            std::uint32_t index[batch];
+            std::uint32_t d[batch];
+            size_type last = std::min(n, (b + 1) * seeding_block);
+            for (size_type i = b * seeding_block; i < last; i += batch) {
+                size_type m = std::min(batch, last - i);
+                nearest_centers(soa, hist.colours.data() + i, m, index, d);
+                for (size_type t = 0; t < m; t++) {
+                    partial[b][index[t]] += hist.counts[i + t];
+                }
+            }
+        }
+    });
+    std::vector<std::uint64_t> weights(candidates.size(), 0);
+    for (const std::vector<std::uint64_t> &p : partial) {
+        for (size_type j = 0; j < candidates.size(); j++) {
+            weights[j] += p[j];
+        }
+    }
+
+    std::vector<std::uint32_t> centers;
+    weighted_kmeans_pp(tp, candidates.data(), weights.data(), candidates.size(), k, rng, centers, hist.channels);
+    // too few candidates (tiny histograms or very few rounds): continue over the whole histogram
+    weighted_kmeans_pp(tp, hist.colours.data(), hist.counts.data(), n, k, rng, centers, hist.channels);
+    return centers;
+}
+
+}  // namespace ra::quantization
+
+#endif
@@ -0,0 +1,157 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <vector>
+
+#include "./thread_pool.hpp"
+
+namespace ra::quantization {
+
+// The phases of a quantization run, in the order they happen.
+enum class quantize_phase {
+    histogram = 0,  // counting the unique colours
+    seeding,        // choosing the initial centers
+    kmeans,         // the k-means iterations and the final assignment
+    remap,          // writing the quantized pixels
+};
+
+// The number of phases.
+constexpr int quantize_phases = 4;
+
+// Returns the name of a phase, as used in the JSON output.
+inline const char *phase_name(quantize_phase phase) {
+    static const char *const names[quantize_phases] = {"histogram", "seeding", "kmeans", "remap"};
+    return names[int(phase)];
+}
+
+// Receives the progress of quantization runs: attach one through
+// quantize_options::observer. Every function is called on the thread
+// that called the quantization function, never concurrently for one
+// run. The default implementations do nothing.
+// Without an observer, the library reads no clocks and keeps no
+// statistics.
+class quantize_observer {
+   public:
+    virtual ~quantize_observer() = default;
+
+    // A run on an image of rows x cols pixels starts.
+    virtual void run_started(int /*rows*/, int /*cols*/) {}
+
+    // The histogram holds unique_colours colours.
+    virtual void histogram_built(std::size_t /*unique_colours*/) {}
+
+    // The initial centers (packed colours) have been chosen.
+    virtual void seeded(const std::vector<std::uint32_t> & /*centers*/) {}
+
+    // k-means iteration iteration (counted from 0) ended with the
+    // given total distortion, after ms milliseconds.
+    virtual void iteration_done(int /*iteration*/, std::uint64_t /*distortion*/, double /*ms*/) {}
+
+    // A phase of the run took ms milliseconds.
+    virtual void phase_done(quantize_phase /*phase*/, double /*ms*/) {}
+
+    // The run ended with palette after iterations k-means iterations.
+    // The palette holds packed colours, or 16-bit sample values if
+    // samples is true. pool holds the thread pool counters for the run.
+    virtual void run_finished(const std::vector<std::uint32_t> & /*palette*/, bool /*samples*/, int /*iterations*/,
+                              const ra::concurrency::pool_stats & /*pool*/) {}
+};
+
+// What a stats_recorder keeps about one run.
+struct quantize_stats {
+    int rows = 0;
+    int cols = 0;
+    std::size_t unique_colours = 0;
+    int iterations = 0;
+    std::vector<std::uint64_t> distortion;  // per iteration
+    std::vector<double> iteration_ms;       // per iteration
+    double phase_ms[quantize_phases] = {};
+    std::uint64_t tasks_scheduled = 0;
+    double queue_wait_ms = 0;
+    std::vector<std::uint32_t> palette;
+    bool samples = false;  // the palette holds 16-bit sample values
+};
+
+// An observer that records every run it sees. Reports that come
+// without a run_started (from cluster_colours called on its own) go to
+// a run of their own.
+class stats_recorder : public quantize_observer {
+   public:
+    // The runs seen so far, oldest first.
+    std::vector<quantize_stats> runs;
+
+    void run_started(int rows, int cols) override {
+        runs.emplace_back();
+        runs.back().rows = rows;
+        runs.back().cols = cols;
+    }
+
+    void histogram_built(std::size_t unique_colours) override { current().unique_colours = unique_colours; }
+
+    void iteration_done(int, std::uint64_t distortion, double ms) override {
+        current().distortion.push_back(distortion);
+        current().iteration_ms.push_back(ms);
+    }
+
+    void phase_done(quantize_phase phase, double ms) override { current().phase_ms[int(phase)] += ms; }
+
+    void run_finished(const std::vector<std::uint32_t> &palette, bool samples, int iterations, const ra::concurrency::pool_stats &pool) override {
+        quantize_stats &s = current();
+        s.palette = palette;
+        s.samples = samples;
+        s.iterations = iterations;
+        s.tasks_scheduled = pool.tasks_scheduled;
+        s.queue_wait_ms = pool.queue_wait_ns / 1e6;
+    }
+
+   private:
+    quantize_stats &current() {
+        if (runs.empty()) {
+            runs.emplace_back();
+        }
+        return runs.back();
+    }
+};
+
+// Writes runs as a JSON object {"runs": [...]}, with the palette
+// colours as "#rrggbbaa" strings and sample values as numbers.
+inline void write_json(std::ostream &out, const std::vector<quantize_stats> &runs) {
+    out << "{\"runs\": [";
+    for (std::size_t r = 0; r < runs.size(); r++) {
+        const quantize_stats &s = runs[r];
+        out << (r ? ",\n" : "\n") << "  {\"rows\": " << s.rows << ", \"cols\": " << s.cols << ", \"unique_colours\": " << s.unique_colours
+            << ", \"iterations\": " << s.iterations << ", \"phase_ms\": {";
+        for (int p = 0; p < quantize_phases; p++) {
+            out << (p ? ", " : "") << '"' << phase_name(quantize_phase(p)) << "\": " << s.phase_ms[p];
+        }
+        out << "}, \"distortion\": [";
+        for (std::size_t i = 0; i < s.distortion.size(); i++) {
+            out << (i ? ", " : "") << s.distortion[i];
+        }
+        out << "], \"iteration_ms\": [";
+        for (std::size_t i = 0; i < s.iteration_ms.size(); i++) {
+            out << (i ? ", " : "") << s.iteration_ms[i];
+        }
+        out << "], \"tasks_scheduled\": " << s.tasks_scheduled << ", \"queue_wait_ms\": " << s.queue_wait_ms << ", \"palette\": [";
+        for (std::size_t i = 0; i < s.palette.size(); i++) {
+            if (s.samples) {
+                out << (i ? ", " : "") << s.palette[i];
+                continue;
+            }
+            char hex[10];
+            std::uint32_t c = s.palette[i];
+            std::snprintf(hex, sizeof hex, "#%02x%02x%02x%02x", c & 0xff, (c >> 8) & 0xff, (c >> 16) & 0xff, c >> 24);
+            out << (i ? ", " : "") << '"' << hex << '"';
+        }
+        out << "]}";
+    }
+    out << "\n]}\n";
+}
+
+}  // namespace ra::quantization
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef TASK_GROUP_H
+#define TASK_GROUP_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "./thread_pool.hpp"
+
+namespace ra::concurrency {
+// A set of tasks run on a thread pool that can be waited for on its
+// own, independently of other work in the pool.
+// Several groups (e.g. the stages of different images) can share one
+// pool; waiting on one group only waits for the tasks run through it.
+template <class Pool>
+class basic_task_group {
+   public:
+    // Constructs an empty group whose tasks run on pool.
+    explicit basic_task_group(Pool &pool) : pool_(pool) {}
+
+    // A task group is not copyable or movable.
+    basic_task_group(const basic_task_group &) = delete;
+    basic_task_group &operator=(const basic_task_group &) = delete;
+    basic_task_group(basic_task_group &&) = delete;
+    basic_task_group &operator=(basic_task_group &&) = delete;
+
+    // Waits for the tasks of the group. An exception they threw that
+    // was not passed on by wait is discarded.
+    ~basic_task_group() {
+        try {
+            wait();
+        } catch (...) {
+        }
+    }
+
+    // Schedules fn() on the pool as part of the group.
+    // If fn throws, the exception is kept and the first one is
+    // rethrown by wait. If the pool is shut down, fn is not run and
+    // wait throws std::runtime_error.
+    // This function is thread safe, and may be called from a task of
+    // the group.
+    template <class F>
+    void run(F &&fn) {
+        pending_++;
+        bool scheduled = pool_.enqueue([this, f = std::forward<F>(fn)]() mutable {
+            try {
+                f();
+            } catch (...) {
+                fail(std::current_exception());
+            }
+            finish();
+        });
+        if (!scheduled) {
+            fail(std::make_exception_ptr(std::runtime_error("thread pool is shut down")));
+            finish();
+        }
+    }
+
+    // Blocks until every task run through the group so far has
+    // completed, then rethrows the first exception one of them threw
+    // (if any) and clears it, so the group can be reused.
+    // While it waits, the calling thread runs queued tasks of the pool
+    // (of any group), so a task of the pool may wait for a group
+    // without tying up its thread.
+    // Precondition: With scheduling::handoff, the calling thread is
+    // not a thread of the pool.
+    void wait() {
+        while (pending_ != 0 && pool_.run_pending_task()) {
+        }
+        if (pool_.is_worker()) {
+            // sleeping here could leave the pool without threads to run our tasks
+            while (pending_ != 0) {
+                if (!pool_.run_pending_task()) {
+                    std::this_thread::yield();
+                }
+            }
+        } else {
+            Lock lk(m_);
+            cv_.wait(lk, [this] { return pending_ == 0; });
+        }
+        std::exception_ptr e;
+        {
+            Lock lk(m_);
+            std::swap(e, error_);
+        }
+        if (e) {
+            std::rethrow_exception(e);
+        }
+    }
+
+   private:
+    using Lock = std::unique_lock<std::mutex>;
+
+    // Keeps e if it is the first exception since the last wait.
+    void fail(std::exception_ptr e) {
+        Lock lk(m_);
+        if (!error_) {
+            error_ = e;
+        }
+    }
+
+    // Reports one task of the group as finished.
+    void finish() {
+        // the waiter may return (and the group be destroyed) as soon as
+        // pending_ reaches zero, so decrement and notify under the lock
+        Lock lk(m_);
+        if (--pending_ == 0) {
+            cv_.notify_all();
+        }
+    }
+
+    Pool &pool_;
+    std::atomic<std::size_t> pending_{0};  // tasks run but not finished
+    std::exception_ptr error_;             // first exception since the last wait
+    std::mutex m_;
+    std::condition_variable cv_;
+};
+
+// A task group on the thread pool used by the library.
+using task_group = basic_task_group<thread_pool>;
+
+}  // namespace ra::concurrency
+
+#endif
@@ -1,11 +1,23 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <exception>
 #include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #include "./queue.hpp"
+#include "./ring_queue.hpp"
 
 using Thread = std::thread;
 using Mutex = std::mutex;
@@ -16,42 +28,134 @@ using IQ = ra::concurrency::queue<size_type>;  // queue of indices
 using CV = std::condition_variable;
 
 namespace ra::concurrency {
+// Counters of the work done by a thread pool, collected only while
+// enabled (see set_stats_enabled).
+struct pool_stats {
+    std::uint64_t tasks_scheduled = 0;  // tasks accepted by the pool, including parallel_for helpers
+    std::uint64_t queue_wait_ns = 0;    // total time tasks spent queued before a thread started them
+};
+
+// How the threads of a pool are placed on the CPUs (see pool_options).
+enum class affinity {
+    // The threads are not pinned: the operating system places them.
+    none = 0,
+    // Thread i is pinned to one CPU, taking the CPUs node by node, so
+    // that the threads fill one NUMA node before the next.
+    compact,
+    // Thread i is pinned to one CPU, taking the NUMA nodes in turn, so
+    // that the threads are spread evenly over the nodes.
+    scatter,
+    // The threads are split over the NUMA nodes in proportion to their
+    // CPUs, and each is pinned to all the CPUs of its node, leaving the
+    // operating system to balance them within the node.
+    numa,
+};
+
+// How many threads a pool has and where they run.
+struct pool_options {
+    std::size_t threads = 0;  // 0 for one per CPU the pool may use
+    affinity placement = affinity::none;
+    // The CPUs the pool may use, or all those the process may run on if
+    // empty. With affinity::none, every thread is pinned to the whole
+    // set.
+    std::vector<int> cpus;
+};
+
+// Parses a list of CPUs in the format of Linux (as in
+// /sys/devices/system/node/node0/cpulist): numbers and ranges separated
+// by commas, such as "0-3,8,10-11". The CPUs come out sorted, without
+// duplicates.
+// Throws std::invalid_argument if text is not such a list.
+std::vector<int> parse_cpu_list(const std::string &text);
+
+// Returns the CPUs the calling process may run on, one group per NUMA
+// node that has any, in node order. Where the nodes are not known, they
+// are all in a single group.
+std::vector<std::vector<int>> numa_cpus();
+
 // Thread pool class.
-class thread_pool {
+// Queue is the concurrent queue template the pool hands tasks and
+// thread indices through: queue (mutexes and condition variables) or
+// ring_queue (lock-free ring). Use the thread_pool alias below unless
+// the choice matters.
+template <template <class> class Queue>
+class basic_thread_pool {
    public:
     // An unsigned integral type used to represent sizes.
     using size_type = std::size_t;
 
-    // Creates a thread pool with the number of threads equal to the
-    // hardware concurrency level (if known); otherwise the number of
-    // threads is set to 2.
-    thread_pool();
+    // How scheduled tasks are handed to the threads of a pool.
+    enum class scheduling {
+        // Every task is handed to one idle thread. The schedule
+        // function blocks while no thread is idle.
+        handoff = 0,
+        // Every thread has its own deque of tasks. Tasks scheduled by
+        // a thread of the pool go to the back of its own deque. Other
+        // tasks go to a shared queue, or, while that is full, are
+        // spread over the deques in turn. A thread runs the tasks of
+        // its own deque newest first, then those of the shared queue,
+        // and then steals the oldest task of another deque. The
+        // schedule function never blocks.
+        work_stealing,
+    };
+
+    // Creates a work-stealing thread pool with the number of threads
+    // equal to the hardware concurrency level (if known); otherwise
+    // the number of threads is set to 2.
+    basic_thread_pool();
+
+    // Creates a work-stealing thread pool with num_threads threads.
+    // Precondition: num_threads > 0
+    basic_thread_pool(std::size_t num_threads);
 
-    // Creates a thread pool with num_threads threads.
+    // Creates a thread pool with num_threads threads that schedules
+    // tasks as given by mode.
     // Precondition: num_threads > 0
-    thread_pool(std::size_t num_threads);
+    basic_thread_pool(std::size_t num_threads, scheduling mode);
+
+    // Creates a work-stealing thread pool with the threads and the
+    // placement given by options. Pinned threads are grouped by the
+    // NUMA node they run on (see group_count).
+    // Throws std::invalid_argument if options.cpus holds a CPU the
+    // process may not run on.
+    explicit basic_thread_pool(const pool_options &options);
 
     // A thread pool is not copyable or movable.
-    thread_pool(const thread_pool &) = delete;
-    thread_pool &operator=(const thread_pool &) = delete;
-    thread_pool(thread_pool &&) = delete;
-    thread_pool &operator=(thread_pool &&) = delete;
+    basic_thread_pool(const basic_thread_pool &) = delete;
+    basic_thread_pool &operator=(const basic_thread_pool &) = delete;
+    basic_thread_pool(basic_thread_pool &&) = delete;
+    basic_thread_pool &operator=(basic_thread_pool &&) = delete;
 
     // Destroys a thread pool, shutting down the thread pool first
     // (if not already shutdown).
 
-    ~thread_pool();
+    ~basic_thread_pool();
 
     // Gets the number of threads in the thread pool.
     // This function is not thread safe.
     size_type size() const;
 
+    // Returns the number of groups the threads are split into: one per
+    // NUMA node the threads are pinned to, or 1 if they are not pinned.
+    size_type group_count() const;
+
+    // Returns the group of thread i.
+    // Precondition: i < size()
+    size_type group_of(size_type i) const;
+
+    // Returns the number of threads that were to be pinned (see
+    // pool_options) but could not be, for instance because a cpuset
+    // forbids their CPUs. They run unpinned, where the operating system
+    // places them; their group is still that of the node they were
+    // meant for.
+    size_type unpinned_threads() const;
+
     // Enqueues a task for execution by the thread pool.
     // This function inserts the task specified by the callable
     // entity func into the queue of tasks associated with the
     // thread pool.
-    // This function may block if the number of currently
-    // queued tasks is sufficiently large.
+    // With scheduling::handoff, this function may block if the
+    // number of currently queued tasks is sufficiently large.
     // Note: The rvalue reference parameter is intentional and
     // implies that the schedule function is permitted to change
     // the value of func (e.g., by moving from func).
@@ -61,6 +165,21 @@ class thread_pool {
     // This function is thread safe.
     void schedule(std::function<void()> &&func);
 
+    // Schedules fn() for execution by the thread pool and returns a
+    // future for its result. An exception thrown by fn is stored in
+    // the future. If the pool is shut down, fn is not run and the
+    // future holds a std::future_error (broken_promise).
+    // This function is thread safe.
+    template <class F>
+    std::future<std::invoke_result_t<std::decay_t<F>>> submit(F &&fn) {
+        using result_type = std::invoke_result_t<std::decay_t<F>>;
+        // std::function needs a copyable target, so the task is shared
+        auto task = std::make_shared<std::packaged_task<result_type()>>(std::forward<F>(fn));
+        std::future<result_type> result = task->get_future();
+        enqueue([task]() { (*task)(); });
+        return result;
+    }
+
     // Shuts down the thread pool.
     // This function places the thread pool into a state where
     // new tasks will no longer be accepted via the schedule
@@ -79,22 +198,233 @@ class thread_pool {
     // This function is not thread safe.
     bool is_shutdown() const;
 
+    // Blocks until every scheduled task has been executed and all
+    // threads in the thread pool are idle.
+    // Precondition: The calling thread is not a thread of this pool.
     void block_until_idle();
 
+    // Returns if the calling thread is one of the threads of this pool.
+    // This function is thread safe.
+    bool is_worker() const;
+
+    // Starts (or stops) collecting the counters returned by stats. When
+    // they are off, as they are by default, scheduling a task costs
+    // one extra relaxed load.
+    // This function is thread safe.
+    void set_stats_enabled(bool enabled);
+
+    // Starts collecting the counters on behalf of one more user, until
+    // the matching release_stats. Users that overlap keep the counters
+    // on until the last of them releases them, whatever the order, and
+    // set_stats_enabled(false) does not stop them early. The counters
+    // are those of the whole pool: they include the tasks of every
+    // user.
+    // This function is thread safe.
+    void retain_stats();
+
+    // Ends a retain_stats.
+    // This function is thread safe.
+    void release_stats();
+
+    // Returns if the counters are being collected.
+    // This function is thread safe.
+    bool stats_enabled() const;
+
+    // Returns the counters collected so far. Tasks still queued are
+    // not included in queue_wait_ns.
+    // This function is thread safe.
+    pool_stats stats() const;
+
+    // Runs one queued task on the calling thread, if there is one, and
+    // returns if a task was run. Threads that wait for part of the work
+    // of the pool (see task_group) call this so that they help instead
+    // of sleeping. Always returns false with scheduling::handoff.
+    // This function is thread safe.
+    bool run_pending_task();
+
+    // Calls fn(first, last) for consecutive chunks [first, last) that
+    // together cover [begin, end), and returns once every chunk has
+    // completed.
+    // The range is split into at most a few chunks per thread, each of
+    // at least grain elements (except possibly the last). The chunks
+    // are handed out to the threads of the pool, and to the calling
+    // thread, from a shared counter, so no memory is allocated per
+    // chunk or per element.
+    // If fn throws, the remaining chunks still run and the first
+    // exception is rethrown to the caller.
+    // This function does not wait for other tasks in the pool, so it
+    // may be used while unrelated tasks are running. With
+    // scheduling::work_stealing it may also be called from a task of
+    // the pool: the calling thread then runs queued tasks while it
+    // waits.
+    // In a pool of several groups, the chunks are dealt out in shares
+    // of consecutive chunks, one per group in proportion to its
+    // threads, and a thread takes the chunks of its own group before
+    // those of the others. The same part of a range (the same rows of
+    // an image) thus goes to the same NUMA node from call to call. A
+    // calling thread that is not in such a pool only waits.
+    // Precondition: With scheduling::handoff, the calling thread is
+    // not a thread of this pool.
+    // This function is thread safe.
+    template <class F>
+    void parallel_for(size_type begin, size_type end, size_type grain, F &&fn) {
+        run_chunks(begin, end, grain, [&fn](size_type, size_type first, size_type last) { fn(first, last); });
+    }
+
+    // Computes fn(first, last) for chunks of [begin, end) as in
+    // parallel_for, and returns the chunk results combined in range
+    // order, starting from identity:
+    // combine(...combine(combine(identity, r0), r1)..., rn).
+    // Because the chunks and the order of combination depend only on
+    // the range, the grain and the size of the pool, the result is
+    // deterministic even for non-associative operations such as
+    // floating-point addition.
+    // Precondition: As for parallel_for.
+    // This function is thread safe.
+    template <class T, class F, class Combine>
+    T parallel_reduce(size_type begin, size_type end, size_type grain, T identity, F &&fn, Combine &&combine) {
+        std::vector<T> partial(chunk_count(end > begin ? end - begin : 0, grain), identity);
+        run_chunks(begin, end, grain, [&](size_type c, size_type first, size_type last) { partial[c] = fn(first, last); });
+        T result = std::move(identity);
+        for (T &p : partial) {
+            result = combine(std::move(result), std::move(p));
+        }
+        return result;
+    }
+
    private:
+    // The chunks of a job left to one group of threads.
+    struct group_share {
+        std::atomic<size_type> next{0};  // next chunk to hand out
+        size_type end = 0;               // the chunk after the last of the share
+    };
+
+    // State shared by the threads working on one parallel_for call.
+    // It lives on the stack of the calling thread.
+    struct chunk_job {
+        basic_thread_pool *pool;
+        size_type begin;
+        size_type end;
+        size_type chunks;
+        void (*call)(void *fn, size_type chunk, size_type first, size_type last);
+        void *fn;
+        std::atomic<size_type> next{0};  // next chunk to hand out
+        std::unique_ptr<group_share[]> shares;  // one per group, if there are several
+        size_type helpers = 0;           // pool tasks working on the job
+        size_type finished = 0;          // helpers that have returned
+        std::exception_ptr error;        // first exception thrown by fn
+        Mutex m;
+        CV cv;
+    };
+
+    // Returns the number of chunks a range of n elements is split into.
+    size_type chunk_count(size_type n, size_type grain) const;
+
+    // Type-erases fn(chunk, first, last) and runs it through run_job.
+    template <class F>
+    void run_chunks(size_type begin, size_type end, size_type grain, F &&fn) {
+        chunk_job job;
+        job.pool = this;
+        job.begin = begin;
+        job.end = end > begin ? end : begin;
+        job.chunks = chunk_count(job.end - begin, grain);
+        job.fn = const_cast<void *>(static_cast<const void *>(&fn));
+        job.call = [](void *f, size_type c, size_type first, size_type last) {
+            (*static_cast<std::remove_reference_t<F> *>(f))(c, first, last);
+        };
+        run_job(job);
+    }
+
+    // Runs the chunks of job on the pool and the calling thread.
+    void run_job(chunk_job &job);
+
+    // Claims and runs chunks of job until there are none left.
+    void work_on(chunk_job &job);
+
+    // Runs chunk c of job, keeping the first exception it throws.
+    static void run_chunk(chunk_job &job, size_type c);
+
+    // The deque of tasks of one thread in scheduling::work_stealing
+    // mode. The owner pushes and pops at the back, thieves pop at the
+    // front.
+    struct task_deque {
+        Mutex m;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // Allocates the per-thread state for mode and starts n threads.
+    void start(size_type n, scheduling mode);
+
+    // Pins every thread to its CPUs (see pins_), counting failures in
+    // unpinned_.
+    void pin_threads();
+
+    template <class Pool>
+    friend class basic_task_group;
+
+    // Schedules func, and returns false (dropping func) if the pool is
+    // shut down.
+    bool enqueue(std::function<void()> &&func);
+
+    // Schedules func in scheduling::work_stealing mode.
+    bool schedule_stealing(std::function<void()> &&func);
+
+    // Runs the task f taken from the deques and reports it finished.
+    void run_task(std::function<void()> &f);
+
+    // Wakes a sleeping thread, if any, after a task has been queued.
+    void wake_one();
+
+    // Pops a task into f for thread i, from the back of its own deque,
+    // the shared queue, or the front of another deque. A thread that
+    // is not in the pool passes i == size(). Returns false if they are
+    // all empty.
+    bool take_task(size_type i, std::function<void()> &f);
+
+    // The body of thread i in scheduling::work_stealing mode.
+    void steal_loop(size_type i);
+
+    using task_queue = Queue<std::function<void()>>;
+    using index_queue = Queue<size_type>;
+
     void start_threads(size_type n);
+    std::vector<std::vector<int>> pins_;  // per thread: the CPUs it is pinned to (none if empty)
+    std::vector<size_type> group_;        // per thread: its group
+    std::vector<size_type> group_start_;  // per group, and one past the last: the threads of the groups before it
+    size_type unpinned_ = 0;              // threads that could not be pinned
+    scheduling mode_ = scheduling::work_stealing;
     int terminate_ = -1;
     int state_ = 0;  // 0 == not shutdown | 1 == finishing tasks | 2 == shutdown
     size_type size_;     // how many threads
-    FQ tasks_ = FQ(32);  // at least 32 tasks
+    task_queue tasks_ = task_queue(32);  // at least 32 tasks
     Thread *threads_;
-    Mutex *mutexes_;
-    CV *cvs_;
-    IQ *idle_;
+    Mutex *mutexes_ = nullptr;
+    CV *cvs_ = nullptr;
+    index_queue *idle_ = nullptr;
+    task_queue injected_ = task_queue(256);    // work_stealing: tasks scheduled from outside the pool
+    task_deque *deques_ = nullptr;             // work_stealing: one per thread
+    std::atomic<size_type> queued_{0};         // work_stealing: tasks in the deques
+    std::atomic<size_type> outstanding_{0};    // work_stealing: scheduled tasks not yet finished
+    std::atomic<size_type> sleepers_{0};       // work_stealing: threads waiting on steal_cv_
+    std::atomic<size_type> next_deque_{0};     // work_stealing: deque for the next external task
+    bool stop_ = false;                        // work_stealing: threads should exit (guarded by steal_m_)
+    Mutex steal_m_ = Mutex();
+    CV steal_cv_ = CV();
+    std::atomic<bool> stats_enabled_{false};          // set by set_stats_enabled
+    std::atomic<size_type> stats_users_{0};           // retain_stats calls not yet released, plus 1 while stats_enabled_
+    std::atomic<std::uint64_t> tasks_scheduled_{0};  // see pool_stats
+    std::atomic<std::uint64_t> queue_wait_ns_{0};
     Mutex tpm_ = Mutex();         // thread pool mutex
     Mutex shutdown_m_ = Mutex();  // shutdown mutex
     CV tpcv_ = CV();
 };
+
+// Both pools are compiled once, in thread_pool.cpp.
+extern template class basic_thread_pool<queue>;
+extern template class basic_thread_pool<ring_queue>;
+
+// The thread pool used by the library.
+using thread_pool = basic_thread_pool<ring_queue>;
 }  // namespace ra::concurrency
 
 #endif
\ No newline at end of file
@@ -0,0 +1,171 @@
+#ifndef TILES_H
+#define TILES_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace ra::quantization {
+
+// A rectangle of an image: rows [row, row + rows) and columns
+// [col, col + cols).
+struct tile_rect {
+    int row;
+    int col;
+    int rows;
+    int cols;
+};
+
+// Splits a rows x cols image into tiles of at most tile_rows x
+// tile_cols pixels, in row-major order.
+// Precondition: tile_rows > 0 && tile_cols > 0
+inline std::vector<tile_rect> make_tiles(int rows, int cols, int tile_rows, int tile_cols) {
+    std::vector<tile_rect> tiles;
+    for (int r = 0; r < rows; r += tile_rows) {
+        for (int c = 0; c < cols; c += tile_cols) {
+            tiles.push_back(tile_rect{r, c, std::min(tile_rows, rows - r), std::min(tile_cols, cols - c)});
+        }
+    }
+    return tiles;
+}
+
+// Where the tiles of an image are read from.
+// read may be called for the same tile more than once (once per pass),
+// but never concurrently.
+class tile_source {
+   public:
+    virtual ~tile_source() = default;
+
+    // Returns the size of the image.
+    virtual int rows() const = 0;
+    virtual int cols() const = 0;
+
+    // Reads the pixels of rect into data as continuous 4-channel, 8-bit
+    // pixels (rect.cols * 4 bytes per row).
+    // Throws std::runtime_error if the pixels cannot be read.
+    virtual void read(const tile_rect &rect, std::uint8_t *data) = 0;
+};
+
+// Where the tiles of a quantized image are written to.
+// Every tile is written once, in the order of make_tiles, and write is
+// never called concurrently.
+class tile_sink {
+   public:
+    virtual ~tile_sink() = default;
+
+    // Writes the continuous 4-channel, 8-bit pixels of rect from data
+    // (rect.cols * 4 bytes per row).
+    // Throws std::runtime_error if the pixels cannot be written.
+    virtual void write(const tile_rect &rect, const std::uint8_t *data) = 0;
+};
+
+// A tile source over a 4-channel, 8-bit image in memory, whose rows are
+// stride bytes apart.
+class memory_tile_source : public tile_source {
+   public:
+    memory_tile_source(const std::uint8_t *data, int rows, int cols, std::size_t stride)
+        : data_(data), rows_(rows), cols_(cols), stride_(stride) {}
+    memory_tile_source(const std::uint8_t *data, int rows, int cols)
+        : memory_tile_source(data, rows, cols, std::size_t(cols) * 4) {}
+
+    int rows() const override { return rows_; }
+    int cols() const override { return cols_; }
+
+    void read(const tile_rect &rect, std::uint8_t *data) override {
+        for (int r = 0; r < rect.rows; r++) {
+            std::memcpy(data + std::size_t(r) * rect.cols * 4, data_ + (rect.row + r) * stride_ + std::size_t(rect.col) * 4, std::size_t(rect.cols) * 4);
+        }
+    }
+
+   private:
+    const std::uint8_t *data_;
+    int rows_;
+    int cols_;
+    std::size_t stride_;
+};
+
+// A tile sink into a 4-channel, 8-bit image in memory, whose rows are
+// stride bytes apart.
+class memory_tile_sink : public tile_sink {
+   public:
+    memory_tile_sink(std::uint8_t *data, std::size_t stride) : data_(data), stride_(stride) {}
+
+    void write(const tile_rect &rect, const std::uint8_t *data) override {
+        for (int r = 0; r < rect.rows; r++) {
+            std::memcpy(data_ + (rect.row + r) * stride_ + std::size_t(rect.col) * 4, data + std::size_t(r) * rect.cols * 4, std::size_t(rect.cols) * 4);
+        }
+    }
+
+   private:
+    std::uint8_t *data_;
+    std::size_t stride_;
+};
+
+// A tile source over a raw file of rows x cols continuous 4-channel,
+// 8-bit pixels in row-major order, with no header.
+// Only the rows of the tile being read are touched.
+class raw_file_tile_source : public tile_source {
+   public:
+    raw_file_tile_source(const std::string &path, int rows, int cols) : file_(path, std::ios::binary), rows_(rows), cols_(cols) {
+        if (!file_) {
+            throw std::runtime_error("cannot open " + path);
+        }
+        file_.seekg(0, std::ios::end);
+        if (std::streamoff(file_.tellg()) < std::streamoff(rows) * cols * 4) {
+            throw std::runtime_error(path + " is smaller than " + std::to_string(rows) + "x" + std::to_string(cols) + " RGBA pixels");
+        }
+    }
+
+    int rows() const override { return rows_; }
+    int cols() const override { return cols_; }
+
+    void read(const tile_rect &rect, std::uint8_t *data) override {
+        for (int r = 0; r < rect.rows; r++) {
+            file_.seekg((std::streamoff(rect.row + r) * cols_ + rect.col) * 4);
+            file_.read(reinterpret_cast<char *>(data + std::size_t(r) * rect.cols * 4), std::streamsize(rect.cols) * 4);
+        }
+        if (!file_) {
+            throw std::runtime_error("read error");
+        }
+    }
+
+   private:
+    std::ifstream file_;
+    int rows_;
+    int cols_;
+};
+
+// A tile sink into a raw file of rows x cols continuous 4-channel,
+// 8-bit pixels in row-major order, with no header. The file is created
+// (or truncated) by the constructor.
+class raw_file_tile_sink : public tile_sink {
+   public:
+    raw_file_tile_sink(const std::string &path, int cols) : file_(path, std::ios::binary | std::ios::trunc), cols_(cols) {
+        if (!file_) {
+            throw std::runtime_error("cannot create " + path);
+        }
+    }
+
+    void write(const tile_rect &rect, const std::uint8_t *data) override {
+        for (int r = 0; r < rect.rows; r++) {
+            file_.seekp((std::streamoff(rect.row + r) * cols_ + rect.col) * 4);
+            file_.write(reinterpret_cast<const char *>(data + std::size_t(r) * rect.cols * 4), std::streamsize(rect.cols) * 4);
+        }
+        if (!file_) {
+            throw std::runtime_error("write error");
+        }
+    }
+
+   private:
+    std::ofstream file_;
+    int cols_;
+};
+
+}  // namespace ra::quantization
+
+#endif
@@ -0,0 +1,130 @@
+#include "../include/ra/indexed_png.hpp"
+
+#include <fstream>
+#include <stdexcept>
+
+#include <zlib.h>
+
+namespace ra::quantization {
+
+namespace {
+
+void put_u32_be(std::vector<std::uint8_t> &out, std::uint32_t x) {
+    out.push_back(x >> 24);
+    out.push_back((x >> 16) & 0xff);
+    out.push_back((x >> 8) & 0xff);
+    out.push_back(x & 0xff);
+}
+
+// Appends a chunk of the given type and data, with its length and CRC.
+void put_chunk(std::vector<std::uint8_t> &out, const char *type, const std::uint8_t *data, std::size_t size) {
+    put_u32_be(out, std::uint32_t(size));
+    std::size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    put_u32_be(out, std::uint32_t(crc32(0, out.data() + start, uInt(out.size() - start))));
+}
+
+// Returns the fewest bits per pixel (1, 2, 4 or 8) that hold an index of a palette of n colours.
+int index_bits(std::size_t n) {
+    int bits = 1;
+    while ((std::size_t(1) << bits) < n) {
+        bits *= 2;
+    }
+    return bits;
+}
+
+}  // namespace
+
+std::vector<std::uint8_t> encode_indexed_png(const const_image_view &indices, const std::vector<std::uint32_t> &palette, bool bgr, int level) {
+    if (palette.empty() || palette.size() > 256) {
+        throw std::invalid_argument("a palette PNG holds 1 to 256 colours, not " + std::to_string(palette.size()));
+    }
+    int bits = index_bits(palette.size());
+    std::vector<std::uint8_t> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+    std::vector<std::uint8_t> header;
+    put_u32_be(header, indices.cols);
+    put_u32_be(header, indices.rows);
+    header.insert(header.end(), {std::uint8_t(bits), 3, 0, 0, 0});  // colour type 3 (palette), deflate, no interlace
+    put_chunk(png, "IHDR", header.data(), header.size());
+
+    std::vector<std::uint8_t> plte;
+    std::vector<std::uint8_t> trns;
+    std::size_t last_translucent = 0;  // tRNS may stop after the last entry that is not opaque
+    for (std::size_t i = 0; i < palette.size(); i++) {
+        std::uint32_t c = palette[i];
+        std::uint8_t r = bgr ? (c >> 16) & 0xff : c & 0xff;
+        std::uint8_t b = bgr ? c & 0xff : (c >> 16) & 0xff;
+        plte.insert(plte.end(), {r, std::uint8_t((c >> 8) & 0xff), b});
+        trns.push_back(c >> 24);
+        if (trns.back() != 255) {
+            last_translucent = i + 1;
+        }
+    }
+    put_chunk(png, "PLTE", plte.data(), plte.size());
+    if (last_translucent > 0) {
+        put_chunk(png, "tRNS", trns.data(), last_translucent);
+    }
+
+    // every row is packed behind filter byte 0 (none), the usual choice for indexed images, and
+    // compressed as it is produced; the stream is cut into IDAT chunks of at most 64 KiB
+    z_stream zs = {};
+    if (deflateInit(&zs, level) != Z_OK) {
+        throw std::runtime_error("cannot initialise zlib");
+    }
+    std::vector<std::uint8_t> row(1 + (std::size_t(indices.cols) * bits + 7) / 8);
+    std::vector<std::uint8_t> idat(1 << 16);
+    zs.next_out = idat.data();
+    zs.avail_out = uInt(idat.size());
+    auto deflate_some = [&](int flush) {
+        int status;
+        do {
+            status = deflate(&zs, flush);
+            if (status == Z_STREAM_ERROR) {
+                deflateEnd(&zs);
+                throw std::runtime_error("zlib compression failed");
+            }
+            if (zs.avail_out == 0 || (flush == Z_FINISH && status == Z_STREAM_END)) {
+                put_chunk(png, "IDAT", idat.data(), idat.size() - zs.avail_out);
+                zs.next_out = idat.data();
+                zs.avail_out = uInt(idat.size());
+            }
+        } while (zs.avail_in != 0 || (flush == Z_FINISH && status != Z_STREAM_END));
+    };
+    for (int r = 0; r < indices.rows; r++) {
+        const std::uint8_t *p = indices.row(r);
+        std::fill(row.begin(), row.end(), 0);
+        if (bits == 8) {
+            std::copy(p, p + indices.cols, row.begin() + 1);
+        } else {
+            int per_byte = 8 / bits;
+            for (int c = 0; c < indices.cols; c++) {
+                // the first pixel goes to the most significant bits
+                row[1 + c / per_byte] |= p[c] << (8 - bits * (c % per_byte + 1));
+            }
+        }
+        zs.next_in = row.data();
+        zs.avail_in = uInt(row.size());
+        deflate_some(Z_NO_FLUSH);
+    }
+    deflate_some(Z_FINISH);
+    deflateEnd(&zs);
+
+    put_chunk(png, "IEND", nullptr, 0);
+    return png;
+}
+
+void write_indexed_png(const std::string &path, const const_image_view &indices, const std::vector<std::uint32_t> &palette, bool bgr, int level) {
+    std::vector<std::uint8_t> png = encode_indexed_png(indices, palette, bgr, level);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("cannot create " + path);
+    }
+    out.write(reinterpret_cast<const char *>(png.data()), png.size());
+    if (!out) {
+        throw std::runtime_error("write error on " + path);
+    }
+}
+
+}  // namespace ra::quantization
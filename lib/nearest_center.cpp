@@ -0,0 +1,400 @@
+#include "../include/ra/nearest_center.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RA_HAVE_X86 1
+#endif
+
+namespace ra::quantization {
+
+namespace {
+
+// Returns channel c (0 to 3) of a packed colour.
+inline std::int32_t channel_of(std::uint32_t colour, int c) { return (colour >> (8 * c)) & 0xff; }
+
+// Returns the squared distance for the channel differences d0 to d3,
+// computing only the channels that vary with C (see
+// center_soa::channels).
+template <int C>
+inline std::uint32_t squared(std::int32_t d0, std::int32_t d1, std::int32_t d2, std::int32_t d3) {
+    if constexpr (C == 1) {
+        return 3 * d0 * d0;  // channels 0 to 2 are equal, channel 3 is 255
+    } else if constexpr (C == 3) {
+        return d0 * d0 + d1 * d1 + d2 * d2;
+    } else {
+        return d0 * d0 + d1 * d1 + d2 * d2 + d3 * d3;
+    }
+}
+
+template <int C>
+void nearest_scalar(const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist) {
+    const std::int32_t *c0 = centers.channel(0);
+    const std::int32_t *c1 = centers.channel(1);
+    const std::int32_t *c2 = centers.channel(2);
+    const std::int32_t *c3 = centers.channel(3);
+    std::size_t k = centers.size();
+    for (std::size_t i = 0; i < n; i++) {
+        std::int32_t v0 = channel_of(colours[i], 0);
+        std::int32_t v1 = channel_of(colours[i], 1);
+        std::int32_t v2 = channel_of(colours[i], 2);
+        std::int32_t v3 = channel_of(colours[i], 3);
+        std::uint32_t best = 0;
+        std::uint32_t best_dist = -1;
+        for (std::size_t j = 0; j < k; j++) {
+            std::int32_t d0 = c0[j] - v0;
+            std::int32_t d1 = c1[j] - v1;
+            std::int32_t d2 = c2[j] - v2;
+            std::int32_t d3 = c3[j] - v3;
+            std::uint32_t d = squared<C>(d0, d1, d2, d3);
+            if (d < best_dist) {
+                best = j;
+                best_dist = d;
+            }
+        }
+        index[i] = best;
+        dist[i] = best_dist;
+    }
+}
+
+template <int C>
+void nearest_two_scalar(const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist, std::uint32_t *second) {
+    const std::int32_t *c0 = centers.channel(0);
+    const std::int32_t *c1 = centers.channel(1);
+    const std::int32_t *c2 = centers.channel(2);
+    const std::int32_t *c3 = centers.channel(3);
+    std::size_t k = centers.size();
+    for (std::size_t i = 0; i < n; i++) {
+        std::int32_t v0 = channel_of(colours[i], 0);
+        std::int32_t v1 = channel_of(colours[i], 1);
+        std::int32_t v2 = channel_of(colours[i], 2);
+        std::int32_t v3 = channel_of(colours[i], 3);
+        std::uint32_t best = 0;
+        std::uint32_t best_dist = -1;
+        std::uint32_t second_dist = -1;
+        for (std::size_t j = 0; j < k; j++) {
+            std::int32_t d0 = c0[j] - v0;
+            std::int32_t d1 = c1[j] - v1;
+            std::int32_t d2 = c2[j] - v2;
+            std::int32_t d3 = c3[j] - v3;
+            std::uint32_t d = squared<C>(d0, d1, d2, d3);
+            if (d < best_dist) {
+                second_dist = best_dist;
+                best = j;
+                best_dist = d;
+            } else if (d < second_dist) {
+                second_dist = d;
+            }
+        }
+        index[i] = best;
+        dist[i] = best_dist;
+        second[i] = second_dist;
+    }
+}
+
+#ifdef RA_HAVE_X86
+
+// Returns the squared distances of the colour (v0, v1, v2, v3) to
+// centers j to j + 3, computing only the channels that vary with C.
+template <int C>
+__attribute__((target("sse4.1"))) inline __m128i distances_sse41(const std::int32_t *c0, const std::int32_t *c1, const std::int32_t *c2, const std::int32_t *c3,
+                                                                 std::size_t j, __m128i v0, __m128i v1, __m128i v2, __m128i v3) {
+    __m128i d = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(c0 + j)), v0);
+    __m128i acc = _mm_mullo_epi32(d, d);
+    if constexpr (C == 1) {
+        acc = _mm_add_epi32(acc, _mm_slli_epi32(acc, 1));  // channels 0 to 2 are equal, channel 3 is 255
+    } else {
+        d = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(c1 + j)), v1);
+        acc = _mm_add_epi32(acc, _mm_mullo_epi32(d, d));
+        d = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(c2 + j)), v2);
+        acc = _mm_add_epi32(acc, _mm_mullo_epi32(d, d));
+        if constexpr (C == 4) {
+            d = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(c3 + j)), v3);
+            acc = _mm_add_epi32(acc, _mm_mullo_epi32(d, d));
+        }
+    }
+    return acc;
+}
+
+// As above, for centers j to j + 7.
+template <int C>
+__attribute__((target("avx2"))) inline __m256i distances_avx2(const std::int32_t *c0, const std::int32_t *c1, const std::int32_t *c2, const std::int32_t *c3,
+                                                              std::size_t j, __m256i v0, __m256i v1, __m256i v2, __m256i v3) {
+    __m256i d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(c0 + j)), v0);
+    __m256i acc = _mm256_mullo_epi32(d, d);
+    if constexpr (C == 1) {
+        acc = _mm256_add_epi32(acc, _mm256_slli_epi32(acc, 1));
+    } else {
+        d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(c1 + j)), v1);
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(d, d));
+        d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(c2 + j)), v2);
+        acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(d, d));
+        if constexpr (C == 4) {
+            d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(c3 + j)), v3);
+            acc = _mm256_add_epi32(acc, _mm256_mullo_epi32(d, d));
+        }
+    }
+    return acc;
+}
+
+// Reduces four per-lane (distance, index) minima to the overall
+// minimum, choosing the lowest index among equal distances.
+__attribute__((target("sse4.1"))) inline void reduce_lanes(__m128i d, __m128i idx, std::uint32_t &index, std::uint32_t &dist) {
+    __m128i m = _mm_min_epi32(d, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+    m = _mm_min_epi32(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+    // lanes that do not hold the minimum distance are excluded from the index minimum
+    __m128i masked = _mm_or_si128(idx, _mm_andnot_si128(_mm_cmpeq_epi32(d, m), _mm_set1_epi32(0x7fffffff)));
+    masked = _mm_min_epi32(masked, _mm_shuffle_epi32(masked, _MM_SHUFFLE(1, 0, 3, 2)));
+    masked = _mm_min_epi32(masked, _mm_shuffle_epi32(masked, _MM_SHUFFLE(2, 3, 0, 1)));
+    index = _mm_cvtsi128_si32(masked);
+    dist = _mm_cvtsi128_si32(m);
+}
+
+template <int C>
+__attribute__((target("sse4.1"))) void nearest_sse41(const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist) {
+    const std::int32_t *c0 = centers.channel(0);
+    const std::int32_t *c1 = centers.channel(1);
+    const std::int32_t *c2 = centers.channel(2);
+    const std::int32_t *c3 = centers.channel(3);
+    std::size_t k = centers.padded_size();
+    const __m128i step = _mm_set1_epi32(4);
+    for (std::size_t i = 0; i < n; i++) {
+        __m128i v0 = _mm_set1_epi32(channel_of(colours[i], 0));
+        __m128i v1 = _mm_set1_epi32(channel_of(colours[i], 1));
+        __m128i v2 = _mm_set1_epi32(channel_of(colours[i], 2));
+        __m128i v3 = _mm_set1_epi32(channel_of(colours[i], 3));
+        __m128i best_dist = _mm_set1_epi32(0x7fffffff);
+        __m128i best = _mm_setzero_si128();
+        __m128i j_vec = _mm_setr_epi32(0, 1, 2, 3);
+        for (std::size_t j = 0; j < k; j += 4) {
+            __m128i acc = distances_sse41<C>(c0, c1, c2, c3, j, v0, v1, v2, v3);
+            __m128i closer = _mm_cmplt_epi32(acc, best_dist);
+            best_dist = _mm_min_epi32(acc, best_dist);
+            best = _mm_blendv_epi8(best, j_vec, closer);
+            j_vec = _mm_add_epi32(j_vec, step);
+        }
+        reduce_lanes(best_dist, best, index[i], dist[i]);
+    }
+}
+
+// Merges two sets of per-lane (nearest, second nearest, index) triples
+// into the first, choosing the lower index among equal distances.
+__attribute__((target("sse4.1"))) inline void merge_two(__m128i &best, __m128i &second, __m128i &idx, __m128i best2, __m128i second2, __m128i idx2) {
+    __m128i take = _mm_or_si128(_mm_cmpgt_epi32(best, best2), _mm_and_si128(_mm_cmpeq_epi32(best, best2), _mm_cmpgt_epi32(idx, idx2)));
+    second = _mm_min_epi32(_mm_min_epi32(second, second2), _mm_max_epi32(best, best2));
+    best = _mm_min_epi32(best, best2);
+    idx = _mm_blendv_epi8(idx, idx2, take);
+}
+
+// Reduces four per-lane (nearest, second nearest, index) triples to
+// the overall triple.
+__attribute__((target("sse4.1"))) inline void reduce_two(__m128i best, __m128i second, __m128i idx, std::uint32_t &index, std::uint32_t &dist, std::uint32_t &second_dist) {
+    merge_two(best, second, idx, _mm_shuffle_epi32(best, _MM_SHUFFLE(1, 0, 3, 2)), _mm_shuffle_epi32(second, _MM_SHUFFLE(1, 0, 3, 2)), _mm_shuffle_epi32(idx, _MM_SHUFFLE(1, 0, 3, 2)));
+    merge_two(best, second, idx, _mm_shuffle_epi32(best, _MM_SHUFFLE(2, 3, 0, 1)), _mm_shuffle_epi32(second, _MM_SHUFFLE(2, 3, 0, 1)), _mm_shuffle_epi32(idx, _MM_SHUFFLE(2, 3, 0, 1)));
+    index = _mm_cvtsi128_si32(idx);
+    dist = _mm_cvtsi128_si32(best);
+    second_dist = _mm_cvtsi128_si32(second);
+}
+
+template <int C>
+__attribute__((target("sse4.1"))) void nearest_two_sse41(const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist, std::uint32_t *second) {
+    const std::int32_t *c0 = centers.channel(0);
+    const std::int32_t *c1 = centers.channel(1);
+    const std::int32_t *c2 = centers.channel(2);
+    const std::int32_t *c3 = centers.channel(3);
+    std::size_t k = centers.padded_size();
+    const __m128i step = _mm_set1_epi32(4);
+    for (std::size_t i = 0; i < n; i++) {
+        __m128i v0 = _mm_set1_epi32(channel_of(colours[i], 0));
+        __m128i v1 = _mm_set1_epi32(channel_of(colours[i], 1));
+        __m128i v2 = _mm_set1_epi32(channel_of(colours[i], 2));
+        __m128i v3 = _mm_set1_epi32(channel_of(colours[i], 3));
+        __m128i best_dist = _mm_set1_epi32(0x7fffffff);
+        __m128i second_dist = best_dist;
+        __m128i best = _mm_setzero_si128();
+        __m128i j_vec = _mm_setr_epi32(0, 1, 2, 3);
+        for (std::size_t j = 0; j < k; j += 4) {
+            __m128i acc = distances_sse41<C>(c0, c1, c2, c3, j, v0, v1, v2, v3);
+            __m128i closer = _mm_cmplt_epi32(acc, best_dist);
+            second_dist = _mm_min_epi32(second_dist, _mm_max_epi32(acc, best_dist));
+            best_dist = _mm_min_epi32(acc, best_dist);
+            best = _mm_blendv_epi8(best, j_vec, closer);
+            j_vec = _mm_add_epi32(j_vec, step);
+        }
+        reduce_two(best_dist, second_dist, best, index[i], dist[i], second[i]);
+    }
+}
+
+template <int C>
+__attribute__((target("avx2"))) void nearest_avx2(const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist) {
+    const std::int32_t *c0 = centers.channel(0);
+    const std::int32_t *c1 = centers.channel(1);
+    const std::int32_t *c2 = centers.channel(2);
+    const std::int32_t *c3 = centers.channel(3);
+    std::size_t k = centers.padded_size();
+    const __m256i step = _mm256_set1_epi32(16);
+    for (std::size_t i = 0; i < n; i++) {
+        __m256i v0 = _mm256_set1_epi32(channel_of(colours[i], 0));
+        __m256i v1 = _mm256_set1_epi32(channel_of(colours[i], 1));
+        __m256i v2 = _mm256_set1_epi32(channel_of(colours[i], 2));
+        __m256i v3 = _mm256_set1_epi32(channel_of(colours[i], 3));
+        // two independent accumulators cover 16 centers per iteration
+        __m256i best_dist_a = _mm256_set1_epi32(0x7fffffff);
+        __m256i best_dist_b = best_dist_a;
+        __m256i best_a = _mm256_setzero_si256();
+        __m256i best_b = best_a;
+        __m256i j_a = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i j_b = _mm256_setr_epi32(8, 9, 10, 11, 12, 13, 14, 15);
+        for (std::size_t j = 0; j < k; j += 16) {
+            __m256i acc_a = distances_avx2<C>(c0, c1, c2, c3, j, v0, v1, v2, v3);
+            __m256i acc_b = distances_avx2<C>(c0, c1, c2, c3, j + 8, v0, v1, v2, v3);
+            __m256i closer_a = _mm256_cmpgt_epi32(best_dist_a, acc_a);
+            __m256i closer_b = _mm256_cmpgt_epi32(best_dist_b, acc_b);
+            best_dist_a = _mm256_min_epi32(acc_a, best_dist_a);
+            best_dist_b = _mm256_min_epi32(acc_b, best_dist_b);
+            best_a = _mm256_blendv_epi8(best_a, j_a, closer_a);
+            best_b = _mm256_blendv_epi8(best_b, j_b, closer_b);
+            j_a = _mm256_add_epi32(j_a, step);
+            j_b = _mm256_add_epi32(j_b, step);
+        }
+        // merge the two accumulators, keeping the lower index on equal distances
+        __m256i b_closer = _mm256_or_si256(_mm256_cmpgt_epi32(best_dist_a, best_dist_b),
+                                           _mm256_and_si256(_mm256_cmpeq_epi32(best_dist_a, best_dist_b), _mm256_cmpgt_epi32(best_a, best_b)));
+        best_dist_a = _mm256_min_epi32(best_dist_a, best_dist_b);
+        best_a = _mm256_blendv_epi8(best_a, best_b, b_closer);
+        // then fold the upper half onto the lower half
+        __m128i lo_dist = _mm256_castsi256_si128(best_dist_a);
+        __m128i hi_dist = _mm256_extracti128_si256(best_dist_a, 1);
+        __m128i lo = _mm256_castsi256_si128(best_a);
+        __m128i hi = _mm256_extracti128_si256(best_a, 1);
+        __m128i hi_closer = _mm_or_si128(_mm_cmpgt_epi32(lo_dist, hi_dist), _mm_and_si128(_mm_cmpeq_epi32(lo_dist, hi_dist), _mm_cmpgt_epi32(lo, hi)));
+        reduce_lanes(_mm_min_epi32(lo_dist, hi_dist), _mm_blendv_epi8(lo, hi, hi_closer), index[i], dist[i]);
+    }
+}
+
+template <int C>
+__attribute__((target("avx2"))) void nearest_two_avx2(const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist, std::uint32_t *second) {
+    const std::int32_t *c0 = centers.channel(0);
+    const std::int32_t *c1 = centers.channel(1);
+    const std::int32_t *c2 = centers.channel(2);
+    const std::int32_t *c3 = centers.channel(3);
+    std::size_t k = centers.padded_size();
+    const __m256i step = _mm256_set1_epi32(8);
+    for (std::size_t i = 0; i < n; i++) {
+        __m256i v0 = _mm256_set1_epi32(channel_of(colours[i], 0));
+        __m256i v1 = _mm256_set1_epi32(channel_of(colours[i], 1));
+        __m256i v2 = _mm256_set1_epi32(channel_of(colours[i], 2));
+        __m256i v3 = _mm256_set1_epi32(channel_of(colours[i], 3));
+        __m256i best_dist = _mm256_set1_epi32(0x7fffffff);
+        __m256i second_dist = best_dist;
+        __m256i best = _mm256_setzero_si256();
+        __m256i j_vec = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        for (std::size_t j = 0; j < k; j += 8) {
+            __m256i acc = distances_avx2<C>(c0, c1, c2, c3, j, v0, v1, v2, v3);
+            __m256i closer = _mm256_cmpgt_epi32(best_dist, acc);
+            second_dist = _mm256_min_epi32(second_dist, _mm256_max_epi32(acc, best_dist));
+            best_dist = _mm256_min_epi32(acc, best_dist);
+            best = _mm256_blendv_epi8(best, j_vec, closer);
+            j_vec = _mm256_add_epi32(j_vec, step);
+        }
+        // fold the upper half onto the lower half, then reduce the remaining four lanes
+        __m128i b = _mm256_castsi256_si128(best_dist);
+        __m128i s = _mm256_castsi256_si128(second_dist);
+        __m128i idx = _mm256_castsi256_si128(best);
+        merge_two(b, s, idx, _mm256_extracti128_si256(best_dist, 1), _mm256_extracti128_si256(second_dist, 1), _mm256_extracti128_si256(best, 1));
+        reduce_two(b, s, idx, index[i], dist[i], second[i]);
+    }
+}
+
+#endif
+
+// The kernels for colours and centers whose channels vary with C.
+template <int C>
+void nearest(simd_level level, const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist) {
+    switch (level) {
+#ifdef RA_HAVE_X86
+        case simd_level::avx2:
+            nearest_avx2<C>(centers, colours, n, index, dist);
+            return;
+        case simd_level::sse41:
+            nearest_sse41<C>(centers, colours, n, index, dist);
+            return;
+#endif
+        default:
+            nearest_scalar<C>(centers, colours, n, index, dist);
+    }
+}
+
+template <int C>
+void nearest_two(simd_level level, const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist, std::uint32_t *second) {
+    switch (level) {
+#ifdef RA_HAVE_X86
+        case simd_level::avx2:
+            nearest_two_avx2<C>(centers, colours, n, index, dist, second);
+            return;
+        case simd_level::sse41:
+            nearest_two_sse41<C>(centers, colours, n, index, dist, second);
+            return;
+#endif
+        default:
+            nearest_two_scalar<C>(centers, colours, n, index, dist, second);
+    }
+}
+
+}  // namespace
+
+simd_level detect_simd_level() {
+#ifdef RA_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return simd_level::avx2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return simd_level::sse41;
+    }
+#endif
+    return simd_level::scalar;
+}
+
+void nearest_centers(simd_level level, const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist) {
+    switch (centers.channels()) {
+        case 1:
+            nearest<1>(level, centers, colours, n, index, dist);
+            return;
+        case 3:
+            nearest<3>(level, centers, colours, n, index, dist);
+            return;
+        default:
+            nearest<4>(level, centers, colours, n, index, dist);
+    }
+}
+
+void nearest_centers(const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist) {
+    static const simd_level level = detect_simd_level();  // resolved once, on first use
+    // for a handful of centers the lane reduction costs more than the scalar loop
+    nearest_centers(centers.size() < 6 ? simd_level::scalar : level, centers, colours, n, index, dist);
+}
+
+void nearest_two_centers(simd_level level, const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist, std::uint32_t *second) {
+    switch (centers.channels()) {
+        case 1:
+            nearest_two<1>(level, centers, colours, n, index, dist, second);
+            break;
+        case 3:
+            nearest_two<3>(level, centers, colours, n, index, dist, second);
+            break;
+        default:
+            nearest_two<4>(level, centers, colours, n, index, dist, second);
+    }
+    if (centers.size() == 1) {  // the vector kernels saw the padding centers
+        for (std::size_t i = 0; i < n; i++) {
+            second[i] = -1;
+        }
+    }
+}
+
+void nearest_two_centers(const center_soa &centers, const std::uint32_t *colours, std::size_t n, std::uint32_t *index, std::uint32_t *dist, std::uint32_t *second) {
+    static const simd_level level = detect_simd_level();
+    nearest_two_centers(centers.size() < 6 ? simd_level::scalar : level, centers, colours, n, index, dist, second);
+}
+
+}  // namespace ra::quantization
@@ -0,0 +1,1070 @@
+#include "../include/ra/quantization_tools.hpp"
+
+namespace ra::quantization {
+
+namespace {
+
+// Milliseconds since start
+double ms_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Reports one run to an observer: its start, the time of each phase and its end, with the thread
+// pool counters for the run. The counters are those of the whole pool, so they include the tasks of
+// any run on the same pool at the same time. Without an observer every member function returns at
+// once.
+class observed_run {
+   public:
+    observed_run(thread_pool &tp, quantize_observer *observer, int rows, int cols) : tp_(tp), observer_(observer) {
+        if (observer_ == nullptr) {
+            return;
+        }
+        tp_.retain_stats();
+        before_ = tp_.stats();
+        observer_->run_started(rows, cols);
+        lap_ = std::chrono::steady_clock::now();
+    }
+
+    observed_run(const observed_run &) = delete;
+    observed_run &operator=(const observed_run &) = delete;
+
+    ~observed_run() {
+        if (observer_ != nullptr) {
+            tp_.release_stats();
+        }
+    }
+
+    // Reports the time since the last phase ended (or the run started) as phase
+    void phase_done(quantize_phase phase) {
+        if (observer_ == nullptr) {
+            return;
+        }
+        observer_->phase_done(phase, ms_since(lap_));
+        lap_ = std::chrono::steady_clock::now();
+    }
+
+    // Starts timing the next phase without reporting the time since the last one, which was
+    // spent in a function that reports its own phases
+    void restart() {
+        if (observer_ != nullptr) {
+            lap_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    // Reports the number of unique colours
+    void histogram_built(std::size_t unique_colours) {
+        if (observer_ != nullptr) {
+            observer_->histogram_built(unique_colours);
+        }
+    }
+
+    // Reports the end of the run; samples is true if the palette holds 16-bit sample values
+    void finished(const std::vector<std::uint32_t> &palette, int iterations, bool samples = false) {
+        if (observer_ == nullptr) {
+            return;
+        }
+        ra::concurrency::pool_stats after = tp_.stats();
+        after.tasks_scheduled -= before_.tasks_scheduled;
+        after.queue_wait_ns -= before_.queue_wait_ns;
+        observer_->run_finished(palette, samples, iterations, after);
+    }
+
+   private:
+    thread_pool &tp_;
+    quantize_observer *observer_;
+    ra::concurrency::pool_stats before_;
+    std::chrono::steady_clock::time_point lap_;
+};
+
+// Per-thread accumulators for one k-means iteration. Each worker owns one of these, so the
+// assignment step never locks; the partial sums are reduced once the iteration is complete.
+struct cluster_sums {
+    std::vector<std::uint64_t> sums; // 4 channel sums per cluster, weighted by pixel count
+    std::vector<std::uint64_t> counts; // number of pixels assigned to each cluster
+    std::uint64_t distortion = 0; // total squared distance of every pixel to its cluster center
+
+    void reset(ul k) {
+        sums.assign(k * 4, 0);
+        counts.assign(k, 0);
+        distortion = 0;
+    }
+};
+
+// Copy the cluster centers into the structure-of-arrays layout used by the nearest-center kernel
+void load_centers(const std::vector<Pixel> &cluster_centers, center_soa &centers) {
+    centers.resize(cluster_centers.size());
+    for (ul j = 0; j < cluster_centers.size(); j++) {
+        const Pixel &c = cluster_centers[j];
+        centers.set(j, get<0>(c), get<1>(c), get<2>(c), get<3>(c));
+    }
+}
+
+// Compute nearest cluster for the unique colours [first, last) and add them to this worker's sums
+void compute_clusters(const colour_histogram &unique_colours, ul first, ul last, const center_soa &centers, cluster_sums &sums) {
+    const ul batch = 256;
+    std::uint32_t index[batch];
+    std::uint32_t dist[batch];
+    for (ul i = first; i < last; i += batch) {
+        ul m = std::min(batch, last - i);
+        nearest_centers(centers, &unique_colours.colours[i], m, index, dist);
+        for (ul t = 0; t < m; t++) {
+            std::uint32_t colour = unique_colours.colours[i + t];
+            std::uint64_t n = unique_colours.counts[i + t]; // number of pixels of this unique colour
+            ul cluster = index[t];
+            sums.counts[cluster] += n;
+            for (int c = 0; c < 4; c++) {
+                sums.sums[cluster * 4 + c] += colour_channel(colour, c) * n;
+            }
+            sums.distortion += dist[t] * n;
+        }
+    }
+}
+
+// Reduce the per-thread sums and move every cluster center to the (rounded up) mean of its
+// members. Empty clusters keep their center. Returns the total distortion of the iteration.
+std::uint64_t update_cluster_centers(std::vector<cluster_sums> &partials, std::vector<Pixel> &cluster_centers) {
+    cluster_sums &total = partials[0];
+    for (ul w = 1; w < partials.size(); w++) {
+        for (ul j = 0; j < total.sums.size(); j++) {
+            total.sums[j] += partials[w].sums[j];
+        }
+        for (ul j = 0; j < total.counts.size(); j++) {
+            total.counts[j] += partials[w].counts[j];
+        }
+        total.distortion += partials[w].distortion;
+    }
+    for (ul j = 0; j < cluster_centers.size(); j++) {
+        std::uint64_t n = total.counts[j]; // the total number of pixels within that cluster
+        if (n == 0) {
+            continue;
+        }
+        const std::uint64_t *sum = &total.sums[j * 4];
+        cluster_centers[j] = {(sum[0] + n - 1) / n, (sum[1] + n - 1) / n, (sum[2] + n - 1) / n, (sum[3] + n - 1) / n};
+    }
+    return total.distortion;
+}
+
+// Per-colour state kept between iterations by the Hamerly engine. For every unique colour it holds
+// the index of its cluster and a lower bound on the distance to every other center.
+struct hamerly_bounds {
+    std::vector<std::uint32_t> assignment;
+    std::vector<double> lower;
+
+    void reset(ul n) {
+        assignment.assign(n, 0);
+        lower.assign(n, -1.0); // a negative bound forces a full comparison in the first iteration
+    }
+};
+
+// Center geometry the Hamerly engine needs for one iteration
+struct center_bounds {
+    std::vector<double> half_gap; // half the distance from each center to its nearest other center
+    std::vector<double> drift; // how far each center moved in the previous update
+    ul max_drift_center = 0; // index of the center that moved the most
+    double max_drift = 0; // largest drift
+    double second_drift = 0; // largest drift of any other center
+};
+
+// Squared distance between two 4-channel colours
+long squared_distance(const Pixel &x, const Pixel &y) {
+    long d0 = get<0>(x) - get<0>(y);
+    long d1 = get<1>(x) - get<1>(y);
+    long d2 = get<2>(x) - get<2>(y);
+    long d3 = get<3>(x) - get<3>(y);
+    return d0*d0 + d1*d1 + d2*d2 + d3*d3;
+}
+
+// Fill in half_gap for the current centers, and drift for a move from prev_centers (if given)
+void compute_center_bounds(const std::vector<Pixel> &cluster_centers, const std::vector<Pixel> *prev_centers, center_bounds &bounds) {
+    ul k = cluster_centers.size();
+    bounds.half_gap.assign(k, std::numeric_limits<double>::infinity());
+    for (ul j = 0; j < k; j++) {
+        for (ul j2 = j + 1; j2 < k; j2++) {
+            double half = 0.5 * std::sqrt((double) squared_distance(cluster_centers[j], cluster_centers[j2]));
+            bounds.half_gap[j] = std::min(bounds.half_gap[j], half);
+            bounds.half_gap[j2] = std::min(bounds.half_gap[j2], half);
+        }
+    }
+    bounds.drift.assign(k, 0.0);
+    bounds.max_drift_center = 0;
+    bounds.max_drift = 0;
+    bounds.second_drift = 0;
+    if (prev_centers == nullptr) {
+        return;
+    }
+    for (ul j = 0; j < k; j++) {
+        double d = std::sqrt((double) squared_distance(cluster_centers[j], (*prev_centers)[j]));
+        bounds.drift[j] = d;
+        if (d > bounds.max_drift) {
+            bounds.second_drift = bounds.max_drift;
+            bounds.max_drift = d;
+            bounds.max_drift_center = j;
+        } else if (d > bounds.second_drift) {
+            bounds.second_drift = d;
+        }
+    }
+}
+
+// Hamerly version of compute_clusters. A colour is compared with all centers only when its exact
+// distance to its own center is not strictly below both its lower bound and half the gap from its
+// center to the nearest other center; otherwise its assignment provably cannot change. The colours
+// that do need the full comparison are batched through the nearest-center kernel, whose ties go to
+// the lowest index, so the assignments match those of the naive engine.
+void compute_clusters_hamerly(const colour_histogram &unique_colours, ul first, ul last, const std::vector<Pixel> &cluster_centers, const center_soa &centers, const center_bounds &bounds, hamerly_bounds &state, cluster_sums &sums) {
+    // bounds are tested with a margin far above the rounding error of the square roots, but far
+    // below the smallest difference between the square roots of two distinct squared distances
+    const double margin = 1e-7;
+    const ul batch = 256;
+    std::uint32_t pending[batch]; // unique colour indices that need the full comparison
+    std::uint32_t colours[batch];
+    std::uint32_t index[batch];
+    std::uint32_t dist[batch];
+    std::uint32_t second[batch];
+    auto accumulate = [&](ul i, ul cluster, std::uint64_t d) {
+        std::uint32_t colour = unique_colours.colours[i];
+        std::uint64_t n = unique_colours.counts[i]; // number of pixels of this unique colour
+        sums.counts[cluster] += n;
+        for (int c = 0; c < 4; c++) {
+            sums.sums[cluster * 4 + c] += colour_channel(colour, c) * n;
+        }
+        sums.distortion += d * n;
+    };
+    for (ul i0 = first; i0 < last; i0 += batch) {
+        ul m = 0;
+        for (ul i = i0; i < std::min(last, i0 + batch); i++) {
+            ul cluster = state.assignment[i];
+            double lower = state.lower[i] - (cluster == bounds.max_drift_center ? bounds.second_drift : bounds.max_drift);
+            long d = squared_distance(to_pixel(unique_colours.colours[i]), cluster_centers[cluster]);
+            if (std::sqrt((double) d) < std::max(lower, bounds.half_gap[cluster]) - margin) {
+                state.lower[i] = lower;
+                accumulate(i, cluster, d);
+            } else {
+                pending[m] = i;
+                colours[m] = unique_colours.colours[i];
+                m++;
+            }
+        }
+        // the bounds are not tight enough; compare these with every center, keeping the two nearest
+        nearest_two_centers(centers, colours, m, index, dist, second);
+        for (ul t = 0; t < m; t++) {
+            state.assignment[pending[t]] = index[t];
+            state.lower[pending[t]] = second[t] == std::uint32_t(-1) ? std::numeric_limits<double>::infinity() : std::sqrt((double) second[t]);
+            accumulate(pending[t], index[t], dist[t]);
+        }
+    }
+}
+
+// Mini-batch k-means (Sculley, 2010). Every iteration samples batch_size pixels from the histogram
+// (a colour is drawn in proportion to its pixel count), assigns them to the current centers, and
+// moves each center towards its samples with a learning rate of 1 / (pixels it has seen so far).
+void minibatch_cluster_centers(const colour_histogram &unique_colours, std::vector<Pixel> &cluster_centers, const quantize_options &options) {
+    ul k = cluster_centers.size();
+    std::vector<std::uint64_t> cumulative(unique_colours.size()); // running pixel count, for sampling
+    std::uint64_t total = 0;
+    for (ul i = 0; i < unique_colours.size(); i++) {
+        total += unique_colours.counts[i];
+        cumulative[i] = total;
+    }
+    std::vector<double> center(k * 4); // the centers move in fractional steps
+    for (ul j = 0; j < k; j++) {
+        const Pixel &c = cluster_centers[j];
+        center[j * 4] = get<0>(c);
+        center[j * 4 + 1] = get<1>(c);
+        center[j * 4 + 2] = get<2>(c);
+        center[j * 4 + 3] = get<3>(c);
+    }
+    std::vector<std::uint64_t> seen(k, 0); // per-center sample counts, giving the learning rates
+    std::mt19937_64 rng(options.seed ^ 0x9E3779B97F4A7C15ull); // not the stream the seeding used
+    std::uniform_int_distribution<std::uint64_t> pick(0, total - 1);
+    ul batch = std::max(1, options.batch_size);
+    std::vector<std::uint32_t> sample(batch);
+    std::vector<std::uint32_t> index(batch);
+    std::vector<std::uint32_t> dist(batch);
+    center_soa centers;
+    centers.resize(k);
+    centers.set_colour_channels(unique_colours.channels);
+
+    for (int iteration = 0; iteration < options.max_iterations; iteration++) {
+        for (ul t = 0; t < batch; t++) {
+            ul i = std::upper_bound(cumulative.begin(), cumulative.end(), pick(rng)) - cumulative.begin();
+            sample[t] = unique_colours.colours[i];
+        }
+        // assign the whole batch to the centers as they were at the start of the iteration
+        for (ul j = 0; j < k; j++) {
+            centers.set(j, std::lround(center[j * 4]), std::lround(center[j * 4 + 1]), std::lround(center[j * 4 + 2]), std::lround(center[j * 4 + 3]));
+        }
+        nearest_centers(centers, sample.data(), batch, index.data(), dist.data());
+        for (ul t = 0; t < batch; t++) {
+            ul j = index[t];
+            double eta = 1.0 / ++seen[j];
+            for (int c = 0; c < 4; c++) {
+                center[j * 4 + c] += eta * (colour_channel(sample[t], c) - center[j * 4 + c]);
+            }
+        }
+    }
+    for (ul j = 0; j < k; j++) {
+        cluster_centers[j] = {std::lround(center[j * 4]), std::lround(center[j * 4 + 1]), std::lround(center[j * 4 + 2]), std::lround(center[j * 4 + 3])};
+    }
+}
+
+// Find the nearest palette entry of every colour of a histogram into assignment, one block of
+// colours per thread; centers and min_dist are scratch buffers
+void assign_into(thread_pool &tp, const colour_histogram &unique_colours, const std::vector<std::uint32_t> &palette, center_soa &centers,
+                 std::vector<std::uint32_t> &min_dist, std::vector<std::uint32_t> &assignment) {
+    centers.resize(palette.size());
+    centers.set_colour_channels(unique_colours.channels);
+    for (ul j = 0; j < palette.size(); j++) {
+        centers.set(j, colour_channel(palette[j], 0), colour_channel(palette[j], 1), colour_channel(palette[j], 2), colour_channel(palette[j], 3));
+    }
+    assignment.resize(unique_colours.size());
+    min_dist.resize(unique_colours.size());
+    ul workers = std::max<ul>(1, std::min<ul>(tp.size(), unique_colours.size()));
+    tp.parallel_for(0, workers, 1, [&](ul w_first, ul w_last) {
+        for (ul w = w_first; w < w_last; w++) {
+            ul first = unique_colours.size() * w / workers;
+            ul last = unique_colours.size() * (w + 1) / workers;
+            nearest_centers(centers, &unique_colours.colours[first], last - first, &assignment[first], &min_dist[first]);
+        }
+    });
+}
+
+// Reads the tiles of a source in turn, reading tile t + 1 on the pool while the caller works on
+// tile t, so that only two tiles are held in memory
+class tile_reader {
+   public:
+    tile_reader(thread_pool &tp, tile_source &source, int tile_size)
+        : tp_(tp), source_(source), tiles_(make_tiles(source.rows(), source.cols(), tile_size, tile_size)) {
+        std::size_t tile_pixels = std::size_t(std::min(tile_size, source.rows())) * std::min(tile_size, source.cols());
+        buffers_[0].resize(tile_pixels * 4);
+        buffers_[1].resize(tile_pixels * 4);
+    }
+
+    // number of tiles of the source
+    std::size_t size() const { return tiles_.size(); }
+
+    // call fn(tile, data) on every tile in turn; read errors and exceptions from fn are passed on
+    template <class F>
+    void for_each_tile(F &&fn) {
+        if (tiles_.empty()) {
+            return;
+        }
+        std::future<void> next = tp_.submit([this]() { source_.read(tiles_[0], buffers_[0].data()); });
+        for (std::size_t t = 0; t < tiles_.size(); t++) {
+            next.get(); // passes on read errors
+            if (t + 1 < tiles_.size()) {
+                next = tp_.submit([this, t]() { source_.read(tiles_[t + 1], buffers_[(t + 1) % 2].data()); });
+            }
+            try {
+                fn(tiles_[t], buffers_[t % 2].data());
+            } catch (...) {
+                if (next.valid()) {
+                    next.wait(); // the read still references the buffers
+                }
+                throw;
+            }
+        }
+    }
+
+   private:
+    thread_pool &tp_;
+    tile_source &source_;
+    std::vector<tile_rect> tiles_;
+    std::vector<std::uint8_t> buffers_[2];
+};
+
+// Returns the number of channels of img, after checking that it is an 8-bit image with 1, 3 or 4
+// channels
+int image_channels(const const_image_view &img) {
+    int channels = img.channels;
+    if (img.bits != 8 || (channels != 1 && channels != 3 && channels != 4)) {
+        throw std::invalid_argument("unsupported image with " + std::to_string(channels) + " channels of " + std::to_string(img.bits) +
+                                    " bits: expected 8 bits with 1, 3 or 4 channels");
+    }
+    return channels;
+}
+
+// As above, also checking that out has the size and type of img
+int image_channels(const const_image_view &img, const image_view &out) {
+    int channels = image_channels(img);
+    if (out.bits != img.bits || out.channels != channels || out.rows != img.rows || out.cols != img.cols) {
+        throw std::invalid_argument("the output image does not have the size and type of the input image");
+    }
+    return channels;
+}
+
+// Checks that img is a 16-bit single-channel image and out a single-channel image of its size with
+// 16 bits, or with 8 bits and k <= 256. Returns true if out has 8 bits, and so receives indices.
+bool sample_indices(const const_image_view &img, const image_view &out, std::size_t k) {
+    if (img.channels != 1) {
+        throw std::invalid_argument("unsupported image with " + std::to_string(img.channels) + " channels of 16 bits: 16-bit images must have a single channel");
+    }
+    if (out.rows != img.rows || out.cols != img.cols || out.channels != 1 || (out.bits != 16 && out.bits != 8)) {
+        throw std::invalid_argument("the output of a 16-bit image must have its size and a single channel of 16 or 8 bits");
+    }
+    if (out.bits == 8 && k > 256) {
+        throw std::invalid_argument("an 8-bit index image holds at most 256 palette entries");
+    }
+    return out.bits == 8;
+}
+
+// Checks that indices is an 8-bit single-channel image of the size of img, able to hold the indices
+// of a palette of k colours, and that img has a supported type
+void check_indices(const const_image_view &img, const image_view &indices, std::size_t k) {
+    if (indices.rows != img.rows || indices.cols != img.cols || indices.channels != 1 || indices.bits != 8) {
+        throw std::invalid_argument("the index image must have the size of the input image and a single channel of 8 bits");
+    }
+    if (k > 256) {
+        throw std::invalid_argument("an 8-bit index image holds at most 256 palette entries");
+    }
+    if (img.bits == 8) {
+        image_channels(img);
+    }
+}
+
+// Store in index[v], for every sample value v, the index of the nearest of centers (sample values),
+// ties going to the lowest index. The centers are sorted and swept along with v, so this takes
+// O(65536 + k log k) however large k is.
+void nearest_sample_centers(const std::vector<std::uint32_t> &centers, std::vector<std::uint32_t> &index) {
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> sorted; // (value, index), lowest index first among equal values
+    for (ul j = 0; j < centers.size(); j++) {
+        sorted.emplace_back(centers[j], j);
+    }
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) { return a.first == b.first; }), sorted.end());
+    index.resize(sample_histogram::values);
+    ul p = 0; // the last center not above v, or the first center
+    for (std::uint32_t v = 0; v < sample_histogram::values; v++) {
+        while (p + 1 < sorted.size() && sorted[p + 1].first <= v) {
+            p++;
+        }
+        std::uint32_t best = sorted[p].second;
+        if (sorted[p].first <= v && p + 1 < sorted.size()) {
+            std::uint32_t below = v - sorted[p].first;
+            std::uint32_t above = sorted[p + 1].first - v;
+            if (above < below || (above == below && sorted[p + 1].second < best)) {
+                best = sorted[p + 1].second;
+            }
+        }
+        index[v] = best;
+    }
+}
+
+// Weighted k-means++ over the sample values of hist, as seed_kmeans_pp does for colours
+std::vector<std::uint32_t> seed_samples(const sample_histogram &hist, ul k, std::uint64_t seed) {
+    std::vector<std::uint32_t> values;
+    std::vector<std::uint64_t> weights;
+    std::uint64_t pixels = 0;
+    for (ul v = 0; v < sample_histogram::values; v++) {
+        if (hist.count(v) != 0) {
+            values.push_back(v);
+            weights.push_back(hist.count(v));
+            pixels += hist.count(v);
+        }
+    }
+    std::mt19937_64 rng(seed);
+    std::uint64_t r = std::uniform_int_distribution<std::uint64_t>(0, pixels - 1)(rng);
+    ul i = 0;
+    while (r >= weights[i]) {
+        r -= weights[i++];
+    }
+    std::vector<std::uint32_t> centers = {values[i]};
+    std::vector<double> dist(values.size(), std::numeric_limits<double>::infinity()); // squared distance to the nearest center
+    while (centers.size() < k) {
+        double total = 0;
+        for (ul t = 0; t < values.size(); t++) {
+            double d = double(values[t]) - centers.back();
+            dist[t] = std::min(dist[t], d * d);
+            total += dist[t] * weights[t];
+        }
+        if (total == 0) {
+            break;
+        }
+        double x = std::uniform_real_distribution<double>(0, total)(rng);
+        i = 0;
+        while (i + 1 < values.size() && (dist[i] == 0 || x >= dist[i] * weights[i])) {
+            x -= dist[i] * weights[i];
+            i++;
+        }
+        centers.push_back(values[i]);
+    }
+    return centers;
+}
+
+// k-means on the sample values of a 16-bit histogram, into result: cluster_colours for 16-bit images.
+// The palette holds the centers, and the assignment is indexed by sample value. Every iteration
+// sweeps the 65536 values once, which takes less than handing the work to the pool would.
+void cluster_samples(const sample_histogram &hist, int k, const quantize_options &options, clustering &result) {
+    quantize_observer *observer = options.observer;
+    std::chrono::steady_clock::time_point phase_start;
+    std::chrono::steady_clock::time_point iteration_start;
+    if (observer) {
+        phase_start = std::chrono::steady_clock::now();
+    }
+
+    std::vector<std::uint32_t> centers;
+    if (!options.initial_palette.empty()) {
+        if (options.initial_palette.size() != (ul) k) {
+            throw std::invalid_argument("The initial palette has " + std::to_string(options.initial_palette.size()) + " colours, but k is " + std::to_string(k) + ".");
+        }
+        for (std::uint32_t c : options.initial_palette) {
+            if (c >= sample_histogram::values) {
+                throw std::invalid_argument("The initial palette holds colours, not 16-bit sample values.");
+            }
+        }
+        centers = options.initial_palette;
+    } else {
+        centers = seed_samples(hist, k, options.seed);
+    }
+
+    if (observer) {
+        observer->seeded(centers);
+        observer->phase_done(quantize_phase::seeding, ms_since(phase_start));
+        phase_start = std::chrono::steady_clock::now();
+    }
+
+    std::vector<std::uint32_t> &index = result.assignment;
+    std::vector<std::uint64_t> sums(centers.size());
+    std::vector<std::uint64_t> counts(centers.size());
+    std::vector<std::uint32_t> prev_centers;
+    // a squared 16-bit distance takes 32 bits, so the total over 2^32 pixels would wrap in 64
+    unsigned __int128 prev_dist = 0;
+    int iterations = 0;
+    for (int iteration = 0; iteration < options.max_iterations; iteration++) {
+        if (observer) {
+            iteration_start = std::chrono::steady_clock::now();
+        }
+        nearest_sample_centers(centers, index);
+        prev_centers = centers;
+        iterations++;
+        std::fill(sums.begin(), sums.end(), 0);
+        std::fill(counts.begin(), counts.end(), 0);
+        unsigned __int128 iter_dist = 0;
+        for (ul v = 0; v < sample_histogram::values; v++) {
+            std::uint64_t n = hist.count(v);
+            if (n == 0) {
+                continue;
+            }
+            ul j = index[v];
+            sums[j] += v * n;
+            counts[j] += n;
+            std::uint64_t d = v > centers[j] ? v - centers[j] : centers[j] - v;
+            iter_dist += (unsigned __int128) (d * d) * n;
+        }
+        // move every center to the (rounded up) mean of its members; empty clusters keep their center
+        std::uint32_t max_shift = 0;
+        for (ul j = 0; j < centers.size(); j++) {
+            if (counts[j] != 0) {
+                centers[j] = (sums[j] + counts[j] - 1) / counts[j];
+            }
+            max_shift = std::max(max_shift, centers[j] > prev_centers[j] ? centers[j] - prev_centers[j] : prev_centers[j] - centers[j]);
+        }
+
+        if (observer) {
+            // reported saturated at the largest uint64_t
+            observer->iteration_done(iteration, std::uint64_t(std::min<unsigned __int128>(iter_dist, UINT64_MAX)), ms_since(iteration_start));
+        }
+
+        // stop once the centers are fixed or the distortion no longer improves by a relative 1e-6
+        if (centers == prev_centers || (iteration > 0 && (long double) prev_dist - (long double) iter_dist <= 1e-6L * (long double) prev_dist)) {
+            break;
+        }
+        if (options.center_tolerance > 0 && max_shift <= options.center_tolerance) {
+            break;
+        }
+        prev_dist = iter_dist;
+    }
+
+    nearest_sample_centers(centers, index);
+    result.palette = centers;
+    result.iterations = iterations;
+    if (observer) {
+        observer->phase_done(quantize_phase::kmeans, ms_since(phase_start));
+    }
+}
+
+// Write, for every pixel of a 16-bit image, its palette index (into an 8-bit out) or the value of its
+// palette entry (into a 16-bit out), given the palette index of every sample value
+void remap_samples(thread_pool &tp, const std::vector<std::uint32_t> &index, const std::vector<std::uint32_t> &palette,
+                   const const_image_view &img, const image_view &out) {
+    ul rows_per_task = std::max<ul>(1, (1 << 16) / std::max(1, img.cols));
+    tp.parallel_for(0, img.rows, rows_per_task, [&](ul first, ul last) {
+        for_each_span(img, out, first, last, [&](const std::uint8_t *p, std::uint8_t *q, ul n) {
+            const std::uint16_t *in = reinterpret_cast<const std::uint16_t *>(p);
+            if (out.bits == 8) {
+                for (ul i = 0; i < n; i++) {
+                    q[i] = index[in[i]];
+                }
+            } else {
+                std::uint16_t *o = reinterpret_cast<std::uint16_t *>(q);
+                for (ul i = 0; i < n; i++) {
+                    o[i] = palette[index[in[i]]];
+                }
+            }
+        });
+    });
+}
+
+}  // namespace
+
+struct cluster_workspace {
+    std::vector<Pixel> cluster_centers; // k cluster centers pertaining to 'chans' colour channels, addressed by index
+    std::vector<Pixel> prev_centers;
+    center_soa centers; // the same centers, one array per channel, for the nearest-center kernel
+    std::vector<cluster_sums> partials; // one per worker
+    hamerly_bounds state; // only used by the Hamerly engine
+    center_bounds bounds;
+    std::vector<std::uint32_t> min_dist; // scratch for the final assignment
+};
+
+namespace {
+
+// cluster_colours, into result, with the buffers of ws
+void cluster_into(thread_pool &tp, const colour_histogram &unique_colours, int k, const quantize_options &options, cluster_workspace &ws, clustering &result) {
+    std::vector<Pixel> &cluster_centers = ws.cluster_centers;
+    center_soa &centers = ws.centers;
+    centers.set_colour_channels(unique_colours.channels);
+    quantize_observer *observer = options.observer;
+    std::chrono::steady_clock::time_point phase_start;
+    std::chrono::steady_clock::time_point iteration_start;
+    if (observer) {
+        phase_start = std::chrono::steady_clock::now();
+    }
+
+    init_cluster_centers(tp, unique_colours, cluster_centers, k, options);
+
+    if (observer) {
+        std::vector<std::uint32_t> seeds;
+        for (const Pixel &c : cluster_centers) {
+            seeds.push_back(pack_colour(get<0>(c), get<1>(c), get<2>(c), get<3>(c)));
+        }
+        observer->seeded(seeds);
+        observer->phase_done(quantize_phase::seeding, ms_since(phase_start));
+        phase_start = std::chrono::steady_clock::now();
+    }
+
+    // at this point we have n unique colours and k initialized cluster centers.
+    // the unique colours are split into one fixed block per thread, so the reduction (and
+    // therefore the distortion) does not depend on how the tasks get scheduled
+    ul workers = std::max<ul>(1, std::min<ul>(tp.size(), unique_colours.size()));
+    std::vector<cluster_sums> &partials = ws.partials;
+    partials.resize(workers);
+    std::uint64_t prev_dist = 0;
+    std::uint64_t iter_dist = 0;
+    std::vector<Pixel> &prev_centers = ws.prev_centers;
+    hamerly_bounds &state = ws.state; // only used by the Hamerly engine
+    center_bounds &bounds = ws.bounds;
+    if (options.engine == kmeans_engine::hamerly) {
+        state.reset(unique_colours.size());
+    }
+
+    int iterations = 0;
+    if (options.engine == kmeans_engine::minibatch) {
+        minibatch_cluster_centers(unique_colours, cluster_centers, options);
+        iterations = std::max(0, options.max_iterations);
+    }
+
+    for (int iteration = 0; options.engine != kmeans_engine::minibatch && iteration < options.max_iterations; iteration++) { // continue iterating until acceptable
+        load_centers(cluster_centers, centers);
+        if (options.engine == kmeans_engine::hamerly) {
+            compute_center_bounds(cluster_centers, iteration > 0 ? &prev_centers : nullptr, bounds);
+        }
+        prev_centers = cluster_centers;
+        iterations++;
+        if (observer) {
+            iteration_start = std::chrono::steady_clock::now();
+        }
+        tp.parallel_for(0, workers, 1, [&](ul w_first, ul w_last) {
+            for (ul w = w_first; w < w_last; w++) {
+                partials[w].reset(cluster_centers.size());
+                ul first = unique_colours.size() * w / workers;
+                ul last = unique_colours.size() * (w + 1) / workers;
+                if (options.engine == kmeans_engine::hamerly) {
+                    compute_clusters_hamerly(unique_colours, first, last, cluster_centers, centers, bounds, state, partials[w]);
+                } else {
+                    compute_clusters(unique_colours, first, last, centers, partials[w]);
+                }
+            }
+        });
+        // parallel_for returns once every block has been computed
+
+        // now compute next iteration of cluster centers
+        iter_dist = update_cluster_centers(partials, cluster_centers);
+
+        if (observer) {
+            observer->iteration_done(iteration, iter_dist, ms_since(iteration_start));
+        }
+
+        // stop once the centers are fixed or the distortion no longer improves by a relative 1e-6
+        if (cluster_centers == prev_centers || (iteration > 0 && (double) prev_dist - (double) iter_dist <= 1e-6 * (double) prev_dist)) {
+            break;
+        }
+        if (options.center_tolerance > 0) {
+            long max_shift = 0;
+            for (ul j = 0; j < cluster_centers.size(); j++) {
+                max_shift = std::max(max_shift, squared_distance(cluster_centers[j], prev_centers[j]));
+            }
+            if (std::sqrt((double) max_shift) <= options.center_tolerance) {
+                break;
+            }
+        }
+        prev_dist = iter_dist;
+    }
+
+    result.iterations = iterations;
+    result.palette.clear();
+    for (const Pixel &c : cluster_centers) {
+        result.palette.push_back(pack_colour(get<0>(c), get<1>(c), get<2>(c), get<3>(c)));
+    }
+    // after while loop is over, do one last (full) computation to find which cluster each unique colour belongs to
+    assign_into(tp, unique_colours, result.palette, centers, ws.min_dist, result.assignment);
+
+    if (observer) {
+        observer->phase_done(quantize_phase::kmeans, ms_since(phase_start));
+    }
+}
+
+}  // namespace
+
+void init_cluster_centers(thread_pool &tp, const colour_histogram &unique_colours, std::vector<Pixel> &cluster_centers, int k, const quantize_options &options) {
+    if (!options.initial_palette.empty()) {
+        if (options.initial_palette.size() != (ul) k) {
+            throw std::invalid_argument("The initial palette has " + std::to_string(options.initial_palette.size()) + " colours, but k is " + std::to_string(k) + ".");
+        }
+        cluster_centers.clear();
+        for (std::uint32_t c : options.initial_palette) {
+            cluster_centers.push_back(to_pixel(c));
+        }
+        return;
+    }
+    seeding_method seeding = options.seeding;
+    if (seeding == seeding_method::automatic) {
+        // k-means++ makes k passes over the histogram, k-means|| about 8 whatever the value of k
+        seeding = (unique_colours.size() >= 65536 && k >= 16) ? seeding_method::kmeans_parallel : seeding_method::kmeans_pp;
+    }
+    std::vector<std::uint32_t> seeds;
+    if (seeding == seeding_method::kmeans_parallel) {
+        seeds = seed_kmeans_parallel(tp, unique_colours, k, options.seed);
+    } else {
+        seeds = seed_kmeans_pp(tp, unique_colours, k, options.seed);
+    }
+    cluster_centers.clear();
+    for (std::uint32_t c : seeds) {
+        cluster_centers.push_back(to_pixel(c));
+    }
+}
+
+std::vector<std::uint32_t> assign_palette(thread_pool &tp, const colour_histogram &unique_colours, const std::vector<std::uint32_t> &palette) {
+    center_soa centers;
+    std::vector<std::uint32_t> min_dist;
+    std::vector<std::uint32_t> index;
+    assign_into(tp, unique_colours, palette, centers, min_dist, index);
+    return index;
+}
+
+clustering cluster_colours(thread_pool &tp, const colour_histogram &unique_colours, int k, const quantize_options &options) {
+    cluster_workspace ws;
+    clustering result;
+    cluster_into(tp, unique_colours, k, options, ws, result);
+    return result;
+}
+
+quantizer::quantizer(const quantize_options &options)
+    : own_pool_(std::make_unique<thread_pool>()), tp_(*own_pool_), options_(options), builder_(tp_), workspace_(std::make_unique<cluster_workspace>()) {}
+
+quantizer::quantizer(std::size_t num_threads, const quantize_options &options)
+    : own_pool_(std::make_unique<thread_pool>(num_threads)), tp_(*own_pool_), options_(options), builder_(tp_), workspace_(std::make_unique<cluster_workspace>()) {}
+
+quantizer::quantizer(const pool_options &pool, const quantize_options &options)
+    : own_pool_(std::make_unique<thread_pool>(pool)), tp_(*own_pool_), options_(options), builder_(tp_), workspace_(std::make_unique<cluster_workspace>()) {}
+
+quantizer::quantizer(thread_pool &tp, const quantize_options &options)
+    : tp_(tp), options_(options), builder_(tp_), workspace_(std::make_unique<cluster_workspace>()) {}
+
+quantizer::~quantizer() = default;
+
+const std::vector<std::uint32_t> &quantizer::quantize(Mat img, Mat out, int k) {
+    return quantize(view_of(img), view_of(out), k);
+}
+
+const std::vector<std::uint32_t> &quantizer::quantize(const const_image_view &img, const image_view &out, int k) {
+    if (img.bits == 16) {
+        return quantize_samples(img, out, k);
+    }
+    image_channels(img, out);
+    return quantize_pixels(img, out, k, false);
+}
+
+void quantizer::apply(Mat img, Mat out, const std::vector<std::uint32_t> &palette) {
+    apply(view_of(img), view_of(out), palette);
+}
+
+void quantizer::apply(const const_image_view &img, const image_view &out, const std::vector<std::uint32_t> &palette) {
+    if (img.bits == 16) {
+        apply_samples(img, out, palette);
+        return;
+    }
+    image_channels(img, out);
+    apply_pixels(img, out, palette, false);
+}
+
+const std::vector<std::uint32_t> &quantizer::quantize_indexed(Mat img, Mat indices, int k) {
+    return quantize_indexed(view_of(img), view_of(indices), k);
+}
+
+const std::vector<std::uint32_t> &quantizer::quantize_indexed(const const_image_view &img, const image_view &indices, int k) {
+    check_indices(img, indices, k);
+    if (img.bits == 16) {
+        return quantize_samples(img, indices, k);
+    }
+    return quantize_pixels(img, indices, k, true);
+}
+
+void quantizer::apply_indexed(Mat img, Mat indices, const std::vector<std::uint32_t> &palette) {
+    apply_indexed(view_of(img), view_of(indices), palette);
+}
+
+void quantizer::apply_indexed(const const_image_view &img, const image_view &indices, const std::vector<std::uint32_t> &palette) {
+    check_indices(img, indices, palette.size());
+    if (img.bits == 16) {
+        apply_samples(img, indices, palette);
+        return;
+    }
+    apply_pixels(img, indices, palette, true);
+}
+
+const std::vector<std::uint32_t> &quantizer::quantize_pixels(const const_image_view &img, const image_view &out, int k, bool indexed) {
+    observed_run run(tp_, options_.observer, img.rows, img.cols);
+
+    // alpha: 0 is transparent, 255 is opaque
+    builder_.add(img);
+    builder_.finish(unique_colours_); // store every unique colour in image, plus number of pixel members
+    run.phase_done(quantize_phase::histogram);
+    run.histogram_built(unique_colours_.size());
+
+    if((ul) k > unique_colours_.size()) {
+        throw std::invalid_argument("K value exceeds number of unique colours in image! Please choose a smaller k.");
+    }
+
+    cluster_into(tp_, unique_colours_, k, options_, *workspace_, result_);
+    run.restart(); // cluster_colours reports its own phases
+
+    // write clusters to output: each pixel's colour maps straight to a palette index
+    table_.build(tp_, unique_colours_, result_.assignment.data());
+    if (indexed) {
+        remap_indices(tp_, table_, img, out);
+    } else {
+        remap_image(tp_, table_, result_.palette, img, out);
+    }
+    run.phase_done(quantize_phase::remap);
+    run.finished(result_.palette, result_.iterations);
+    return result_.palette;
+}
+
+void quantizer::apply_pixels(const const_image_view &img, const image_view &out, const std::vector<std::uint32_t> &palette, bool indexed) {
+    observed_run run(tp_, options_.observer, img.rows, img.cols);
+    builder_.add(img);
+    builder_.finish(unique_colours_);
+    run.phase_done(quantize_phase::histogram);
+    run.histogram_built(unique_colours_.size());
+    assign_into(tp_, unique_colours_, palette, workspace_->centers, workspace_->min_dist, result_.assignment);
+    table_.build(tp_, unique_colours_, result_.assignment.data());
+    if (indexed) {
+        remap_indices(tp_, table_, img, out);
+    } else {
+        remap_image(tp_, table_, palette, img, out);
+    }
+    run.phase_done(quantize_phase::remap);
+    run.finished(palette, 0);
+}
+
+const std::vector<std::uint32_t> &quantizer::quantize_samples(const const_image_view &img, const image_view &out, int k) {
+    sample_indices(img, out, k);
+    observed_run run(tp_, options_.observer, img.rows, img.cols);
+    samples_.build(tp_, img);
+    run.phase_done(quantize_phase::histogram);
+    run.histogram_built(samples_.unique());
+
+    if((ul) k > samples_.unique()) {
+        throw std::invalid_argument("K value exceeds number of unique colours in image! Please choose a smaller k.");
+    }
+
+    cluster_samples(samples_, k, options_, result_);
+    run.restart(); // cluster_samples reports its own phases
+    remap_samples(tp_, result_.assignment, result_.palette, img, out);
+    run.phase_done(quantize_phase::remap);
+    run.finished(result_.palette, result_.iterations, true);
+    return result_.palette;
+}
+
+void quantizer::apply_samples(const const_image_view &img, const image_view &out, const std::vector<std::uint32_t> &palette) {
+    sample_indices(img, out, palette.size());
+    for (std::uint32_t c : palette) {
+        if (c >= sample_histogram::values) {
+            throw std::invalid_argument("The palette holds colours, not 16-bit sample values.");
+        }
+    }
+    // every sample value is mapped, so no histogram is needed
+    observed_run run(tp_, options_.observer, img.rows, img.cols);
+    nearest_sample_centers(palette, result_.assignment);
+    remap_samples(tp_, result_.assignment, palette, img, out);
+    run.phase_done(quantize_phase::remap);
+    run.finished(palette, 0, true);
+}
+
+std::vector<std::uint32_t> quantize_image(thread_pool &tp, Mat img, Mat out, int k, const quantize_options &options) {
+    return quantizer(tp, options).quantize(img, out, k);
+}
+
+std::vector<std::uint32_t> quantize_image(Mat img, Mat out, int k, const quantize_options &options) {
+    thread_pool tp;
+    return quantize_image(tp, img, out, k, options);
+}
+
+void apply_palette(thread_pool &tp, Mat img, Mat out, const std::vector<std::uint32_t> &palette, quantize_observer *observer) {
+    quantize_options options;
+    options.observer = observer;
+    quantizer(tp, options).apply(img, out, palette);
+}
+
+sequence_quantizer::sequence_quantizer(thread_pool &tp, int k, const quantize_options &options)
+    : tp_(tp), k_(k), options_(options), workspace_(std::make_unique<cluster_workspace>()) {}
+
+sequence_quantizer::~sequence_quantizer() = default;
+
+const std::vector<std::uint32_t> &sequence_quantizer::next(Mat frame, Mat out) {
+    return next(view_of(frame), view_of(out));
+}
+
+const std::vector<std::uint32_t> &sequence_quantizer::next(const const_image_view &frame, const image_view &out) {
+    int channels = image_channels(frame, out);
+    observed_run run(tp_, options_.observer, frame.rows, frame.cols);
+    if (palette_.empty() || frame.rows != rows_ || frame.cols != cols_ || channels != channels_) {
+        unique_colours_ = build_histogram(tp_, frame);
+        if ((ul) k_ > unique_colours_.size()) {
+            throw std::invalid_argument("K value exceeds number of unique colours in image! Please choose a smaller k.");
+        }
+        rows_ = frame.rows;
+        cols_ = frame.cols;
+        channels_ = channels;
+        changed_ = 0;
+        palette_.clear(); // a new scene is seeded, not warm-started from the last one
+    } else {
+        unique_colours_ = update_histogram(tp_, unique_colours_, const_image_view(prev_.get(), rows_, cols_, channels), frame, &changed_);
+    }
+    run.phase_done(quantize_phase::histogram);
+    run.histogram_built(unique_colours_.size());
+    quantize_options options = options_;
+    if (!palette_.empty()) {
+        options.initial_palette = palette_;
+    }
+    cluster_into(tp_, unique_colours_, k_, options, *workspace_, result_);
+    run.restart(); // cluster_colours reports its own phases
+    table_.build(tp_, unique_colours_, result_.assignment.data());
+    // keep the frame, without its row padding, since out may be the frame itself; the copy is left
+    // uninitialised and made in the row blocks update_histogram reads, so that each page is first
+    // touched (and placed) by the threads that compare it with the next frame
+    std::size_t size = std::size_t(rows_) * frame.row_bytes();
+    if (size != prev_size_) {
+        prev_.reset(new std::uint8_t[size]);
+        prev_size_ = size;
+    }
+    image_view prev(prev_.get(), rows_, cols_, channels);
+    ul workers = std::max<ul>(1, std::min<ul>(tp_.size(), rows_));
+    tp_.parallel_for(0, workers, 1, [&](ul w_first, ul w_last) {
+        for (ul w = w_first; w < w_last; w++) {
+            for_each_span(frame, prev, rows_ * w / workers, rows_ * (w + 1) / workers,
+                          [&](const std::uint8_t *p, std::uint8_t *q, std::size_t n) { std::memcpy(q, p, n * channels); });
+        }
+    });
+    remap_image(tp_, table_, result_.palette, frame, out);
+    run.phase_done(quantize_phase::remap);
+    run.finished(result_.palette, result_.iterations);
+    palette_ = result_.palette;
+    return palette_;
+}
+
+void mat_tile_source::read(const tile_rect &rect, std::uint8_t *data) {
+    Mat src = img_(Rect(rect.col, rect.row, rect.cols, rect.rows));
+    Mat dst(rect.rows, rect.cols, CV_8UC4, data);
+    switch (img_.type()) {
+        case CV_8UC1:
+            cvtColor(src, dst, COLOR_GRAY2RGBA);
+            break;
+        case CV_8UC3:
+            cvtColor(src, dst, COLOR_RGB2RGBA);
+            break;
+        case CV_8UC4:
+            src.copyTo(dst);
+            break;
+        case CV_16UC1: { // typical of jp2 satellite files
+            Mat grey;
+            src.convertTo(grey, CV_8U, 1.0 / 128);
+            cvtColor(grey, dst, COLOR_GRAY2RGBA);
+            break;
+        }
+        default:
+            throw std::runtime_error("unsupported image type " + std::to_string(img_.type()));
+    }
+}
+
+std::vector<std::uint32_t> quantize_tiles(thread_pool &tp, tile_source &source, tile_sink &sink, int k, const quantize_options &options, int tile_size) {
+    observed_run run(tp, options.observer, source.rows(), source.cols());
+    tile_reader reader(tp, source, tile_size);
+
+    histogram_builder builder(tp);
+    reader.for_each_tile([&](const tile_rect &rect, std::uint8_t *data) { builder.add(data, rect.rows, rect.cols); });
+    colour_histogram unique_colours = builder.finish();
+    run.phase_done(quantize_phase::histogram);
+    run.histogram_built(unique_colours.size());
+
+    if((ul) k > unique_colours.size()) {
+        throw std::invalid_argument("K value exceeds number of unique colours in image! Please choose a smaller k.");
+    }
+
+    clustering result = cluster_colours(tp, unique_colours, k, options);
+    run.restart(); // cluster_colours reports its own phases
+
+    remap_table table(tp, unique_colours, result.assignment.data());
+    reader.for_each_tile([&](const tile_rect &rect, std::uint8_t *data) {
+        remap_image(tp, table, result.palette, data, data, rect.rows, rect.cols);
+        sink.write(rect, data);
+    });
+    run.phase_done(quantize_phase::remap);
+    run.finished(result.palette, result.iterations);
+    return result.palette;
+}
+
+std::vector<std::uint32_t> quantize_tiles(tile_source &source, tile_sink &sink, int k, const quantize_options &options, int tile_size) {
+    thread_pool tp; // create thread pool with max possible num of threads for this hardware
+    return quantize_tiles(tp, source, sink, k, options, tile_size);
+}
+
+void apply_palette_tiles(thread_pool &tp, tile_source &source, tile_sink &sink, const std::vector<std::uint32_t> &palette, int tile_size,
+                         quantize_observer *observer) {
+    observed_run run(tp, observer, source.rows(), source.cols());
+    tile_reader reader(tp, source, tile_size);
+    // the histogram, assignment and table of every tile are rebuilt in the buffers of the last one
+    histogram_builder builder(tp);
+    colour_histogram unique_colours;
+    center_soa centers;
+    std::vector<std::uint32_t> min_dist;
+    std::vector<std::uint32_t> assignment;
+    remap_table table;
+    reader.for_each_tile([&](const tile_rect &rect, std::uint8_t *data) {
+        builder.add(data, rect.rows, rect.cols);
+        builder.finish(unique_colours);
+        assign_into(tp, unique_colours, palette, centers, min_dist, assignment);
+        table.build(tp, unique_colours, assignment.data());
+        remap_image(tp, table, palette, data, data, rect.rows, rect.cols);
+        sink.write(rect, data);
+    });
+    run.phase_done(quantize_phase::remap);
+    run.finished(palette, 0);
+}
+
+void apply_palette_tiles(tile_source &source, tile_sink &sink, const std::vector<std::uint32_t> &palette, int tile_size, quantize_observer *observer) {
+    thread_pool tp; // create thread pool with max possible num of threads for this hardware
+    apply_palette_tiles(tp, source, sink, palette, tile_size, observer);
+}
+
+}  // namespace ra::quantization
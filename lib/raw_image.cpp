@@ -0,0 +1,166 @@
+#include "../include/ra/raw_image.hpp"
+
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace ra::quantization {
+
+namespace {
+
+// 16-bit samples are mapped as they are, so the file byte order must be the host's
+static_assert(std::endian::native == std::endian::little);
+
+constexpr std::size_t header_size = 32;
+
+std::uint32_t get_u32(const std::uint8_t *p) {
+    return std::uint32_t(p[0]) | (std::uint32_t(p[1]) << 8) | (std::uint32_t(p[2]) << 16) | (std::uint32_t(p[3]) << 24);
+}
+
+void put_u32(std::uint8_t *p, std::uint32_t x) {
+    p[0] = x & 0xff;
+    p[1] = (x >> 8) & 0xff;
+    p[2] = (x >> 16) & 0xff;
+    p[3] = x >> 24;
+}
+
+// Returns the offset of the pixels of a file with n palette entries.
+std::size_t pixel_offset(std::size_t n) { return (header_size + 4 * n + 63) / 64 * 64; }
+
+bool supported_shape(int channels, int bits) { return (channels == 1 || channels == 3 || channels == 4) && (bits == 8 || bits == 16); }
+
+[[noreturn]] void fail(const std::string &what, const std::string &path) {
+    throw std::runtime_error(what + " " + path + ": " + std::strerror(errno));
+}
+
+}  // namespace
+
+bool is_raw_image(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[4] = {};
+    in.read(magic, 4);
+    return in && std::memcmp(magic, "RAIM", 4) == 0;
+}
+
+namespace detail {
+
+mapped_file::mapped_file(const std::string &path, std::size_t size, bool writable) {
+    int fd = writable ? ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        fail(writable ? "cannot create" : "cannot open", path);
+    }
+    if (writable && ::ftruncate(fd, off_t(size)) != 0) {
+        ::close(fd);
+        fail("cannot resize", path);
+    }
+    if (!writable) {
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            fail("cannot stat", path);
+        }
+        size = std::size_t(st.st_size);
+    }
+    if (size != 0) {
+        void *p = ::mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            ::close(fd);
+            fail("cannot map", path);
+        }
+        data_ = static_cast<std::uint8_t *>(p);
+        size_ = size;
+    }
+    ::close(fd); // the mapping keeps the file open
+}
+
+mapped_file::mapped_file(mapped_file &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {}
+
+mapped_file &mapped_file::operator=(mapped_file &&other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    return *this;
+}
+
+mapped_file::~mapped_file() {
+    if (data_ != nullptr) {
+        ::munmap(data_, size_);
+    }
+}
+
+}  // namespace detail
+
+mapped_raw_image::mapped_raw_image(const std::string &path) : file_(path, 0, false) {
+    const std::uint8_t *p = file_.data();
+    if (file_.size() < header_size || std::memcmp(p, "RAIM", 4) != 0) {
+        throw std::runtime_error(path + " is not a raw image file");
+    }
+    std::uint32_t version = get_u32(p + 4);
+    if (version != raw_image_version) {
+        throw std::runtime_error(path + " has unsupported raw image version " + std::to_string(version));
+    }
+    std::uint32_t rows = get_u32(p + 8);
+    std::uint32_t cols = get_u32(p + 12);
+    channels_ = get_u32(p + 16);
+    bits_ = get_u32(p + 20);
+    std::size_t entries = get_u32(p + 24);
+    offset_ = get_u32(p + 28);
+    if (!supported_shape(channels_, bits_) || rows == 0 || cols == 0 || rows > INT32_MAX || cols > INT32_MAX) {
+        throw std::runtime_error(path + " has an unsupported image shape");
+    }
+    rows_ = rows;
+    cols_ = cols;
+    if (offset_ % 64 != 0) { // 16-bit samples are read in place, so they must be aligned
+        throw std::runtime_error(path + " has a misaligned pixel offset");
+    }
+    if (offset_ < header_size + 4 * entries || offset_ > file_.size() ||
+        (file_.size() - offset_) / rows_ / cols_ < std::size_t(channels_) * (bits_ / 8)) {
+        throw std::runtime_error(path + " is truncated");
+    }
+    for (std::size_t i = 0; i < entries; i++) {
+        palette_.push_back(get_u32(p + header_size + 4 * i));
+    }
+    // the pixels are read once for the histogram and once for the remap: start paging them in
+    ::madvise(file_.data(), file_.size(), MADV_WILLNEED);
+}
+
+const_image_view mapped_raw_image::view() const { return const_image_view(file_.data() + offset_, rows_, cols_, channels_, bits_); }
+
+mapped_raw_output::mapped_raw_output(const std::string &path, int rows, int cols, int channels, int bits, std::size_t palette_entries)
+    : rows_(rows), cols_(cols), channels_(channels), bits_(bits), palette_entries_(palette_entries), offset_(pixel_offset(palette_entries)) {
+    if (!supported_shape(channels, bits) || rows < 1 || cols < 1 || palette_entries > UINT32_MAX / 4) {
+        throw std::invalid_argument("unsupported raw image shape");
+    }
+    file_ = detail::mapped_file(path, offset_ + std::size_t(rows) * cols * channels * (bits / 8), true);
+    std::uint8_t *p = file_.data();
+    std::memcpy(p, "RAIM", 4);
+    put_u32(p + 4, raw_image_version);
+    put_u32(p + 8, rows);
+    put_u32(p + 12, cols);
+    put_u32(p + 16, channels);
+    put_u32(p + 20, bits);
+    put_u32(p + 24, std::uint32_t(palette_entries));
+    put_u32(p + 28, std::uint32_t(offset_));
+}
+
+void mapped_raw_output::set_palette(const std::vector<std::uint32_t> &palette) {
+    if (palette.size() != palette_entries_) {
+        throw std::invalid_argument("the raw image has room for " + std::to_string(palette_entries_) + " palette entries, not " +
+                                    std::to_string(palette.size()));
+    }
+    for (std::size_t i = 0; i < palette.size(); i++) {
+        put_u32(file_.data() + header_size + 4 * i, palette[i]);
+    }
+}
+
+image_view mapped_raw_output::view() const { return image_view(file_.data() + offset_, rows_, cols_, channels_, bits_); }
+
+}  // namespace ra::quantization
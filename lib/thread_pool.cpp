@@ -1,8 +1,19 @@
 #include "../include/ra/thread_pool.hpp"
 
+#include <algorithm>
+#include <cctype>
 #include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
 #include <utility>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 using Thread = std::thread;
 using Mutex = std::mutex;
 using Lock = std::unique_lock<std::mutex>;
@@ -12,58 +23,324 @@ using IQ = ra::concurrency::queue<size_type>;  // queue of indices
 using CV = std::condition_variable;
 namespace ra::concurrency {
 
+namespace {
+// The pool the calling thread belongs to (if any) and its index there.
+thread_local const void *current_pool = nullptr;
+thread_local size_type current_index = 0;
+
+// Returns the CPUs the process may run on.
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &set)) {
+                cpus.push_back(c);
+            }
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        unsigned int n = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned int c = 0; c < n; c++) {
+            cpus.push_back(int(c));
+        }
+    }
+    return cpus;
+}
+
+// Pins thread t to cpus, unless empty, and returns false if that
+// fails (as it does where a cpuset forbids those CPUs, or outside
+// Linux). A thread that cannot be pinned runs where the operating
+// system places it.
+bool pin_thread(Thread &t, const std::vector<int> &cpus) {
+    if (cpus.empty()) {
+        return true;
+    }
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int c : cpus) {
+        if (c < CPU_SETSIZE) {
+            CPU_SET(c, &set);
+        }
+    }
+    return pthread_setaffinity_np(t.native_handle(), sizeof(set), &set) == 0;
+#else
+    (void) t;
+    return false;
+#endif
+}
+}  // namespace
+
+std::vector<int> parse_cpu_list(const std::string &text) {
+    std::string s = text;
+    while (!s.empty() && std::isspace(static_cast<unsigned char>(s.back()))) {
+        s.pop_back();
+    }
+    std::vector<int> cpus;
+    if (s.empty()) {
+        return cpus;
+    }
+    std::size_t i = 0;
+    auto number = [&]() {
+        std::size_t start = i;
+        int n = 0;
+        while (i < s.size() && std::isdigit(static_cast<unsigned char>(s[i])) && n <= 65535) {
+            n = 10 * n + (s[i++] - '0');
+        }
+        if (i == start || n > 65535) {
+            throw std::invalid_argument("invalid CPU list: " + text);
+        }
+        return n;
+    };
+    while (true) {
+        int first = number();
+        int last = first;
+        if (i < s.size() && s[i] == '-') {
+            i++;
+            last = number();
+            if (last < first) {
+                throw std::invalid_argument("invalid CPU list: " + text);
+            }
+        }
+        for (int c = first; c <= last; c++) {
+            cpus.push_back(c);
+        }
+        if (i == s.size()) {
+            break;
+        }
+        if (s[i++] != ',') {
+            throw std::invalid_argument("invalid CPU list: " + text);
+        }
+    }
+    std::sort(cpus.begin(), cpus.end());
+    cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+    return cpus;
+}
+
+std::vector<std::vector<int>> numa_cpus() {
+    std::vector<int> allowed = allowed_cpus();
+    std::vector<std::pair<int, std::vector<int>>> nodes;
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it("/sys/devices/system/node", ec), end; !ec && it != end; it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        if (name.size() <= 4 || name.compare(0, 4, "node") != 0 || name.find_first_not_of("0123456789", 4) != std::string::npos) {
+            continue;
+        }
+        std::ifstream in(it->path() / "cpulist");
+        std::string line;
+        std::getline(in, line);
+        std::vector<int> cpus;
+        try {
+            cpus = parse_cpu_list(line);
+        } catch (const std::invalid_argument &) {
+            continue;
+        }
+        // nodes with memory but no CPU, or none the process may use, are left out
+        std::vector<int> usable;
+        std::set_intersection(cpus.begin(), cpus.end(), allowed.begin(), allowed.end(), std::back_inserter(usable));
+        if (!usable.empty()) {
+            nodes.emplace_back(std::stoi(name.substr(4)), std::move(usable));
+        }
+    }
+    std::sort(nodes.begin(), nodes.end());
+    std::vector<std::vector<int>> result;
+    std::size_t found = 0;
+    for (auto &node : nodes) {
+        found += node.second.size();
+        result.push_back(std::move(node.second));
+    }
+    if (found != allowed.size()) {  // no (or partial) NUMA information
+        result = {allowed};
+    }
+    return result;
+}
+
 // An unsigned integral type used to represent sizes.
 
 // Creates a thread pool with the number of threads equal to the
 // hardware concurrency level (if known); otherwise the number of
 // threads is set to 2.
-thread_pool::thread_pool() {
+template <template <class> class Queue>
+basic_thread_pool<Queue>::basic_thread_pool() {
     //std::cout << "THREAD POOL INIT...\n";
     unsigned int n = std::thread::hardware_concurrency();
     if (n == 0) {
         n = 2;
     }
+    start(n, scheduling::work_stealing);
+}
+
+// Creates a thread pool with num_threads threads.
+// Precondition: num_threads > 0
+template <template <class> class Queue>
+basic_thread_pool<Queue>::basic_thread_pool(size_type num_threads) { start(num_threads, scheduling::work_stealing); }
+
+template <template <class> class Queue>
+basic_thread_pool<Queue>::basic_thread_pool(size_type num_threads, scheduling mode) { start(num_threads, mode); }
+
+template <template <class> class Queue>
+basic_thread_pool<Queue>::basic_thread_pool(const pool_options &options) {
+    std::vector<std::vector<int>> nodes = numa_cpus();
+    if (!options.cpus.empty()) {
+        std::vector<int> wanted = options.cpus;
+        std::sort(wanted.begin(), wanted.end());
+        for (int c : wanted) {
+            bool found = std::any_of(nodes.begin(), nodes.end(), [c](const std::vector<int> &node) {
+                return std::binary_search(node.begin(), node.end(), c);
+            });
+            if (!found) {
+                throw std::invalid_argument("CPU " + std::to_string(c) + " is not available to this process");
+            }
+        }
+        for (std::vector<int> &node : nodes) {
+            std::vector<int> kept;
+            std::set_intersection(node.begin(), node.end(), wanted.begin(), wanted.end(), std::back_inserter(kept));
+            node = std::move(kept);
+        }
+        nodes.erase(std::remove_if(nodes.begin(), nodes.end(), [](const std::vector<int> &node) { return node.empty(); }), nodes.end());
+    }
+    // every CPU, node by node, with its node
+    std::vector<std::pair<int, size_type>> cpus;
+    for (size_type g = 0; g < nodes.size(); g++) {
+        for (int c : nodes[g]) {
+            cpus.emplace_back(c, g);
+        }
+    }
+    size_type n = options.threads != 0 ? options.threads : cpus.size();
+    pins_.assign(n, {});
+    std::vector<size_type> node_of(n, 0);
+    switch (options.placement) {
+        case affinity::none:
+            if (!options.cpus.empty()) {
+                for (size_type i = 0; i < n; i++) {
+                    for (const auto &cpu : cpus) {
+                        pins_[i].push_back(cpu.first);
+                    }
+                }
+            }
+            break;
+        case affinity::scatter: {
+            // deal the CPUs out node after node: the first of every node, then the second...
+            std::vector<std::pair<int, size_type>> dealt;
+            for (size_type r = 0; dealt.size() < cpus.size(); r++) {
+                for (size_type g = 0; g < nodes.size(); g++) {
+                    if (r < nodes[g].size()) {
+                        dealt.emplace_back(nodes[g][r], g);
+                    }
+                }
+            }
+            cpus = std::move(dealt);
+            [[fallthrough]];
+        }
+        case affinity::compact:
+            for (size_type i = 0; i < n; i++) {
+                pins_[i] = {cpus[i % cpus.size()].first};
+                node_of[i] = cpus[i % cpus.size()].second;
+            }
+            break;
+        case affinity::numa:
+            for (size_type i = 0; i < n; i++) {
+                // the node of the CPU as far into the list as thread i is into the pool
+                node_of[i] = cpus[i * cpus.size() / n].second;
+                pins_[i] = nodes[node_of[i]];
+            }
+            break;
+    }
+    // number the nodes that have threads, in node order
+    std::vector<size_type> group_of_node(nodes.size(), 0);
+    std::vector<size_type> threads_of_node(nodes.size(), 0);
+    for (size_type i = 0; i < n; i++) {
+        threads_of_node[node_of[i]]++;
+    }
+    group_start_ = {0};
+    for (size_type g = 0; g < nodes.size(); g++) {
+        if (threads_of_node[g] != 0) {
+            group_of_node[g] = group_start_.size() - 1;
+            group_start_.push_back(group_start_.back() + threads_of_node[g]);
+        }
+    }
+    group_.resize(n);
+    for (size_type i = 0; i < n; i++) {
+        group_[i] = group_of_node[node_of[i]];
+    }
+    start(n, scheduling::work_stealing);
+}
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::start(size_type n, scheduling mode) {
+    mode_ = mode;
     size_ = n;
+    if (pins_.empty()) {  // not placed: one group of unpinned threads
+        pins_.resize(n);
+        group_.assign(n, 0);
+        group_start_ = {0, n};
+    }
     threads_ = new Thread[n];
+    if (mode == scheduling::work_stealing) {
+        deques_ = new task_deque[n];
+        for (size_type i = 0; i < n; i++) {
+            threads_[i] = Thread([this](size_type i) { steal_loop(i); }, i);
+        }
+        pin_threads();
+        return;
+    }
     mutexes_ = new Mutex[n];
     cvs_ = new CV[n];
-    idle_ = new IQ(n);
+    idle_ = new index_queue(n);
     /*
     for (size_type i = 0; i < n; i++) {
         idle_->push(std::move(i));
     }*/
     start_threads(n);
+    pin_threads();
 }
 
-// Creates a thread pool with num_threads threads.
-// Precondition: num_threads > 0
-thread_pool::thread_pool(size_type num_threads) {
-    //std::cout << "THREAD POOL INIT...\n";
-    size_ = num_threads;
-    threads_ = new Thread[num_threads];
-    mutexes_ = new Mutex[num_threads];
-    cvs_ = new CV[num_threads];
-    idle_ = new IQ(num_threads);
-    /*
-    for (size_type i = 0; i < num_threads; i++) {
-        idle_->push(std::move(i));
-    }*/
-    start_threads(num_threads);
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::pin_threads() {
+    // pinned from here rather than by the threads themselves, so that a failure is known once the
+    // constructor returns; a thread only waits for tasks before it is pinned
+    for (size_type i = 0; i < size_; i++) {
+        if (!pin_thread(threads_[i], pins_[i])) {
+            unpinned_++;
+        }
+    }
 }
 
 // Destroys a thread pool, shutting down the thread pool first
 // (if not already shutdown).
 
-thread_pool::~thread_pool() {
+template <template <class> class Queue>
+basic_thread_pool<Queue>::~basic_thread_pool() {
     //std::cout << "DESTRUCT...\n";
 
     shutdown();  // call shutdown - ensures all tasks completed before
 
+    if (mode_ == scheduling::work_stealing) {
+        {
+            Lock lk(steal_m_);
+            stop_ = true;
+        }
+        steal_cv_.notify_all();
+        for (size_type i = 0; i < size_; i++) {
+            threads_[i].join();
+        }
+        delete[] threads_;
+        delete[] deques_;
+        return;
+    }
+
     terminate_ = 0;  // cv signal for threads to self terminate
     for (size_type i = 0; i < size_; i++) {
         size_type t;
         idle_->pop(t);  // run all n threads for last time
-        cvs_[t].notify_one();
+        {
+            Lock lk(mutexes_[t]); // only succeeds once the thread is waiting, so the notify is not lost
+            cvs_[t].notify_one();
+        }
         threads_[t].join();  // get rid of threads
     }
     //std::cout << "TERMINATE DONE...\n";
@@ -76,9 +353,35 @@ thread_pool::~thread_pool() {
 }
 
 
-size_type thread_pool::size() const { return size_; }
+template <template <class> class Queue>
+size_type basic_thread_pool<Queue>::size() const { return size_; }
+
+template <template <class> class Queue>
+size_type basic_thread_pool<Queue>::group_count() const { return group_start_.size() - 1; }
+
+template <template <class> class Queue>
+size_type basic_thread_pool<Queue>::group_of(size_type i) const { return group_[i]; }
 
-void thread_pool::schedule(std::function<void()> &&func) {
+template <template <class> class Queue>
+size_type basic_thread_pool<Queue>::unpinned_threads() const { return unpinned_; }
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::schedule(std::function<void()> &&func) { enqueue(std::move(func)); }
+
+template <template <class> class Queue>
+bool basic_thread_pool<Queue>::enqueue(std::function<void()> &&func) {
+    if (stats_users_.load(std::memory_order_relaxed) != 0) {
+        // time the task from here until a thread starts it
+        tasks_scheduled_.fetch_add(1, std::memory_order_relaxed);
+        func = [this, f = std::move(func), queued = std::chrono::steady_clock::now()]() mutable {
+            std::chrono::nanoseconds wait = std::chrono::steady_clock::now() - queued;
+            queue_wait_ns_.fetch_add(wait.count(), std::memory_order_relaxed);
+            f();
+        };
+    }
+    if (mode_ == scheduling::work_stealing) {
+        return schedule_stealing(std::move(func));
+    }
     tpm_.lock();
     if (state_ == 0) { // non-shutdown state
         tpm_.unlock();
@@ -87,14 +390,26 @@ void thread_pool::schedule(std::function<void()> &&func) {
         idle_->pop(i); // thread safe - get index of idle thread
         Lock lk(mutexes_[i]); // guaranteed only locks when thread is waiting
         cvs_[i].notify_one(); // this should be fine to notify waiting thread now
+        return true;
     } else {
         tpm_.unlock();
+        return false;
     }
     //std::cout << "TP SCHEDULE COMPLETED...\n";
 }
 
-void thread_pool::shutdown() {
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::shutdown() {
     //std::cout << "SHUTDOWN: STARTING...\n";
+    if (mode_ == scheduling::work_stealing) {
+        Lock lk(tpm_);
+        if (state_ == 0) {
+            state_ = 1;
+            tpcv_.wait(lk, [this] { return outstanding_ == 0; });
+        }
+        state_ = 2;
+        return;
+    }
     tpm_.lock();
     if (state_ == 0) { // only if shutdown has not been called before
         state_ = 1;  
@@ -125,8 +440,13 @@ void thread_pool::shutdown() {
 }
 
 // returns and unblocks only when the thread pool has no busy threads (all idle).
-void thread_pool::block_until_idle() { 
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::block_until_idle() { 
     Lock lk(tpm_);
+    if (mode_ == scheduling::work_stealing) {
+        tpcv_.wait(lk, [this] { return outstanding_ == 0; });
+        return;
+    }
     tpcv_.wait(lk, [this] {
         // now locked
         return (idle_->is_full() && tasks_.is_empty());
@@ -134,11 +454,269 @@ void thread_pool::block_until_idle() {
 }
 
 
+template <template <class> class Queue>
+typename basic_thread_pool<Queue>::size_type basic_thread_pool<Queue>::chunk_count(size_type n, size_type grain) const {
+    if (n == 0) {
+        return 0;
+    }
+    if (grain == 0) {
+        grain = 1;
+    }
+    size_type max_chunks = 4 * (size_ + 1);  // a few per thread (the caller works too), to even out the load
+    return std::min((n + grain - 1) / grain, max_chunks);
+}
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::work_on(chunk_job &job) {
+    if (!job.shares) {
+        while (true) {
+            size_type c = job.next.fetch_add(1);
+            if (c >= job.chunks) {
+                return;
+            }
+            run_chunk(job, c);
+        }
+    }
+    // the share of the group of this thread first, then those of the groups after it
+    size_type groups = group_count();
+    size_type own = is_worker() ? group_[current_index] : 0;
+    for (size_type k = 0; k < groups; k++) {
+        group_share &share = job.shares[(own + k) % groups];
+        while (true) {
+            size_type c = share.next.fetch_add(1);
+            if (c >= share.end) {
+                break;
+            }
+            run_chunk(job, c);
+        }
+    }
+}
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::run_chunk(chunk_job &job, size_type c) {
+    size_type n = job.end - job.begin;
+    size_type first = job.begin + n * c / job.chunks;
+    size_type last = job.begin + n * (c + 1) / job.chunks;
+    try {
+        job.call(job.fn, c, first, last);
+    } catch (...) {
+        Lock lk(job.m);
+        if (!job.error) {
+            job.error = std::current_exception();
+        }
+    }
+}
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::run_job(chunk_job &job) {
+    if (job.chunks == 0) {
+        return;
+    }
+    size_type groups = group_count();
+    if (groups > 1) {
+        job.shares = std::make_unique<group_share[]>(groups);
+        for (size_type g = 0; g < groups; g++) {
+            job.shares[g].next = job.chunks * group_start_[g] / size_;
+            job.shares[g].end = job.chunks * group_start_[g + 1] / size_;
+        }
+    }
+    // the caller takes a share of the chunks, so only chunks - 1 helpers can be useful; in a pool of
+    // several groups, a thread from outside would take chunks away from their node, so it only waits
+    bool caller_works = groups == 1 || is_worker();
+    size_type helpers = std::min(size_, caller_works ? job.chunks - 1 : job.chunks);
+    job.helpers = helpers;
+    for (size_type h = 0; h < helpers; h++) {
+        chunk_job *j = &job;  // a bare pointer fits in the std::function without allocating
+        bool scheduled = enqueue([j]() {
+            j->pool->work_on(*j);
+            Lock lk(j->m);
+            if (++j->finished == j->helpers) {
+                j->cv.notify_one();
+            }
+        });
+        if (!scheduled) {  // shut down: nobody will come
+            Lock lk(job.m);
+            job.helpers--;
+        }
+    }
+    if (caller_works || job.helpers == 0) {
+        work_on(job);
+    }
+    // helpers may still be inside their last chunk, and all of them reference job
+    if (is_worker() && mode_ == scheduling::work_stealing) {
+        // helpers still queued may be behind this thread in its own deque: run them rather than wait
+        while (true) {
+            {
+                Lock lk(job.m);
+                if (job.finished == job.helpers) {
+                    break;
+                }
+            }
+            if (!run_pending_task()) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    Lock lk(job.m);
+    job.cv.wait(lk, [&job] { return job.finished == job.helpers; });
+    if (job.error) {
+        std::rethrow_exception(job.error);
+    }
+}
+
+template <template <class> class Queue>
+bool basic_thread_pool<Queue>::schedule_stealing(std::function<void()> &&func) {
+    {
+        // counted under tpm_ so that shutdown cannot miss a task scheduled concurrently
+        Lock lk(tpm_);
+        if (state_ != 0) {
+            return false;
+        }
+        outstanding_++;
+    }
+    if (current_pool != this) {
+        queued_++;  // counted before the push, since a thread may take the task at once
+        if (injected_.try_push(std::move(func)) == task_queue::status::success) {
+            wake_one();
+            return true;
+        }
+        queued_--;
+    }
+    size_type i = current_pool == this ? current_index : next_deque_.fetch_add(1) % size_;
+    {
+        // counted under the deque lock, so no thread takes the task before it is counted
+        Lock lk(deques_[i].m);
+        deques_[i].tasks.push_back(std::move(func));
+        queued_++;
+    }
+    wake_one();
+    return true;
+}
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::wake_one() {
+    // A thread about to sleep increments sleepers_ before it checks
+    // queued_, and the scheduling thread incremented queued_ before
+    // checking sleepers_, so at least one of the two sees the other.
+    if (sleepers_ > 0) {
+        Lock lk(steal_m_);
+        steal_cv_.notify_one();
+    }
+}
+
+template <template <class> class Queue>
+bool basic_thread_pool<Queue>::take_task(size_type i, std::function<void()> &f) {
+    if (i < size_) {
+        Lock lk(deques_[i].m);
+        if (!deques_[i].tasks.empty()) {
+            f = std::move(deques_[i].tasks.back());
+            deques_[i].tasks.pop_back();
+            queued_--;
+            return true;
+        }
+    }
+    if (injected_.try_pop(f) == task_queue::status::success) {
+        queued_--;
+        return true;
+    }
+    for (size_type k = 1; k <= size_; k++) {
+        size_type j = (i + k) % size_;
+        if (j == i) {
+            continue;
+        }
+        task_deque &d = deques_[j];
+        Lock lk(d.m);
+        if (!d.tasks.empty()) {
+            f = std::move(d.tasks.front());
+            d.tasks.pop_front();
+            queued_--;
+            return true;
+        }
+    }
+    return false;
+}
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::run_task(std::function<void()> &f) {
+    f();
+    f = nullptr;  // release the captures before reporting the task as finished
+    if (--outstanding_ == 0) {
+        Lock lk(tpm_);
+        tpcv_.notify_all();
+    }
+}
+
+template <template <class> class Queue>
+bool basic_thread_pool<Queue>::is_worker() const { return current_pool == this; }
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::set_stats_enabled(bool enabled) {
+    if (stats_enabled_.exchange(enabled) != enabled) {  // the flag counts as one user
+        if (enabled) {
+            stats_users_++;
+        } else {
+            stats_users_--;
+        }
+    }
+}
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::retain_stats() { stats_users_++; }
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::release_stats() { stats_users_--; }
+
+template <template <class> class Queue>
+bool basic_thread_pool<Queue>::stats_enabled() const { return stats_users_ != 0; }
+
+template <template <class> class Queue>
+pool_stats basic_thread_pool<Queue>::stats() const {
+    pool_stats s;
+    s.tasks_scheduled = tasks_scheduled_.load(std::memory_order_relaxed);
+    s.queue_wait_ns = queue_wait_ns_.load(std::memory_order_relaxed);
+    return s;
+}
+
+template <template <class> class Queue>
+bool basic_thread_pool<Queue>::run_pending_task() {
+    if (mode_ != scheduling::work_stealing) {
+        return false;
+    }
+    std::function<void()> f;
+    if (!take_task(is_worker() ? current_index : size_, f)) {
+        return false;
+    }
+    run_task(f);
+    return true;
+}
+
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::steal_loop(size_type i) {
+    current_pool = this;
+    current_index = i;
+    std::function<void()> f;
+    while (true) {
+        if (take_task(i, f)) {
+            run_task(f);
+            continue;
+        }
+        Lock lk(steal_m_);
+        sleepers_++;
+        steal_cv_.wait(lk, [this] { return queued_ > 0 || stop_; });
+        sleepers_--;
+        if (stop_ && queued_ == 0) {
+            return;
+        }
+    }
+}
+
 // Tests if the thread pool has been shutdown.
 // This function is not thread safe.
-bool thread_pool::is_shutdown() const { return state_; }
+template <template <class> class Queue>
+bool basic_thread_pool<Queue>::is_shutdown() const { return state_; }
 
-void thread_pool::start_threads(size_type n) {
+template <template <class> class Queue>
+void basic_thread_pool<Queue>::start_threads(size_type n) {
 
     for (size_type i = 0; i < n; i++) {
 
@@ -183,5 +761,8 @@ void thread_pool::start_threads(size_type n) {
     // shutdown called
 }
 
+template class basic_thread_pool<queue>;
+template class basic_thread_pool<ring_queue>;
+
 // thread pool cond var
 }  // namespace ra::concurrency
\ No newline at end of file
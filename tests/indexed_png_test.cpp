@@ -0,0 +1,218 @@
+// Checks encode_indexed_png by decoding what it writes: the chunk CRCs,
+// the IHDR, the PLTE and tRNS chunks (tRNS cut after the last entry that
+// is not opaque, and left out for an opaque palette), and the indices of
+// every pixel, for palettes of 2, 3, 5, 17 and 256 colours (1, 2, 4 and 8
+// bits per index) and odd widths, with padded rows. A large image that
+// does not compress checks that the deflate stream is split over several
+// IDAT chunks.
+// Exits with 1 on the first mismatch.
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <zlib.h>
+
+#include "../include/ra/histogram.hpp"
+#include "../include/ra/indexed_png.hpp"
+
+using namespace ra::quantization;
+
+namespace {
+
+std::uint32_t get_u32_be(const std::uint8_t *p) {
+    return (std::uint32_t(p[0]) << 24) | (std::uint32_t(p[1]) << 16) | (std::uint32_t(p[2]) << 8) | std::uint32_t(p[3]);
+}
+
+// What decode_png reads back from a palette PNG.
+struct decoded_png {
+    std::uint32_t width = 0;
+    std::uint32_t height = 0;
+    int bits = 0;
+    std::vector<std::uint8_t> plte;
+    std::vector<std::uint8_t> trns;
+    std::vector<std::uint8_t> indices;  // width * height, row after row
+    std::vector<std::size_t> idat_sizes;
+};
+
+// Decodes a non-interlaced palette PNG into png, checking its layout on the way. Returns an
+// empty string, or what is wrong with the file.
+std::string decode_png(const std::vector<std::uint8_t> &file, decoded_png &png) {
+    const std::uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    if (file.size() < 8 || std::memcmp(file.data(), signature, 8) != 0) {
+        return "bad signature";
+    }
+    std::vector<std::uint8_t> stream;
+    std::vector<std::string> types;
+    for (std::size_t p = 8; p < file.size();) {
+        if (file.size() - p < 12) {
+            return "truncated chunk";
+        }
+        std::uint32_t size = get_u32_be(&file[p]);
+        if (file.size() - p - 12 < size) {
+            return "truncated chunk";
+        }
+        std::string type(reinterpret_cast<const char *>(&file[p + 4]), 4);
+        const std::uint8_t *data = &file[p + 8];
+        if (crc32(0, &file[p + 4], size + 4) != get_u32_be(data + size)) {
+            return "bad CRC in " + type;
+        }
+        types.push_back(type);
+        if (type == "IHDR") {
+            if (size != 13 || data[9] != 3 || data[10] != 0 || data[11] != 0 || data[12] != 0) {
+                return "not a non-interlaced palette IHDR";
+            }
+            png.width = get_u32_be(data);
+            png.height = get_u32_be(data + 4);
+            png.bits = data[8];
+        } else if (type == "PLTE") {
+            png.plte.assign(data, data + size);
+        } else if (type == "tRNS") {
+            png.trns.assign(data, data + size);
+        } else if (type == "IDAT") {
+            stream.insert(stream.end(), data, data + size);
+            png.idat_sizes.push_back(size);
+        }
+        p += 12 + size;
+    }
+    // IHDR first, PLTE and tRNS before the IDATs, which are consecutive, and IEND last
+    std::string order;
+    for (std::size_t i = 0; i < types.size(); i++) {
+        if (i == 0 || types[i] != "IDAT" || types[i - 1] != "IDAT") {
+            order += (order.empty() ? "" : " ") + types[i];
+        }
+    }
+    if (order != "IHDR PLTE IDAT IEND" && order != "IHDR PLTE tRNS IDAT IEND") {
+        return "unexpected chunks " + order;
+    }
+
+    std::size_t row_bytes = 1 + (std::size_t(png.width) * png.bits + 7) / 8;
+    std::vector<std::uint8_t> raw(row_bytes * png.height + 1);  // one spare byte catches a stream that is too long
+    uLongf raw_size = raw.size();
+    if (uncompress(raw.data(), &raw_size, stream.data(), stream.size()) != Z_OK || raw_size != row_bytes * png.height) {
+        return "the IDAT stream does not inflate to " + std::to_string(png.height) + " rows of " + std::to_string(row_bytes) + " bytes";
+    }
+    png.indices.clear();
+    for (std::uint32_t r = 0; r < png.height; r++) {
+        const std::uint8_t *row = &raw[r * row_bytes];
+        if (row[0] != 0) {
+            return "row " + std::to_string(r) + " has filter " + std::to_string(row[0]);
+        }
+        for (std::uint32_t c = 0; c < png.width; c++) {
+            std::size_t bit = std::size_t(c) * png.bits;
+            png.indices.push_back((row[1 + bit / 8] >> (8 - png.bits - bit % 8)) & ((1 << png.bits) - 1));
+        }
+        // the bits after the last pixel of a row are zero
+        std::size_t used = std::size_t(png.width) * png.bits;
+        if (used % 8 != 0 && (row[row_bytes - 1] & ((1 << (8 - used % 8)) - 1)) != 0) {
+            return "row " + std::to_string(r) + " has stray bits after its last pixel";
+        }
+    }
+    return "";
+}
+
+// Encodes random indices of an image of rows x cols into a palette of n colours, with every
+// entry opaque except those translucent returns true for, decodes the result and compares.
+// Returns false on a mismatch.
+template <class F>
+bool check(std::size_t n, int rows, int cols, bool bgr, int level, F translucent, std::mt19937 &rng, std::size_t min_idats = 1) {
+    std::uniform_int_distribution<int> byte(0, 255);
+    std::vector<std::uint32_t> palette(n);
+    for (std::size_t i = 0; i < n; i++) {
+        palette[i] = pack_colour(byte(rng), byte(rng), byte(rng), translucent(i) ? byte(rng) % 255 : 255);
+    }
+    std::size_t stride = cols + 5;  // padded rows
+    std::vector<std::uint8_t> pixels(stride * rows, 0xee);
+    std::uniform_int_distribution<std::size_t> index(0, n - 1);
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            // the last entry is always used, so the widest index is packed too
+            pixels[r * stride + c] = r == 0 && c == 0 ? n - 1 : index(rng);
+        }
+    }
+    const_image_view view(pixels.data(), rows, cols, 1, 8, stride);
+
+    std::string what = std::to_string(n) + " colours, " + std::to_string(rows) + " x " + std::to_string(cols) + (bgr ? ", bgr" : ", rgb") + ": ";
+    decoded_png png;
+    std::string error = decode_png(encode_indexed_png(view, palette, bgr, level), png);
+    if (!error.empty()) {
+        std::cerr << what << error << '\n';
+        return false;
+    }
+    int bits = n <= 2 ? 1 : n <= 4 ? 2 : n <= 16 ? 4 : 8;
+    if (png.width != std::uint32_t(cols) || png.height != std::uint32_t(rows) || png.bits != bits) {
+        std::cerr << what << "IHDR says " << png.height << " x " << png.width << " at " << png.bits << " bits\n";
+        return false;
+    }
+    std::vector<std::uint8_t> plte;
+    std::vector<std::uint8_t> trns;
+    for (std::size_t i = 0; i < n; i++) {
+        std::uint32_t c = palette[i];
+        int red = bgr ? 2 : 0;
+        plte.insert(plte.end(), {colour_channel(c, red), colour_channel(c, 1), colour_channel(c, 2 - red)});
+        trns.push_back(colour_channel(c, 3));
+    }
+    while (!trns.empty() && trns.back() == 255) {
+        trns.pop_back();
+    }
+    if (png.plte != plte || png.trns != trns) {
+        std::cerr << what << "PLTE or tRNS differs (tRNS of " << png.trns.size() << " entries, expected " << trns.size() << ")\n";
+        return false;
+    }
+    for (int r = 0; r < rows; r++) {
+        for (int c = 0; c < cols; c++) {
+            if (png.indices[std::size_t(r) * cols + c] != pixels[r * stride + c]) {
+                std::cerr << what << "pixel (" << r << ", " << c << ") decodes to index " << int(png.indices[std::size_t(r) * cols + c]) << ", not "
+                          << int(pixels[r * stride + c]) << '\n';
+                return false;
+            }
+        }
+    }
+    if (png.idat_sizes.size() < min_idats) {
+        std::cerr << what << png.idat_sizes.size() << " IDAT chunks, expected at least " << min_idats << '\n';
+        return false;
+    }
+    for (std::size_t i = 0; i + 1 < png.idat_sizes.size(); i++) {
+        if (png.idat_sizes[i] != 65536) {
+            std::cerr << what << "IDAT chunk " << i << " holds " << png.idat_sizes[i] << " bytes, not 64 KiB\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    std::mt19937 rng(4242);
+    int checks = 0;
+    auto opaque = [](std::size_t) { return false; };
+    auto all = [](std::size_t) { return true; };
+    for (std::size_t n : {2, 3, 5, 17, 256}) {
+        auto second = [](std::size_t i) { return i == 1; };            // tRNS stops after entry 1
+        auto last = [n](std::size_t i) { return i == n - 1; };         // tRNS covers the palette
+        auto even = [n](std::size_t i) { return i % 2 == 0 && i + 1 < n; };  // the last entry is opaque
+        for (int cols : {1, 3, 7, 9, 13, 101}) {
+            for (int rows : {1, 5}) {
+                for (bool bgr : {true, false}) {
+                    if (!check(n, rows, cols, bgr, 6, opaque, rng) || !check(n, rows, cols, bgr, 6, all, rng) ||
+                        !check(n, rows, cols, bgr, 6, second, rng) || !check(n, rows, cols, bgr, 6, last, rng) ||
+                        !check(n, rows, cols, bgr, 6, even, rng)) {
+                        return 1;
+                    }
+                    checks += 5;
+                }
+            }
+        }
+    }
+    // random 8-bit indices stored without compression take about 4 IDAT chunks
+    if (!check(256, 513, 511, true, 0, all, rng, 4)) {
+        return 1;
+    }
+    checks++;
+    std::cout << checks << " checks passed\n";
+    return 0;
+}
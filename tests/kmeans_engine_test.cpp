@@ -0,0 +1,129 @@
+// Checks that the Hamerly engine gives the same result as the naive one:
+// started from the same centers, both must run the same number of
+// iterations with the same distortion in each, and end with the same
+// palette and the same assignment of every colour. The histograms include
+// evenly spaced colours, which lie exactly halfway between centers, and
+// repeated centers, so ties are decided the same way by both.
+// Exits with 1 on the first mismatch.
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "../include/ra/quantization_tools.hpp"
+
+using namespace ra::quantization;
+
+namespace {
+
+// Returns a histogram of the given colours, with random pixel counts.
+colour_histogram make_histogram(const std::set<std::uint32_t> &colours, int channels, std::mt19937 &rng) {
+    std::uniform_int_distribution<int> count(1, 1000);
+    colour_histogram hist;
+    hist.channels = channels;
+    for (std::uint32_t c : colours) {
+        hist.colours.push_back(c);
+        hist.counts.push_back(count(rng));
+    }
+    return hist;
+}
+
+// Clusters hist with engine, recording the distortion of every iteration into distortion.
+clustering run(thread_pool &tp, const colour_histogram &hist, int k, quantize_options options, kmeans_engine engine,
+               std::vector<std::uint64_t> &distortion) {
+    stats_recorder recorder;
+    options.engine = engine;
+    options.observer = &recorder;
+    clustering result = cluster_colours(tp, hist, k, options);
+    distortion = recorder.runs.empty() ? std::vector<std::uint64_t>() : recorder.runs.back().distortion;
+    return result;
+}
+
+// Compares both engines on hist; returns false on a mismatch.
+bool check(thread_pool &tp, const std::string &name, const colour_histogram &hist, int k, const quantize_options &options) {
+    std::vector<std::uint64_t> naive_distortion;
+    std::vector<std::uint64_t> hamerly_distortion;
+    clustering naive = run(tp, hist, k, options, kmeans_engine::naive, naive_distortion);
+    clustering hamerly = run(tp, hist, k, options, kmeans_engine::hamerly, hamerly_distortion);
+    const char *what = nullptr;
+    if (naive.iterations != hamerly.iterations) {
+        what = "iterations";
+    } else if (naive_distortion != hamerly_distortion) {
+        what = "distortion";
+    } else if (naive.palette != hamerly.palette) {
+        what = "palette";
+    } else if (naive.assignment != hamerly.assignment) {
+        what = "assignment";
+    }
+    if (what != nullptr) {
+        std::cerr << name << ", k = " << k << ", seed " << options.seed << ": the engines differ in their " << what << " (" << naive.iterations
+                  << " and " << hamerly.iterations << " iterations)\n";
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    thread_pool tp(4);
+    std::mt19937 rng(2024);
+    std::uniform_int_distribution<int> byte(0, 255);
+    int checks = 0;
+
+    std::set<std::uint32_t> random_colours;
+    while (random_colours.size() < 5000) {
+        random_colours.insert(pack_colour(byte(rng), byte(rng), byte(rng), byte(rng)));
+    }
+    std::set<std::uint32_t> grey; // every grey level: neighbouring centers often have a colour halfway
+    for (int v = 0; v < 256; v++) {
+        grey.insert(pack_colour(v, v, v, 255));
+    }
+    std::set<std::uint32_t> lattice; // evenly spaced colours, equidistant from many centers
+    for (int r = 0; r < 256; r += 16) {
+        for (int g = 0; g < 256; g += 16) {
+            lattice.insert(pack_colour(r, g, 128, 255));
+        }
+    }
+    struct test_histogram {
+        std::string name;
+        colour_histogram hist;
+    };
+    std::vector<test_histogram> histograms = {
+        {"random", make_histogram(random_colours, 4, rng)},
+        {"grey", make_histogram(grey, 1, rng)},
+        {"lattice", make_histogram(lattice, 3, rng)},
+    };
+
+    for (const test_histogram &h : histograms) {
+        for (int k : {2, 5, 16, 33}) {
+            for (std::uint64_t seed : {0, 1, 2}) {
+                for (seeding_method seeding : {seeding_method::kmeans_pp, seeding_method::kmeans_parallel}) {
+                    quantize_options options;
+                    options.seed = seed;
+                    options.seeding = seeding;
+                    if (!check(tp, h.name, h.hist, k, options)) {
+                        return 1;
+                    }
+                    checks++;
+                }
+            }
+        }
+        // repeated centers: both copies are equally near to every colour, so the lower index wins
+        quantize_options options;
+        for (int j = 0; j < 8; j++) {
+            options.initial_palette.push_back(h.hist.colours[j * 3 % h.hist.size()]);
+        }
+        options.initial_palette[5] = options.initial_palette[1];
+        options.initial_palette[7] = options.initial_palette[1];
+        if (!check(tp, h.name + " with repeated centers", h.hist, 8, options)) {
+            return 1;
+        }
+        checks++;
+    }
+    std::cout << checks << " checks passed\n";
+    return 0;
+}
@@ -0,0 +1,126 @@
+// Checks nearest_centers and nearest_two_centers at every instruction set
+// the running CPU supports against a brute-force search, for grey, opaque
+// and translucent colours, with tied centers and numbers of centers that
+// are not a multiple of the SIMD width or of center_soa::block.
+// Exits with 1 on the first mismatch.
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../include/ra/nearest_center.hpp"
+
+using namespace ra::quantization;
+
+namespace {
+
+std::uint32_t pack(int c0, int c1, int c2, int c3) { return std::uint32_t(c0) | (std::uint32_t(c1) << 8) | (std::uint32_t(c2) << 16) | (std::uint32_t(c3) << 24); }
+
+int channel(std::uint32_t colour, int c) { return (colour >> (8 * c)) & 0xff; }
+
+std::uint32_t distance(std::uint32_t a, std::uint32_t b) {
+    std::uint32_t d = 0;
+    for (int c = 0; c < 4; c++) {
+        int x = channel(a, c) - channel(b, c);
+        d += x * x;
+    }
+    return d;
+}
+
+// Returns a random colour of the given layout (see center_soa::set_colour_channels).
+std::uint32_t random_colour(std::mt19937 &rng, int channels) {
+    std::uniform_int_distribution<int> byte(0, 255);
+    if (channels == 1) {
+        int v = byte(rng);
+        return pack(v, v, v, 255);
+    }
+    return pack(byte(rng), byte(rng), byte(rng), channels == 3 ? 255 : byte(rng));
+}
+
+const char *level_name(simd_level level) {
+    switch (level) {
+        case simd_level::avx2:
+            return "avx2";
+        case simd_level::sse41:
+            return "sse4.1";
+        default:
+            return "scalar";
+    }
+}
+
+// Compares both kernels at level with the brute force on k centers; returns false on a mismatch.
+bool check(simd_level level, int channels, std::size_t k, std::mt19937 &rng) {
+    std::vector<std::uint32_t> palette(k);
+    for (std::size_t j = 0; j < k; j++) {
+        // every third center repeats an earlier one, so ties must go to the lower index
+        palette[j] = j >= 3 && j % 3 == 0 ? palette[j / 2] : random_colour(rng, channels);
+    }
+    center_soa centers;
+    centers.set_colour_channels(channels);
+    centers.resize(k);
+    for (std::size_t j = 0; j < k; j++) {
+        centers.set(j, channel(palette[j], 0), channel(palette[j], 1), channel(palette[j], 2), channel(palette[j], 3));
+    }
+
+    std::vector<std::uint32_t> colours(1000);
+    for (std::size_t i = 0; i < colours.size(); i++) {
+        // some colours sit exactly on a center, and n is not a multiple of the width either
+        colours[i] = i % 7 == 0 ? palette[i % k] : random_colour(rng, channels);
+    }
+    colours.resize(colours.size() - k % 5);
+    std::size_t n = colours.size();
+    std::vector<std::uint32_t> index(n), dist(n), index2(n), dist2(n), second(n);
+    nearest_centers(level, centers, colours.data(), n, index.data(), dist.data());
+    nearest_two_centers(level, centers, colours.data(), n, index2.data(), dist2.data(), second.data());
+
+    for (std::size_t i = 0; i < n; i++) {
+        std::uint32_t best = 0;
+        std::uint32_t best_dist = UINT32_MAX;
+        std::uint32_t second_dist = UINT32_MAX;
+        for (std::size_t j = 0; j < k; j++) {
+            std::uint32_t d = distance(colours[i], palette[j]);
+            if (d < best_dist) {
+                second_dist = best_dist;
+                best = j;
+                best_dist = d;
+            } else if (d < second_dist) {
+                second_dist = d;
+            }
+        }
+        if (index[i] != best || dist[i] != best_dist || index2[i] != best || dist2[i] != best_dist || second[i] != second_dist) {
+            std::cerr << level_name(level) << ", " << channels << " channels, k = " << k << ": colour " << i << " got center " << index[i] << " ("
+                      << dist[i] << "), two-center " << index2[i] << " (" << dist2[i] << ", " << second[i] << "), expected " << best << " ("
+                      << best_dist << ", " << second_dist << ")\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    std::vector<simd_level> levels = {simd_level::scalar};
+    simd_level best = detect_simd_level();
+    if (best >= simd_level::sse41) {
+        levels.push_back(simd_level::sse41);
+    }
+    if (best >= simd_level::avx2) {
+        levels.push_back(simd_level::avx2);
+    }
+    std::mt19937 rng(12345);
+    int checks = 0;
+    for (simd_level level : levels) {
+        for (int channels : {1, 3, 4}) {
+            for (std::size_t k : {1, 2, 3, 5, 7, 8, 9, 15, 16, 17, 23, 31, 32, 33, 100, 256}) {
+                if (!check(level, channels, k, rng)) {
+                    return 1;
+                }
+                checks++;
+            }
+        }
+    }
+    std::cout << checks << " checks passed (best instruction set: " << level_name(best) << ")\n";
+    return 0;
+}
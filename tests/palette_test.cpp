@@ -0,0 +1,140 @@
+// Checks save_palette and load_palette: palettes of several sizes come
+// back unchanged, the file has the documented little-endian layout, and
+// missing, empty, truncated, mislabelled and empty-palette files are
+// refused with std::runtime_error.
+// Exits with 1 on the first failure.
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../include/ra/palette.hpp"
+
+using namespace ra::quantization;
+
+namespace {
+
+std::vector<char> read_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+void write_file(const std::string &path, const std::vector<char> &bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(bytes.data(), bytes.size());
+}
+
+// Returns true if load_palette(path) throws std::runtime_error.
+bool refused(const std::string &path) {
+    try {
+        load_palette(path);
+    } catch (const std::runtime_error &) {
+        return true;
+    }
+    return false;
+}
+
+bool fail(const std::string &what) {
+    std::cerr << what << '\n';
+    return false;
+}
+
+bool check_round_trip(const std::string &path) {
+    std::mt19937 rng(99);
+    for (std::size_t n : {1, 2, 3, 16, 256, 1000}) {
+        std::vector<std::uint32_t> palette(n);
+        for (std::uint32_t &c : palette) {
+            c = rng();
+        }
+        palette[0] = n % 2 == 0 ? 0 : 0xffffffff;
+        save_palette(path, palette);
+        if (load_palette(path) != palette) {
+            return fail("a palette of " + std::to_string(n) + " colours does not load back unchanged");
+        }
+        if (read_file(path).size() != 12 + 4 * n) {
+            return fail("the file of a palette of " + std::to_string(n) + " colours has the wrong size");
+        }
+    }
+    // the layout is fixed: magic, version, count and colours, little-endian
+    save_palette(path, {0x04030201, 0xa0b0c0d0});
+    std::vector<char> expected = {'R', 'A', 'P', 'L', 1, 0, 0, 0, 2, 0, 0, 0, 1, 2, 3, 4, char(0xd0), char(0xc0), char(0xb0), char(0xa0)};
+    if (read_file(path) != expected) {
+        return fail("the file does not have the documented layout");
+    }
+    return true;
+}
+
+bool check_bad_files(const std::string &path) {
+    std::filesystem::remove(path);
+    if (!refused(path)) {
+        return fail("a missing file is accepted");
+    }
+    save_palette(path, {0x11223344, 0x55667788, 0x99aabbcc});
+    std::vector<char> good = read_file(path);
+    // every proper prefix of a good file, the empty file included, is refused
+    for (std::size_t size = 0; size < good.size(); size++) {
+        write_file(path, std::vector<char>(good.begin(), good.begin() + size));
+        if (!refused(path)) {
+            return fail("a file cut to " + std::to_string(size) + " of " + std::to_string(good.size()) + " bytes is accepted");
+        }
+    }
+    for (int byte = 0; byte < 4; byte++) {
+        std::vector<char> bad = good;
+        bad[byte] ^= 0x20;
+        write_file(path, bad);
+        if (!refused(path)) {
+            return fail("a file with magic byte " + std::to_string(byte) + " changed is accepted");
+        }
+    }
+    std::vector<char> png = {char(0x89), 'P', 'N', 'G', '\r', '\n', 0x1a, '\n', 0, 0, 0, 13};
+    write_file(path, png);
+    if (!refused(path)) {
+        return fail("a PNG file is accepted");
+    }
+    std::vector<char> version = good;
+    version[4] = 2;
+    write_file(path, version);
+    if (!refused(path)) {
+        return fail("a file of another version is accepted");
+    }
+    std::vector<char> empty(good.begin(), good.begin() + 12);
+    empty[8] = 0;
+    write_file(path, empty);
+    if (!refused(path)) {
+        return fail("a palette of no colours is accepted");
+    }
+    std::vector<char> longer = good;
+    longer[8] = 4; // one colour more than the file holds
+    write_file(path, longer);
+    if (!refused(path)) {
+        return fail("a file holding fewer colours than its count is accepted");
+    }
+    std::vector<char> huge = good;
+    huge[8] = huge[9] = huge[10] = huge[11] = char(0xff); // must be refused, not allocated for
+    write_file(path, huge);
+    if (!refused(path)) {
+        return fail("a file with a count of 2^32 - 1 colours is accepted");
+    }
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    std::string path = (std::filesystem::temp_directory_path() / ("palette_test_" + std::to_string(::getpid()) + ".rapl")).string();
+    bool ok = check_round_trip(path) && check_bad_files(path);
+    std::filesystem::remove(path);
+    if (!ok) {
+        return 1;
+    }
+    std::cout << "palette files passed\n";
+    return 0;
+}
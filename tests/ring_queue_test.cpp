@@ -0,0 +1,218 @@
+// Checks ring_queue, and queue alongside it since the two share an
+// interface: several producers and consumers with every item delivered
+// exactly once and in the order of its producer, a capacity of 1,
+// try_push and try_pop reporting a full and an empty queue, and close
+// waking pushers and poppers that are blocked.
+// Exits with 1 on the first failure.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../include/ra/queue.hpp"
+#include "../include/ra/ring_queue.hpp"
+
+using namespace ra::concurrency;
+
+namespace {
+
+// Prints what failed and returns false.
+bool fail(const std::string &name, const std::string &what) {
+    std::cerr << name << ": " << what << '\n';
+    return false;
+}
+
+// Runs fn on a thread of its own and returns once it has returned. A call
+// that is still blocked after 10 seconds ends the test, since the thread
+// cannot be stopped.
+template <class F>
+void finish_or_exit(const std::string &name, const std::string &what, F fn) {
+    std::atomic<bool> done{false};
+    std::thread t([&] {
+        fn();
+        done = true;
+    });
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (!done && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (!done) {
+        fail(name, what + " is still blocked");
+        std::_Exit(1);
+    }
+    t.join();
+}
+
+// producers threads push items, consumers threads pop them until the queue is closed; every item
+// must come out exactly once, and the items of one producer in the order they went in.
+template <template <class> class Q>
+bool check_exactly_once(const std::string &name, std::size_t capacity, int producers, int consumers) {
+    using status = typename Q<std::uint64_t>::status;
+    const std::uint64_t items = 5000; // per producer
+    Q<std::uint64_t> q(capacity);
+    std::vector<std::atomic<int>> seen(producers * items);
+    std::atomic<int> errors{0};
+    std::vector<std::thread> threads;
+    for (int p = 0; p < producers; p++) {
+        threads.emplace_back([&, p] {
+            for (std::uint64_t i = 0; i < items; i++) {
+                std::uint64_t x = p * items + i;
+                if (q.push(std::move(x)) != status::success) {
+                    errors++;
+                }
+            }
+        });
+    }
+    for (int c = 0; c < consumers; c++) {
+        threads.emplace_back([&] {
+            std::vector<std::int64_t> last(producers, -1);
+            std::uint64_t x;
+            while (q.pop(x) == status::success) {
+                int p = x / items;
+                std::int64_t i = x % items;
+                if (i <= last[p]) {
+                    errors++; // out of order
+                }
+                last[p] = i;
+                seen[x]++;
+            }
+        });
+    }
+    for (int p = 0; p < producers; p++) {
+        threads[p].join();
+    }
+    q.close(); // the consumers still drain what is left
+    for (int c = 0; c < consumers; c++) {
+        threads[producers + c].join();
+    }
+    std::string what = std::to_string(producers) + " producers, " + std::to_string(consumers) + " consumers, capacity " + std::to_string(capacity);
+    if (errors != 0) {
+        return fail(name, what + ": a push failed or items came out of order");
+    }
+    for (std::size_t i = 0; i < seen.size(); i++) {
+        if (seen[i] != 1) {
+            return fail(name, what + ": item " + std::to_string(i) + " delivered " + std::to_string(seen[i]) + " times");
+        }
+    }
+    return true;
+}
+
+// try_push and try_pop on a queue of the given capacity: full once it holds capacity items (with
+// the rejected item left alone), empty once they are all out, and closed after close.
+template <template <class> class Q>
+bool check_try(const std::string &name, std::size_t capacity) {
+    using status = typename Q<std::string>::status;
+    Q<std::string> q(capacity);
+    std::string x;
+    if (q.try_pop(x) != status::empty || !q.is_empty()) {
+        return fail(name, "try_pop on a new queue is not empty");
+    }
+    for (std::size_t i = 0; i < capacity; i++) {
+        std::string item = std::to_string(i);
+        if (q.try_push(std::move(item)) != status::success) {
+            return fail(name, "try_push " + std::to_string(i) + " of capacity " + std::to_string(capacity) + " failed");
+        }
+    }
+    std::string extra = "extra";
+    if (q.try_push(std::move(extra)) != status::full || extra != "extra" || !q.is_full()) {
+        return fail(name, "try_push on a full queue of capacity " + std::to_string(capacity) + " is not full");
+    }
+    for (std::size_t i = 0; i < capacity; i++) {
+        if (q.try_pop(x) != status::success || x != std::to_string(i)) {
+            return fail(name, "try_pop " + std::to_string(i) + " of capacity " + std::to_string(capacity) + " failed");
+        }
+    }
+    if (q.try_pop(x) != status::empty) {
+        return fail(name, "try_pop on an emptied queue is not empty");
+    }
+    // a queue that goes round several times keeps working
+    for (int lap = 0; lap < 3; lap++) {
+        for (std::size_t i = 0; i < capacity; i++) {
+            std::string item = std::to_string(lap) + "." + std::to_string(i);
+            q.try_push(std::move(item));
+        }
+        for (std::size_t i = 0; i < capacity; i++) {
+            if (q.try_pop(x) != status::success || x != std::to_string(lap) + "." + std::to_string(i)) {
+                return fail(name, "try_pop in lap " + std::to_string(lap) + " failed");
+            }
+        }
+    }
+    std::string last = "last";
+    q.try_push(std::move(last));
+    q.close();
+    std::string late = "late";
+    if (q.try_push(std::move(late)) != status::closed) {
+        return fail(name, "try_push on a closed queue is not closed");
+    }
+    if (q.try_pop(x) != status::success || x != "last" || q.try_pop(x) != status::closed) {
+        return fail(name, "a closed queue does not give out what it holds, then closed");
+    }
+    return true;
+}
+
+// close wakes a pusher blocked on a full queue and a popper blocked on an empty one.
+template <template <class> class Q>
+bool check_close_wakes(const std::string &name) {
+    using status = typename Q<int>::status;
+    std::vector<status> results(4, status::success);
+    {
+        Q<int> full(1);
+        full.push(0);
+        Q<int> empty(1);
+        finish_or_exit(name, "close", [&] {
+            std::thread pusher1([&] { results[0] = full.push(1); });
+            std::thread pusher2([&] { results[1] = full.push(2); });
+            std::thread popper1([&] {
+                int x;
+                results[2] = empty.pop(x);
+            });
+            std::thread popper2([&] {
+                int x;
+                results[3] = empty.pop(x);
+            });
+            std::this_thread::sleep_for(std::chrono::milliseconds(50)); // let them block
+            full.close();
+            empty.close();
+            pusher1.join();
+            pusher2.join();
+            popper1.join();
+            popper2.join();
+        });
+    }
+    for (status s : results) {
+        if (s != status::closed) {
+            return fail(name, "a blocked push or pop woken by close did not return closed");
+        }
+    }
+    return true;
+}
+
+template <template <class> class Q>
+bool check_queue(const std::string &name) {
+    for (std::size_t capacity : {1, 2, 3, 64}) {
+        if (!check_try<Q>(name, capacity)) {
+            return false;
+        }
+        for (int threads : {1, 2, 4}) {
+            if (!check_exactly_once<Q>(name, capacity, threads, threads) || !check_exactly_once<Q>(name, capacity, threads, 5 - threads)) {
+                return false;
+            }
+        }
+    }
+    return check_close_wakes<Q>(name);
+}
+
+}  // namespace
+
+int main() {
+    if (!check_queue<ring_queue>("ring_queue") || !check_queue<queue>("queue")) {
+        return 1;
+    }
+    std::cout << "ring_queue and queue passed\n";
+    return 0;
+}